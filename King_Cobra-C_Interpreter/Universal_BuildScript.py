@@ -44,7 +44,7 @@ def main():
 
 	gcc = "gcc"
 	outputFileName = "Interpreter_Program"
-	tags = "-Wall -O2"
+	tags = "-Wall -O2 -fno-crossjumping -lpthread"
 
 	try:
 		# For Windows Users:
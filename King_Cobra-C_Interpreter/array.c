@@ -0,0 +1,71 @@
+#include "array.h"
+#include "vm.h"
+
+/**
+ * Returns the index that value names in array, or -1 after reporting why it doesn't.
+*/
+static int arrayIndex(ObjArray* array, Value value) {
+    if (!IS_NUMBER(value)) {
+        runtimeError("Array index must be a number.");
+        return -1;
+    }
+    double index = AS_NUMBER(value);
+    if (!(index >= 0 && index < array->count)) {
+        runtimeError("Array index %g is out of bounds for length %d.", index, array->count);
+        return -1;
+    }
+    if (index != (int)index) {
+        runtimeError("Array index must be a whole number.");
+        return -1;
+    }
+    return (int)index;
+}
+
+Value arrayNative(int argCount, Value* args) {
+    if (argCount < 1 || argCount > 2 || !IS_NUMBER(args[0]) || (argCount == 2 && !IS_NUMBER(args[1]))) {
+        runtimeError("array() takes a length and an optional number to fill it with.");
+        return UNDEFINED_VAL;
+    }
+    double length = AS_NUMBER(args[0]);
+    if (!(length >= 0 && length <= ARRAY_MAX) || length != (int)length) {
+        runtimeError("Array length must be a whole number between 0 and %d.", ARRAY_MAX);
+        return UNDEFINED_VAL;
+    }
+
+    ObjArray* array = newArray((int)length);
+    if (argCount == 2) {
+        double fill = AS_NUMBER(args[1]);
+        for (int i = 0; i < array->count; i++) {
+            array->numbers[i] = fill;
+        }
+    }
+    return OBJ_VAL(array);
+}
+
+Value getNative(int argCount, Value* args) {
+    if (argCount != 2 || !IS_ARRAY(args[0])) {
+        runtimeError("get() takes an array and an index.");
+        return UNDEFINED_VAL;
+    }
+    int index = arrayIndex(AS_ARRAY(args[0]), args[1]);
+    return index == -1 ? UNDEFINED_VAL : NUMBER_VAL(AS_ARRAY(args[0])->numbers[index]);
+}
+
+Value setNative(int argCount, Value* args) {
+    if (argCount != 3 || !IS_ARRAY(args[0]) || !IS_NUMBER(args[2])) {
+        runtimeError("set() takes an array, an index and a number.");
+        return UNDEFINED_VAL;
+    }
+    int index = arrayIndex(AS_ARRAY(args[0]), args[1]);
+    if (index == -1) return UNDEFINED_VAL;
+    AS_ARRAY(args[0])->numbers[index] = AS_NUMBER(args[2]);
+    return args[2];
+}
+
+Value lengthNative(int argCount, Value* args) {
+    if (argCount != 1 || !IS_ARRAY(args[0])) {
+        runtimeError("length() takes an array.");
+        return UNDEFINED_VAL;
+    }
+    return NUMBER_VAL(AS_ARRAY(args[0])->count);
+}
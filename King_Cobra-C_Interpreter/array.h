@@ -0,0 +1,19 @@
+#ifndef kc_array_h
+#define kc_array_h
+
+#include "object.h"
+
+/**
+ * Numeric arrays. array(length, fill) makes an array of length numbers, all fill (0 if
+ * left out); get(array, index), set(array, index, number) and length(array) work on it.
+ * parallelMap() and parallelReduce() (scheduler.h) run kernels over arrays.
+ * Lengths are limited to what heap images can hold.
+*/
+#define ARRAY_MAX INSTR_ARG_MAX
+
+Value arrayNative(int argCount, Value* args);
+Value getNative(int argCount, Value* args);
+Value setNative(int argCount, Value* args);
+Value lengthNative(int argCount, Value* args);
+
+#endif
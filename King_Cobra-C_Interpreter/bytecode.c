@@ -0,0 +1,661 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "bytecode.h"
+#include "memory.h"
+#include "regcompiler.h"
+#include "vm.h"
+
+// Files are mapped into memory where the platform has mmap, and read into a buffer otherwise.
+#if defined(__unix__) || defined(__APPLE__)
+#define BYTECODE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/**
+ * Layout of a bytecode file. Everything is a 32-bit word in the byte order of the machine
+ * that wrote it, and string bytes are padded to a whole number of words:
+ *
+ *   header:    magic, BYTECODE_VERSION, source hash (two words, low half first),
+ *              checksum of everything after it (two words), global count, then
+ *              the name of every global slot as a string
+ *   function:  arity, upvalue count, maxStack, name (length -1 for the script),
+ *              code count, code words, line run count, (offset, line) per run,
+ *              inline cache count, constant count, then each constant as a tag
+ *              followed by a number (two words), a string or a nested function
+ *   string:    length, bytes
+ *
+ * Global operands refer to the slots of the VM that wrote the file, which is why the
+ * header lists their names. The loader maps each one to the slot of the running VM.
+ * The checksum is the same hash as the source's, taken over the bytes that follow it.
+*/
+#define BYTECODE_MAGIC 0x0043434b  // "KCC\0" when written little-endian
+#define CHECKSUM_OFFSET (4 * sizeof(uint32_t))
+#define PAYLOAD_OFFSET (6 * sizeof(uint32_t))
+
+typedef enum {
+    CONSTANT_NUMBER,
+    CONSTANT_STRING,
+    CONSTANT_FUNCTION
+} ConstantTag;
+
+static uint32_t padding[1] = {0};
+
+/**
+ * Returns the hash that a bytecode file records for the given source text.
+ * This is the 64-bit FNV-1a hash, the wide version of hashString() in object.c.
+*/
+uint64_t hashSource(const char* source, size_t length) {
+    uint64_t hash = 14695981039346656037u;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (uint8_t)source[i];
+        hash *= 1099511628211u;
+    }
+    return hash;
+}
+
+void initByteBuffer(ByteBuffer* buffer) {
+    buffer->bytes = NULL;
+    buffer->count = 0;
+    buffer->capacity = 0;
+}
+
+void freeByteBuffer(ByteBuffer* buffer) {
+    free(buffer->bytes);
+    initByteBuffer(buffer);
+}
+
+void writeBytes(ByteBuffer* buffer, const void* bytes, size_t count) {
+    if (buffer->capacity < buffer->count + count) {
+        size_t capacity = buffer->capacity < 256 ? 256 : buffer->capacity;
+        while (capacity < buffer->count + count) capacity *= 2;
+        uint8_t* grown = (uint8_t*)realloc(buffer->bytes, capacity);
+        if (grown == NULL) exit(1);
+        buffer->bytes = grown;
+        buffer->capacity = capacity;
+    }
+    memcpy(buffer->bytes + buffer->count, bytes, count);
+    buffer->count += count;
+}
+
+void writeWord(ByteBuffer* buffer, uint32_t word) {
+    writeBytes(buffer, &word, sizeof(uint32_t));
+}
+
+void writeNumber(ByteBuffer* buffer, double number) {
+    writeBytes(buffer, &number, sizeof(double));
+}
+
+void writeString(ByteBuffer* buffer, const char* chars, int length) {
+    writeWord(buffer, (uint32_t)length);
+    writeBytes(buffer, chars, length);
+    writeBytes(buffer, padding, (4 - length % 4) % 4);
+}
+
+/**
+ * Writes the buffer to path. It is written under a temporary name and renamed into place
+ * once it is complete, so that an interrupted write or another process reading the same
+ * file never sees half of it. Returns false, leaving no file behind, if that fails.
+*/
+bool writeByteBufferFile(ByteBuffer* buffer, const char* path) {
+    size_t length = strlen(path);
+    char* tempPath = (char*)malloc(length + 5);
+    if (tempPath == NULL) return false;
+    memcpy(tempPath, path, length);
+    memcpy(tempPath + length, ".tmp", 5);
+
+    bool written = false;
+    FILE* file = fopen(tempPath, "wb");
+    if (file != NULL) {
+        written = fwrite(buffer->bytes, 1, buffer->count, file) == buffer->count;
+        written = fclose(file) == 0 && written;
+        if (written) written = rename(tempPath, path) == 0;
+        if (!written) remove(tempPath);
+    }
+
+    free(tempPath);
+    return written;
+}
+
+/**
+ * Writes the name of every global slot, so that a reader can map the slot operands
+ * of the code that follows to its own slots (see readGlobalNames()).
+*/
+void writeGlobalNames(ByteBuffer* buffer) {
+    writeWord(buffer, (uint32_t)vm.globalNames.count);
+    for (int i = 0; i < vm.globalNames.count; i++) {
+        writeString(buffer, GLOBAL_NAME(i)->chars, GLOBAL_NAME(i)->length);
+    }
+}
+
+/**
+ * Writes the code of a chunk with its line runs and the number of inline caches it uses.
+ * Instructions that run() has quickened are written in their generic form, since the
+ * register translator only knows those and the file must not depend on what ran.
+*/
+void writeCode(ByteBuffer* buffer, Chunk* chunk) {
+    writeWord(buffer, (uint32_t)chunk->count);
+    int offset = 0;
+    while (offset < chunk->count) {
+        int length = instructionLength(chunk, offset);
+        writeWord(buffer, genericInstruction(chunk->code[offset]));
+        writeBytes(buffer, chunk->code + offset + 1, sizeof(uint32_t) * (length - 1));
+        offset += length;
+    }
+
+    writeWord(buffer, (uint32_t)chunk->lines.count);
+    for (int i = 0; i < chunk->lines.count; i++) {
+        writeWord(buffer, (uint32_t)chunk->lines.starts[i].offset);
+        writeWord(buffer, (uint32_t)chunk->lines.starts[i].line);
+    }
+    writeWord(buffer, (uint32_t)chunk->cacheCount);
+}
+
+/**
+ * Writes one function and, through its constants, every function nested in it.
+ * Returns false if a constant is of a kind that bytecode files cannot hold.
+*/
+static bool writeFunction(ByteBuffer* buffer, ObjFunction* function) {
+    Chunk* chunk = &function->chunk;
+    writeWord(buffer, (uint32_t)function->arity);
+    writeWord(buffer, (uint32_t)function->upvalueCount);
+    writeWord(buffer, (uint32_t)function->maxStack);
+    if (function->name == NULL) {
+        writeWord(buffer, (uint32_t)-1);
+    }
+    else {
+        writeString(buffer, function->name->chars, function->name->length);
+    }
+
+    writeCode(buffer, chunk);
+
+    writeWord(buffer, (uint32_t)chunk->constants.count);
+    for (int i = 0; i < chunk->constants.count; i++) {
+        Value constant = chunk->constants.values[i];
+        if (IS_NUMBER(constant)) {
+            writeWord(buffer, CONSTANT_NUMBER);
+            writeNumber(buffer, AS_NUMBER(constant));
+        }
+        else if (IS_STRING(constant)) {
+            writeWord(buffer, CONSTANT_STRING);
+            writeString(buffer, AS_STRING(constant)->chars, AS_STRING(constant)->length);
+        }
+        else if (IS_FUNCTION(constant)) {
+            writeWord(buffer, CONSTANT_FUNCTION);
+            if (!writeFunction(buffer, AS_FUNCTION(constant))) return false;
+        }
+        else {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Serializes the function tree that compile() returned to path, along with sourceHash.
+ * Returns false if the file could not be written, which leaves no file behind.
+*/
+bool writeBytecodeFile(const char* path, ObjFunction* function, uint64_t sourceHash) {
+    ByteBuffer buffer;
+    initByteBuffer(&buffer);
+    writeWord(&buffer, BYTECODE_MAGIC);
+    writeWord(&buffer, BYTECODE_VERSION);
+    writeWord(&buffer, (uint32_t)sourceHash);
+    writeWord(&buffer, (uint32_t)(sourceHash >> 32));
+    // The checksum is filled in once the rest is written.
+    writeWord(&buffer, 0);
+    writeWord(&buffer, 0);
+    writeGlobalNames(&buffer);
+
+    bool written = writeFunction(&buffer, function);
+    if (written) {
+        uint64_t checksum = hashSource((const char*)buffer.bytes + PAYLOAD_OFFSET, buffer.count - PAYLOAD_OFFSET);
+        uint32_t words[2] = {(uint32_t)checksum, (uint32_t)(checksum >> 32)};
+        memcpy(buffer.bytes + CHECKSUM_OFFSET, words, sizeof(words));
+        written = writeByteBufferFile(&buffer, path);
+    }
+    freeByteBuffer(&buffer);
+    return written;
+}
+
+void initReader(Reader* reader, const uint8_t* data, size_t size) {
+    reader->current = data;
+    reader->end = data + size;
+    reader->failed = false;
+    reader->globals = NULL;
+    reader->globalCount = 0;
+    reader->globalCapacity = 0;
+}
+
+void freeReader(Reader* reader) {
+    FREE_ARRAY(int, reader->globals, reader->globalCapacity);
+    initReader(reader, NULL, 0);
+}
+
+bool canRead(Reader* reader, size_t size) {
+    if (reader->failed || (size_t)(reader->end - reader->current) < size) {
+        reader->failed = true;
+        return false;
+    }
+    return true;
+}
+
+uint32_t readWord(Reader* reader) {
+    if (!canRead(reader, sizeof(uint32_t))) return 0;
+    uint32_t word;
+    memcpy(&word, reader->current, sizeof(uint32_t));
+    reader->current += sizeof(uint32_t);
+    return word;
+}
+
+double readNumber(Reader* reader) {
+    double number = 0;
+    if (canRead(reader, sizeof(double))) {
+        memcpy(&number, reader->current, sizeof(double));
+        reader->current += sizeof(double);
+    }
+    return number;
+}
+
+/**
+ * Reads the count of items that follow, which take up wordsPerItem words each and must
+ * therefore still fit in the rest of the file.
+*/
+int readCount(Reader* reader, size_t wordsPerItem) {
+    uint32_t count = readWord(reader);
+    if (count > INSTR_ARG_MAX || !canRead(reader, count * wordsPerItem * sizeof(uint32_t))) {
+        reader->failed = true;
+        return 0;
+    }
+    return (int)count;
+}
+
+/**
+ * Returns the length bytes at the cursor as an interned ObjString, copied straight out of the mapping.
+*/
+ObjString* readChars(Reader* reader, uint32_t length) {
+    size_t padded = ((size_t)length + 3) & ~(size_t)3;
+    if (length > INT32_MAX - 4) reader->failed = true;
+    if (!canRead(reader, padded)) return NULL;
+
+    ObjString* string = copyString((const char*)reader->current, (int)length);
+    reader->current += padded;
+    return string;
+}
+
+ObjString* readString(Reader* reader) {
+    return readChars(reader, readWord(reader));
+}
+
+/**
+ * Reads what writeGlobalNames() wrote and gives each of the names a slot in the running VM.
+*/
+void readGlobalNames(Reader* reader) {
+    int count = readCount(reader, 1);
+    reader->globals = count > 0 ? ALLOCATE(int, count) : NULL;
+    reader->globalCapacity = count;
+    // globalCount only counts the slots that are filled in so far.
+    for (int i = 0; i < count && !reader->failed; i++) {
+        ObjString* name = readString(reader);
+        if (name == NULL) break;
+        push(OBJ_VAL(name));
+        reader->globals[reader->globalCount++] = globalSlot(name);
+        pop();
+    }
+}
+
+/**
+ * Reads what writeCode() wrote into an empty chunk. The code words are copied out of
+ * the mapping in one go. Their global operands still need relocateCode() once the
+ * chunk has its constants, which also checks the rest of them.
+*/
+void readCode(Reader* reader, Chunk* chunk) {
+    int count = readCount(reader, 1);
+    if (count > 0) {
+        chunk->code = GROW_ARRAY(uint32_t, chunk->code, 0, count);
+        memcpy(chunk->code, reader->current, count * sizeof(uint32_t));
+        chunk->capacity = count;
+        chunk->count = count;
+        reader->current += count * sizeof(uint32_t);
+    }
+
+    int lineCount = readCount(reader, 2);
+    if (lineCount > 0) {
+        chunk->lines.starts = GROW_ARRAY(LineStart, chunk->lines.starts, 0, lineCount);
+        chunk->lines.capacity = lineCount;
+        for (int i = 0; i < lineCount; i++) {
+            chunk->lines.starts[i].offset = (int)readWord(reader);
+            chunk->lines.starts[i].line = (int)readWord(reader);
+        }
+        chunk->lines.count = lineCount;
+    }
+
+    // Every inline cache belongs to an instruction.
+    int cacheCount = readCount(reader, 0);
+    if (cacheCount > count) {
+        reader->failed = true;
+        return;
+    }
+    for (int i = 0; i < cacheCount; i++) {
+        addInlineCache(chunk);
+    }
+}
+
+static bool isConstant(Chunk* chunk, uint32_t index) {
+    return index < (uint32_t)chunk->constants.count;
+}
+
+static bool isStringConstant(Chunk* chunk, uint32_t index) {
+    return isConstant(chunk, index) && IS_STRING(chunk->constants.values[index]);
+}
+
+static bool isNumberConstant(Chunk* chunk, uint32_t index) {
+    return isConstant(chunk, index) && IS_NUMBER(chunk->constants.values[index]);
+}
+
+/**
+ * Returns whether the counts that size the frames and closures of function are ones
+ * that the compiler could have produced.
+*/
+static bool hasValidCounts(ObjFunction* function) {
+    return function->arity >= 0 && function->arity <= UINT8_MAX &&
+        function->upvalueCount >= 0 && function->upvalueCount <= UINT8_COUNT &&
+        function->maxStack > function->arity;
+}
+
+/**
+ * Returns whether the operands of the instruction at offset, which fits in the code,
+ * all refer to something that exists: constants of the right type, inline caches,
+ * local slots within maxStack and upvalues of the function.
+*/
+static bool hasValidOperands(ObjFunction* function, int offset) {
+    Chunk* chunk = &function->chunk;
+    uint32_t* code = chunk->code + offset;
+    uint32_t arg = INSTR_ARG(code[0]);
+    uint32_t slots = (uint32_t)function->maxStack;
+    uint32_t caches = (uint32_t)chunk->cacheCount;
+
+    switch (INSTR_OP(code[0])) {
+        case OP_CONSTANT:
+            return isConstant(chunk, arg);
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_SET_LOCAL_POP:
+            return arg < slots;
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+            return arg < (uint32_t)function->upvalueCount;
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+            return isStringConstant(chunk, arg) && code[1] < caches;
+        case OP_INVOKE:
+        case OP_TAIL_INVOKE:
+            return isStringConstant(chunk, arg) && INSTR_ARG(code[1]) < caches;
+        case OP_GET_SUPER:
+        case OP_SUPER_INVOKE:
+        case OP_TAIL_SUPER_INVOKE:
+        case OP_CLASS:
+        case OP_METHOD:
+            return isStringConstant(chunk, arg);
+        case OP_CLOSURE: {
+            int upvalueCount = AS_FUNCTION(chunk->constants.values[arg])->upvalueCount;
+            for (int i = 1; i <= upvalueCount; i++) {
+                uint32_t index = INSTR_ARG(code[i]);
+                if (INSTR_OP(code[i]) ? index >= slots : index >= (uint32_t)function->upvalueCount) return false;
+            }
+            return true;
+        }
+        case OP_FOR_RANGE: {
+            uint32_t limit = INSTR_ARG(code[1]);
+            return INSTR_A(code[0]) < slots && isNumberConstant(chunk, INSTR_B(code[0])) &&
+                (INSTR_OP(code[1]) ? isConstant(chunk, limit) : limit < slots);
+        }
+        case OP_GET_LOCAL_CONSTANT:
+            return INSTR_A(code[0]) < slots && isConstant(chunk, INSTR_B(code[0]));
+        case OP_ADD_LOCALS:
+        case OP_ADD_LOCALS_NUM:
+        case OP_ADD_LOCALS_ANY:
+            return INSTR_A(code[0]) < slots && INSTR_B(code[0]) < slots;
+        case OP_INCREMENT_LOCAL:
+            return INSTR_A(code[0]) < slots && isNumberConstant(chunk, INSTR_B(code[0]));
+        default:
+            return INSTR_OP(code[0]) <= OP_ADD_LOCALS_ANY;
+    }
+}
+
+static bool isJump(uint32_t instruction) {
+    switch (INSTR_OP(instruction)) {
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP:
+        case OP_FOR_RANGE:
+        case OP_JUMP_IF_FALSE_POP:
+        case OP_LESS_JUMP_IF_FALSE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/**
+ * Points every global operand in the code at the running VM's slot for the name that
+ * the file gives it, and checks everything else that run() and the register translator
+ * take on trust: every operand has to exist, every jump has to land on an instruction,
+ * the code can't run off its end or below the callee's slot, and maxStack has to be
+ * what maxStackDepth() finds.
+ * Anything else sets failed, so that a damaged file is rejected before any of it runs.
+*/
+void relocateCode(Reader* reader, ObjFunction* function) {
+    Chunk* chunk = &function->chunk;
+    if (!hasValidCounts(function) || chunk->count == 0) {
+        reader->failed = true;
+        return;
+    }
+
+    bool* starts = ALLOCATE(bool, chunk->count);
+    for (int i = 0; i < chunk->count; i++) {
+        starts[i] = false;
+    }
+
+    int offset = 0;
+    int last = 0;
+    while (offset < chunk->count && !reader->failed) {
+        uint32_t instruction = chunk->code[offset];
+        if (INSTR_OP(instruction) == OP_CLOSURE) {
+            // instructionLength() looks at the function constant's upvalues.
+            int constant = INSTR_ARG(instruction);
+            if (constant >= chunk->constants.count || !IS_FUNCTION(chunk->constants.values[constant]) ||
+                !hasValidCounts(AS_FUNCTION(chunk->constants.values[constant]))) {
+                reader->failed = true;
+                break;
+            }
+        }
+
+        int length = instructionLength(chunk, offset);
+        if (length > chunk->count - offset || !hasValidOperands(function, offset)) {
+            reader->failed = true;
+            break;
+        }
+
+        switch (INSTR_OP(instruction)) {
+            case OP_GET_GLOBAL:
+            case OP_DEFINE_GLOBAL:
+            case OP_SET_GLOBAL: {
+                int slot = INSTR_ARG(instruction);
+                if (slot >= reader->globalCount) {
+                    reader->failed = true;
+                    break;
+                }
+                chunk->code[offset] = INSTR_ENCODE(INSTR_OP(instruction), reader->globals[slot]);
+                break;
+            }
+            default:
+                break;
+        }
+
+        starts[offset] = true;
+        last = offset;
+        offset += length;
+    }
+
+    // Jumps are checked once every instruction is known, since most of them go forward.
+    for (offset = 0; offset < chunk->count && !reader->failed; offset += instructionLength(chunk, offset)) {
+        if (!isJump(chunk->code[offset])) continue;
+        int target = jumpTarget(chunk, offset);
+        if (target < 0 || target >= chunk->count || !starts[target]) reader->failed = true;
+    }
+    FREE_ARRAY(bool, starts, chunk->count);
+
+    uint32_t end = INSTR_OP(chunk->code[last]);
+    if (!reader->failed && end != OP_RETURN && end != OP_JUMP && end != OP_LOOP) {
+        reader->failed = true;
+    }
+    // The callee and its arguments are already in the frame when the code starts, and
+    // no instruction may take the callee's slot off the stack.
+    if (!reader->failed && (function->maxStack != maxStackDepth(chunk, function->arity + 1) ||
+        minStackDepth(chunk, function->arity + 1) < 1)) {
+        reader->failed = true;
+    }
+}
+
+/**
+ * Rebuilds one function and every function nested in it. The function stays on the VM
+ * stack while it is being filled in, since the strings and functions that go into its
+ * constants allocate and can set off a collection.
+*/
+static ObjFunction* readFunction(Reader* reader) {
+    ObjFunction* function = newFunction();
+    push(OBJ_VAL(function));
+    Chunk* chunk = &function->chunk;
+
+    function->arity = (int)readWord(reader);
+    function->upvalueCount = (int)readWord(reader);
+    function->maxStack = (int)readWord(reader);
+    uint32_t nameLength = readWord(reader);
+    if (nameLength != (uint32_t)-1) function->name = readChars(reader, nameLength);
+
+    readCode(reader, chunk);
+
+    int constantCount = readCount(reader, 1);
+    for (int i = 0; i < constantCount && !reader->failed; i++) {
+        switch (readWord(reader)) {
+            case CONSTANT_NUMBER:
+                appendConstant(chunk, NUMBER_VAL(readNumber(reader)));
+                break;
+            case CONSTANT_STRING: {
+                ObjString* string = readString(reader);
+                if (string != NULL) appendConstant(chunk, OBJ_VAL(string));
+                break;
+            }
+            case CONSTANT_FUNCTION: {
+                ObjFunction* nested = readFunction(reader);
+                if (nested != NULL) appendConstant(chunk, OBJ_VAL(nested));
+                break;
+            }
+            default:
+                reader->failed = true;
+                break;
+        }
+    }
+
+    if (!reader->failed) relocateCode(reader, function);
+    // The register code is built from the stack code, just like after compiling.
+    if (!reader->failed && vm.registerEngine) compileRegisterCode(function);
+
+    pop();
+    return reader->failed ? NULL : function;
+}
+
+/**
+ * Maps the whole file at path into memory and returns it, or NULL if it cannot be opened.
+*/
+const uint8_t* mapFile(const char* path, size_t* size) {
+#ifdef BYTECODE_MMAP
+    int descriptor = open(path, O_RDONLY);
+    if (descriptor < 0) return NULL;
+
+    struct stat status;
+    if (fstat(descriptor, &status) != 0 || status.st_size == 0) {
+        close(descriptor);
+        return NULL;
+    }
+
+    void* data = mmap(NULL, (size_t)status.st_size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+    close(descriptor);
+    if (data == MAP_FAILED) return NULL;
+
+    *size = (size_t)status.st_size;
+    return (const uint8_t*)data;
+#else
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) return NULL;
+
+    fseek(file, 0L, SEEK_END);
+    long fileSize = ftell(file);
+    rewind(file);
+
+    uint8_t* data = fileSize > 0 ? (uint8_t*)malloc((size_t)fileSize) : NULL;
+    if (data == NULL || fread(data, 1, (size_t)fileSize, file) < (size_t)fileSize) {
+        free(data);
+        fclose(file);
+        return NULL;
+    }
+
+    fclose(file);
+    *size = (size_t)fileSize;
+    return data;
+#endif
+}
+
+void unmapFile(const uint8_t* data, size_t size) {
+#ifdef BYTECODE_MMAP
+    munmap((void*)data, size);
+#else
+    free((void*)data);
+#endif
+}
+
+/**
+ * Maps the bytecode file at path and rebuilds the function tree that it holds.
+ * Code words are copied from the mapping in one go and strings are interned straight
+ * from it, so nothing is parsed into an intermediate form.
+ * Returns NULL if there is no such file, if it was written for other source text or
+ * by another version of the interpreter, or if it is damaged.
+*/
+ObjFunction* loadBytecodeFile(const char* path, uint64_t sourceHash) {
+    size_t size;
+    const uint8_t* data = mapFile(path, &size);
+    if (data == NULL) return NULL;
+
+    Reader reader;
+    initReader(&reader, data, size);
+
+    ObjFunction* function = NULL;
+    bool valid = readWord(&reader) == BYTECODE_MAGIC && readWord(&reader) == BYTECODE_VERSION;
+    if (valid) {
+        uint64_t hash = readWord(&reader);
+        hash |= (uint64_t)readWord(&reader) << 32;
+        valid = hash == sourceHash;
+    }
+    if (valid) {
+        uint64_t checksum = readWord(&reader);
+        checksum |= (uint64_t)readWord(&reader) << 32;
+        valid = !reader.failed &&
+            checksum == hashSource((const char*)reader.current, (size_t)(reader.end - reader.current));
+    }
+
+    if (valid) {
+        readGlobalNames(&reader);
+        if (!reader.failed) function = readFunction(&reader);
+        if (reader.current != reader.end) function = NULL;
+    }
+
+    freeReader(&reader);
+    unmapFile(data, size);
+    return function;
+}
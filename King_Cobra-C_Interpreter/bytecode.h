@@ -0,0 +1,85 @@
+#ifndef kc_bytecode_h
+#define kc_bytecode_h
+
+#include "object.h"
+
+/**
+ * Precompiled bytecode files (.kcc). A file holds the finished stack code of a script's
+ * function tree together with the hash of the source it was compiled from, so running
+ * an unchanged script can skip the scanner and the compiler altogether.
+ * Bump BYTECODE_VERSION whenever the instruction set or the file layout changes.
+*/
+#define BYTECODE_VERSION 4
+
+/**
+ * Returns the hash that a bytecode file records for the given source text.
+*/
+uint64_t hashSource(const char* source, size_t length);
+
+/**
+ * Serializes the function tree that compile() returned to path, along with sourceHash.
+ * Returns false if the file could not be written, which leaves no file behind.
+*/
+bool writeBytecodeFile(const char* path, ObjFunction* function, uint64_t sourceHash);
+
+/**
+ * Maps the bytecode file at path and rebuilds the function tree that it holds.
+ * Returns NULL if there is no such file, if it was written for other source text or
+ * by another version of the interpreter, or if it is damaged.
+*/
+ObjFunction* loadBytecodeFile(const char* path, uint64_t sourceHash);
+
+/**
+ * The pieces of the format that heap images (snapshot.c) share with bytecode files.
+ * Everything is written as 32-bit words, see the layout at the top of bytecode.c.
+ * A ByteBuffer lives on the C heap rather than the VM's, so that a buffer written by
+ * one VM can be handed to another one.
+*/
+typedef struct {
+    uint8_t* bytes;
+    size_t count;
+    size_t capacity;
+} ByteBuffer;
+
+void initByteBuffer(ByteBuffer* buffer);
+void freeByteBuffer(ByteBuffer* buffer);
+void writeBytes(ByteBuffer* buffer, const void* bytes, size_t count);
+void writeWord(ByteBuffer* buffer, uint32_t word);
+void writeNumber(ByteBuffer* buffer, double number);
+void writeString(ByteBuffer* buffer, const char* chars, int length);
+void writeGlobalNames(ByteBuffer* buffer);
+void writeCode(ByteBuffer* buffer, Chunk* chunk);
+bool writeByteBufferFile(ByteBuffer* buffer, const char* path);
+
+/**
+ * A cursor over a mapped file. Reads past the end set failed instead of going
+ * out of bounds, so a truncated file is rejected like any other bad one.
+*/
+typedef struct {
+    const uint8_t* current;
+    const uint8_t* end;
+    bool failed;
+    int* globals;       // Slot in the running VM of each global slot in the file
+    int globalCount;
+    int globalCapacity;
+} Reader;
+
+void initReader(Reader* reader, const uint8_t* data, size_t size);
+void freeReader(Reader* reader);
+bool canRead(Reader* reader, size_t size);
+uint32_t readWord(Reader* reader);
+double readNumber(Reader* reader);
+int readCount(Reader* reader, size_t wordsPerItem);
+ObjString* readChars(Reader* reader, uint32_t length);
+ObjString* readString(Reader* reader);
+void readGlobalNames(Reader* reader);
+void readCode(Reader* reader, Chunk* chunk);
+void relocateCode(Reader* reader, ObjFunction* function);
+
+/**
+ * Maps the whole file at path into memory, or returns NULL if it cannot be opened.
+*/
+const uint8_t* mapFile(const char* path, size_t* size);
+void unmapFile(const uint8_t* data, size_t size);
+
+#endif
@@ -1,6 +1,8 @@
 #include <stdlib.h>
+#include <string.h>
 #include "chunk.h"
 #include "memory.h"
+#include "object.h"
 #include "vm.h"
 
 /**
@@ -9,12 +11,29 @@
  * Similar to how JVM languages compile down to bytecode or
  * an intermediate representation.
 */
+static void initLineTable(LineTable* lines) {
+    lines->count = 0;
+    lines->capacity = 0;
+    lines->starts = NULL;
+}
+
 void initChunk(Chunk* chunk) {
     chunk->count = 0;
     chunk->capacity = 0;
     chunk->code = NULL;
-    chunk->lines = NULL;
+    initLineTable(&chunk->lines);
     initValueArray(&chunk->constants);
+    chunk->constantSlots = NULL;
+    chunk->constantSlotCount = 0;
+    chunk->constantSlotCapacity = 0;
+    chunk->registers.count = 0;
+    chunk->registers.capacity = 0;
+    chunk->registers.code = NULL;
+    initLineTable(&chunk->registers.lines);
+    chunk->registers.frameSize = 0;
+    chunk->cacheCount = 0;
+    chunk->cacheCapacity = 0;
+    chunk->caches = NULL;
 }
 
 /**
@@ -23,34 +42,399 @@ void initChunk(Chunk* chunk) {
  * memory allocated for it on the heap.
 */
 void freeChunk(Chunk* chunk) {
-    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-    FREE_ARRAY(int, chunk->lines, chunk->capacity);
+    FREE_ARRAY(uint32_t, chunk->code, chunk->capacity);
+    FREE_ARRAY(LineStart, chunk->lines.starts, chunk->lines.capacity);
+    FREE_ARRAY(uint32_t, chunk->registers.code, chunk->registers.capacity);
+    FREE_ARRAY(LineStart, chunk->registers.lines.starts, chunk->registers.lines.capacity);
+    FREE_ARRAY(InlineCache, chunk->caches, chunk->cacheCapacity);
+    FREE_ARRAY(int, chunk->constantSlots, chunk->constantSlotCapacity);
     freeValueArray(&chunk->constants);
     initChunk(chunk);
 }
 
 /**
- * Writes the provided byte and the line number as well to the specified Chunk.
+ * Writes the provided instruction word and the line number as well to the specified Chunk.
 */
-void writeChunk(Chunk* chunk, uint8_t byte, int line) {
+void writeChunk(Chunk* chunk, uint32_t instruction, int line) {
     if(chunk->capacity < chunk->count + 1) {
         int oldCapacity = chunk->capacity;
         chunk->capacity = GROW_CAPACITY(oldCapacity);
-        chunk->code = GROW_ARRAY(uint8_t, chunk->code, oldCapacity, chunk->capacity);
-        chunk->lines = GROW_ARRAY(int, chunk->lines, oldCapacity, chunk->capacity);
+        chunk->code = GROW_ARRAY(uint32_t, chunk->code, oldCapacity, chunk->capacity);
     }
 
-    chunk->code[chunk->count] = byte;
-    chunk->lines[chunk->count] = line;
+    chunk->code[chunk->count] = instruction;
+    addLine(&chunk->lines, chunk->count, line);
     chunk->count++;
 }
 
 /**
- * Adds the provided constant instruction to the specified Chunk.
+ * Takes back every word from offset count on, along with the lines they came from.
+*/
+void truncateChunk(Chunk* chunk, int count) {
+    chunk->count = count;
+    while (chunk->lines.count > 0 && chunk->lines.starts[chunk->lines.count - 1].offset >= count) {
+        chunk->lines.count--;
+    }
+}
+
+/**
+ * Records that the word at offset, which is the next one written, comes from line.
+ * A new run only starts when the line changes. Code that takes back its last word
+ * and writes another one in its place replaces the line of a run starting there.
+*/
+void addLine(LineTable* lines, int offset, int line) {
+    if (lines->count > 0) {
+        LineStart* last = &lines->starts[lines->count - 1];
+        if (last->offset == offset) {
+            last->line = line;
+            if (lines->count > 1 && lines->starts[lines->count - 2].line == line) lines->count--;
+            return;
+        }
+        if (last->line == line) return;
+    }
+
+    if (lines->capacity < lines->count + 1) {
+        int oldCapacity = lines->capacity;
+        lines->capacity = GROW_CAPACITY(oldCapacity);
+        lines->starts = GROW_ARRAY(LineStart, lines->starts, oldCapacity, lines->capacity);
+    }
+
+    lines->starts[lines->count].offset = offset;
+    lines->starts[lines->count].line = line;
+    lines->count++;
+}
+
+/**
+ * Returns the source line of the word at offset, with a binary search for the
+ * last run that starts at or before it.
+*/
+int getLine(LineTable* lines, int offset) {
+    int low = 0;
+    int high = lines->count - 1;
+    while (low < high) {
+        int middle = low + (high - low + 1) / 2;
+        if (lines->starts[middle].offset <= offset) {
+            low = middle;
+        }
+        else {
+            high = middle - 1;
+        }
+    }
+    return lines->count == 0 ? 0 : lines->starts[low].line;
+}
+
+/**
+ * The constant index is an open-addressed hash table over the numbers and strings in
+ * a Chunk's constants. Every slot holds a constant's index plus one, or 0 if empty.
+*/
+static bool isIndexed(Value value) {
+    return IS_NUMBER(value) || IS_STRING(value);
+}
+
+static uint32_t hashConstant(Value value) {
+    if (IS_STRING(value)) return AS_STRING(value)->hash;
+
+    double number = AS_NUMBER(value);
+    uint64_t bits;
+    memcpy(&bits, &number, sizeof(bits));
+    bits ^= bits >> 33;
+    bits *= 0xff51afd7ed558ccdULL;
+    bits ^= bits >> 33;
+    return (uint32_t)bits;
+}
+
+/**
+ * Numbers match by their bits, so 0 and -0 stay apart. Strings are interned, so the
+ * same characters are always the same object.
+*/
+static bool sameConstant(Value a, Value b) {
+    if (IS_STRING(a) || IS_STRING(b)) {
+        return IS_STRING(a) && IS_STRING(b) && AS_STRING(a) == AS_STRING(b);
+    }
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+    return memcmp(&x, &y, sizeof(double)) == 0;
+}
+
+/**
+ * Returns the slot that holds value, or the empty slot where it belongs.
+*/
+static int* findConstantSlot(Chunk* chunk, Value value) {
+    uint32_t mask = (uint32_t)chunk->constantSlotCapacity - 1;
+    for (uint32_t slot = hashConstant(value) & mask;; slot = (slot + 1) & mask) {
+        int* entry = &chunk->constantSlots[slot];
+        if (*entry == 0 || sameConstant(chunk->constants.values[*entry - 1], value)) return entry;
+    }
+}
+
+/**
+ * Rebuilds the index with room for more constants, keeping it at most half full.
+*/
+static void growConstantIndex(Chunk* chunk) {
+    FREE_ARRAY(int, chunk->constantSlots, chunk->constantSlotCapacity);
+    chunk->constantSlotCapacity = chunk->constantSlotCapacity < 8 ? 8 : chunk->constantSlotCapacity * 2;
+    chunk->constantSlots = ALLOCATE(int, chunk->constantSlotCapacity);
+    for (int i = 0; i < chunk->constantSlotCapacity; i++) {
+        chunk->constantSlots[i] = 0;
+    }
+
+    chunk->constantSlotCount = 0;
+    for (int i = 0; i < chunk->constants.count; i++) {
+        Value value = chunk->constants.values[i];
+        if (!isIndexed(value)) continue;
+        int* entry = findConstantSlot(chunk, value);
+        if (*entry == 0) {
+            *entry = i + 1;
+            chunk->constantSlotCount++;
+        }
+    }
+}
+
+/**
+ * Returns the index of value in the constants of the specified Chunk, adding it first
+ * if it isn't there yet.
 */
 int addConstant(Chunk* chunk, Value value) {
+    if (!isIndexed(value)) {
+        appendConstant(chunk, value);
+        return chunk->constants.count - 1;
+    }
+
+    if (chunk->constantSlotCapacity > 0) {
+        int* entry = findConstantSlot(chunk, value);
+        if (*entry != 0) return *entry - 1;
+    }
+
+    appendConstant(chunk, value);
+    int index = chunk->constants.count - 1;
+    if ((chunk->constantSlotCount + 1) * 2 > chunk->constantSlotCapacity) {
+        // Indexes the new constant along with the others.
+        growConstantIndex(chunk);
+    }
+    else {
+        *findConstantSlot(chunk, value) = index + 1;
+        chunk->constantSlotCount++;
+    }
+    return index;
+}
+
+void appendConstant(Chunk* chunk, Value value) {
     push(value);
     writeValueArray(&chunk->constants, value);
     pop();
-    return chunk->constants.count -1;
+}
+
+/**
+ * Adds an empty inline cache to the specified Chunk and returns its index.
+*/
+int addInlineCache(Chunk* chunk) {
+    if (chunk->cacheCapacity < chunk->cacheCount + 1) {
+        int oldCapacity = chunk->cacheCapacity;
+        chunk->cacheCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->caches = GROW_ARRAY(InlineCache, chunk->caches, oldCapacity, chunk->cacheCapacity);
+    }
+
+    chunk->caches[chunk->cacheCount].count = 0;
+    return chunk->cacheCount++;
+}
+
+/**
+ * Empties every inline cache of the specified Chunk, including megamorphic ones.
+*/
+void resetInlineCaches(Chunk* chunk) {
+    for (int i = 0; i < chunk->cacheCount; i++) {
+        chunk->caches[i].count = 0;
+    }
+}
+
+/**
+ * Returns how many words the instruction at offset takes up, extension words included.
+*/
+int instructionLength(Chunk* chunk, int offset) {
+    switch (INSTR_OP(chunk->code[offset])) {
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+        case OP_INVOKE:
+        case OP_SUPER_INVOKE:
+        case OP_TAIL_INVOKE:
+        case OP_TAIL_SUPER_INVOKE:
+            return 2;
+        case OP_FOR_RANGE:
+            return 3;
+        case OP_CLOSURE: {
+            ObjFunction* function = AS_FUNCTION(chunk->constants.values[INSTR_ARG(chunk->code[offset])]);
+            return 1 + function->upvalueCount;
+        }
+        default:
+            return 1;
+    }
+}
+
+/**
+ * Returns how many instructions the code of the Chunk holds, not counting extension words.
+*/
+int instructionCount(Chunk* chunk) {
+    int count = 0;
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+        count++;
+    }
+    return count;
+}
+
+/**
+ * Returns the offset that the jump instruction at offset lands on.
+*/
+int jumpTarget(Chunk* chunk, int offset) {
+    uint32_t instruction = chunk->code[offset];
+    if (INSTR_OP(instruction) == OP_LOOP) return offset + 1 - (int)INSTR_ARG(instruction);
+    if (INSTR_OP(instruction) == OP_FOR_RANGE) return offset + 3 - (int)INSTR_ARG(chunk->code[offset + 2]);
+    return offset + 1 + (int)INSTR_ARG(instruction);
+}
+
+/**
+ * Returns the instruction with a quickened opcode put back to the generic one that
+ * run() rewrote it from, which is also what the guard of the quickened form does.
+*/
+uint32_t genericInstruction(uint32_t instruction) {
+    switch (INSTR_OP(instruction)) {
+        case OP_EQUAL_NUM:
+        case OP_EQUAL_ANY:
+            return INSTR_ENCODE(OP_EQUAL, INSTR_ARG(instruction));
+        case OP_ADD_NUM:
+        case OP_ADD_STR:
+        case OP_ADD_ANY:
+            return INSTR_ENCODE(OP_ADD, INSTR_ARG(instruction));
+        case OP_ADD_LOCALS_NUM:
+        case OP_ADD_LOCALS_ANY:
+            return INSTR_ENCODE(OP_ADD_LOCALS, INSTR_ARG(instruction));
+        default:
+            return instruction;
+    }
+}
+
+/**
+ * Returns how many values the instruction at offset leaves on the stack, less the
+ * ones it takes off. The conditional jumps that pop their condition do so on both paths.
+*/
+static int stackEffect(Chunk* chunk, int offset) {
+    uint32_t* code = chunk->code;
+    switch (INSTR_OP(code[offset])) {
+        case OP_CONSTANT:
+        case OP_NULL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_LOCAL:
+        case OP_GET_GLOBAL:
+        case OP_GET_UPVALUE:
+        case OP_CLOSURE:
+        case OP_CLASS:
+        case OP_ADD_LOCALS:
+        case OP_ADD_LOCALS_NUM:
+        case OP_ADD_LOCALS_ANY:
+            return 1;
+        case OP_GET_LOCAL_CONSTANT:
+            return 2;
+        case OP_POP:
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_PROPERTY:
+        case OP_GET_SUPER:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_GREATER_EQUAL:
+        case OP_LESS_EQUAL:
+        case OP_NOT_EQUAL:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_PRINT:
+        case OP_CLOSE_UPVALUE:
+        case OP_INHERIT:
+        case OP_METHOD:
+        case OP_SET_LOCAL_POP:
+        case OP_JUMP_IF_FALSE_POP:
+        case OP_EQUAL_NUM:
+        case OP_ADD_NUM:
+        case OP_ADD_STR:
+        case OP_EQUAL_ANY:
+        case OP_ADD_ANY:
+            return -1;
+        case OP_LESS_JUMP_IF_FALSE:
+            return -2;
+        case OP_CALL:
+        case OP_TAIL_CALL:
+            return -(int)INSTR_ARG(code[offset]);
+        case OP_INVOKE:
+        case OP_TAIL_INVOKE:
+            return -(int)INSTR_OP(code[offset + 1]);
+        case OP_SUPER_INVOKE:
+        case OP_TAIL_SUPER_INVOKE:
+            return -(int)INSTR_OP(code[offset + 1]) - 1;
+        default:
+            return 0;
+    }
+}
+
+/**
+ * A single pass in code order, like the register translation in regcompiler.c.
+ * Forward jumps record the deepest stack they arrive with and the code at their
+ * target continues from the deeper of that and the fall-through depth, so a
+ * path that leaves extra values behind is never undercounted. The shallowest depth
+ * that an instruction some path reaches leaves goes to minDepth.
+*/
+static int walkStackDepth(Chunk* chunk, int depth, int* minDepth) {
+    int* depthAt = ALLOCATE(int, chunk->count + 1);
+    for (int i = 0; i <= chunk->count; i++) {
+        depthAt[i] = -1;
+    }
+
+    int maxDepth = depth;
+    *minDepth = depth;
+    bool reachable = true;
+    bool live = true;
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+        // The code right after an unconditional jump is dead unless a jump lands on it.
+        live = (live && reachable) || depthAt[offset] != -1;
+        if (depthAt[offset] != -1 && (!reachable || depthAt[offset] > depth)) {
+            depth = depthAt[offset];
+        }
+        reachable = true;
+
+        depth += stackEffect(chunk, offset);
+        if (depth > maxDepth) maxDepth = depth;
+        if (live && depth < *minDepth) *minDepth = depth;
+
+        switch (INSTR_OP(chunk->code[offset])) {
+            case OP_JUMP:
+            case OP_JUMP_IF_FALSE:
+            case OP_JUMP_IF_FALSE_POP:
+            case OP_LESS_JUMP_IF_FALSE: {
+                int target = jumpTarget(chunk, offset);
+                if (depth > depthAt[target]) depthAt[target] = depth;
+                reachable = INSTR_OP(chunk->code[offset]) != OP_JUMP;
+                break;
+            }
+            case OP_LOOP:
+            case OP_RETURN:
+                reachable = false;
+                break;
+            default:
+                break;
+        }
+    }
+
+    FREE_ARRAY(int, depthAt, chunk->count + 1);
+    return maxDepth;
+}
+
+int maxStackDepth(Chunk* chunk, int depth) {
+    int minDepth;
+    return walkStackDepth(chunk, depth, &minDepth);
+}
+
+int minStackDepth(Chunk* chunk, int depth) {
+    int minDepth;
+    walkStackDepth(chunk, depth, &minDepth);
+    return minDepth;
 }
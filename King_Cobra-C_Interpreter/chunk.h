@@ -5,24 +5,26 @@
 #include "value.h"
 
 /**
- * All opcodes account for one byte in the two bytes of an instruction.
+ * Opcodes of the stack machine. Every instruction is one 32-bit word, with the opcode in
+ * the low byte and a 24 bit operand above it (see INSTR_ENCODE below). The comments give
+ * the operand, and what the extension words that a few instructions carry after it hold.
 */
 typedef enum {
-    OP_CONSTANT,
+    OP_CONSTANT,        // constant index
     OP_NULL,
     OP_TRUE,
     OP_FALSE,
     OP_POP,
-    OP_GET_LOCAL,
-    OP_SET_LOCAL,
-    OP_GET_GLOBAL,
-    OP_DEFINE_GLOBAL,
-    OP_SET_GLOBAL,
-    OP_GET_UPVALUE,
-    OP_SET_UPVALUE,
-    OP_GET_PROPERTY,
-    OP_SET_PROPERTY,
-    OP_GET_SUPER,
+    OP_GET_LOCAL,       // local slot
+    OP_SET_LOCAL,       // local slot
+    OP_GET_GLOBAL,      // global slot
+    OP_DEFINE_GLOBAL,   // global slot
+    OP_SET_GLOBAL,      // global slot
+    OP_GET_UPVALUE,     // upvalue index
+    OP_SET_UPVALUE,     // upvalue index
+    OP_GET_PROPERTY,    // name constant, inline cache index in the word that follows
+    OP_SET_PROPERTY,    // name constant, inline cache index in the word that follows
+    OP_GET_SUPER,       // name constant
     OP_EQUAL,
     OP_GREATER,
     OP_LESS,
@@ -36,31 +38,185 @@ typedef enum {
     OP_NOT,
     OP_NEGATE,
     OP_PRINT,
-    OP_JUMP,
-    OP_JUMP_IF_FALSE,
-    OP_LOOP,
-    OP_CALL,
-    OP_INVOKE,
-    OP_SUPER_INVOKE,
-    OP_CLOSURE,
+    OP_JUMP,            // words to skip forward, counted from the next instruction
+    OP_JUMP_IF_FALSE,   // words to skip forward
+    OP_LOOP,            // words to go back, counted from the next instruction
+    OP_CALL,            // argument count
+    OP_TAIL_CALL,       // argument count, a call whose result is returned right away; OP_RETURN follows it
+    OP_INVOKE,          // name constant, INSTR_ENCODE(argument count, inline cache index) follows
+    OP_SUPER_INVOKE,    // name constant, INSTR_ENCODE(argument count, 0) follows
+    OP_TAIL_INVOKE,     // OP_INVOKE whose result is returned right away; OP_RETURN follows it
+    OP_TAIL_SUPER_INVOKE,   // OP_SUPER_INVOKE whose result is returned right away; OP_RETURN follows it
+    OP_CLOSURE,         // function constant, INSTR_ENCODE(isLocal, index) follows for each upvalue
     OP_CLOSE_UPVALUE,
     OP_RETURN,
-    OP_CLASS,
+    OP_CLASS,           // name constant
     OP_INHERIT,
-    OP_METHOD
+    OP_METHOD,          // name constant
+    OP_FOR_RANGE,       // INSTR_ENCODE_AB(counter slot, step constant), INSTR_ENCODE(limit is a constant,
+                        // limit slot or constant) and the words to go back to the body follow
+    // Superinstructions. The compiler never emits these, optimizeChunk() fuses the
+    // most frequent opcode sequences into them once a function is compiled. The ones with
+    // two operands pack them with INSTR_ENCODE_AB and are only used when both fit.
+    OP_GET_LOCAL_CONSTANT,  // GET_LOCAL a, CONSTANT k
+    OP_ADD_LOCALS,          // GET_LOCAL a, GET_LOCAL b, ADD
+    OP_INCREMENT_LOCAL,     // GET_LOCAL a, CONSTANT k, ADD, SET_LOCAL a, POP (k is a number)
+    OP_SET_LOCAL_POP,       // SET_LOCAL a, POP
+    OP_JUMP_IF_FALSE_POP,   // JUMP_IF_FALSE, POP, landing past the POP at the target
+    OP_LESS_JUMP_IF_FALSE,  // LESS, JUMP_IF_FALSE, POP, landing past the POP at the target
+    // Quickened forms. run() rewrites a generic instruction into one of these the first
+    // time it executes, keyed on the operand types it saw. When the guard fails, the
+    // site has seen more than one kind of operand, so it is rewritten into the form that
+    // handles every kind and never quickens again. They never appear in freshly compiled code.
+    OP_EQUAL_NUM,           // EQUAL of two numbers
+    OP_ADD_NUM,             // ADD of two numbers
+    OP_ADD_STR,             // ADD of two strings
+    OP_ADD_LOCALS_NUM,      // ADD_LOCALS of two numbers
+    OP_EQUAL_ANY,           // EQUAL that stays generic
+    OP_ADD_ANY,             // ADD that stays generic
+    OP_ADD_LOCALS_ANY       // ADD_LOCALS that stays generic
 } OpCode;
 
+#define INSTR_ENCODE(op, arg) ((uint32_t)(op) | ((uint32_t)(arg) << 8))
+#define INSTR_OP(instruction)  ((instruction) & 0xff)
+#define INSTR_ARG(instruction) ((instruction) >> 8)
+#define INSTR_ARG_MAX 0xffffff
+// The two operands of a fused superinstruction get 12 bits each.
+#define INSTR_ENCODE_AB(op, a, b) \
+    ((uint32_t)(op) | ((uint32_t)(a) << 8) | ((uint32_t)(b) << 20))
+#define INSTR_A(instruction) (((instruction) >> 8) & 0xfff)
+#define INSTR_B(instruction) ((instruction) >> 20)
+#define INSTR_AB_MAX 0xfff
+
+/**
+ * Opcodes of the register machine (see regcompiler.c and runRegisters() in vm.c).
+ * Registers are the frame's value slots: locals first, then the temporaries that the
+ * stack code would have pushed. Every instruction is one 32-bit word, with the opcode
+ * in the low byte followed by either three byte operands A, B, C or A and a 16 bit Bx.
+ * R[x] is register x, K[x] is constant x and the K-suffixed forms take C from the constants.
+*/
+typedef enum {
+    ROP_MOVE,           // R[A] = R[B]
+    ROP_LOAD_CONSTANT,  // R[A] = K[Bx]
+    ROP_NULL,           // R[A] = null
+    ROP_TRUE,           // R[A] = true
+    ROP_FALSE,          // R[A] = false
+    ROP_GET_GLOBAL,     // R[A] = global slot Bx
+    ROP_DEFINE_GLOBAL,  // global slot Bx = R[A]
+    ROP_SET_GLOBAL,     // global slot Bx = R[A], which must already be defined
+    ROP_GET_UPVALUE,    // R[A] = upvalue B
+    ROP_SET_UPVALUE,    // upvalue B = R[A]
+    ROP_GET_PROPERTY,   // R[A] = R[A].K[Bx], the inline cache index is in the word that follows
+    ROP_SET_PROPERTY,   // R[A].K[Bx] = R[A + 1], then R[A] = R[A + 1], inline cache index follows
+    ROP_GET_SUPER,      // R[A] = R[A + 1].K[Bx] bound to R[A]
+    ROP_EQUAL,          // R[A] = R[B] == R[C]
+    ROP_NOT_EQUAL,
+    ROP_GREATER,
+    ROP_LESS,
+    ROP_GREATER_EQUAL,
+    ROP_LESS_EQUAL,
+    ROP_ADD,
+    ROP_SUBTRACT,
+    ROP_MULTIPLY,
+    ROP_DIVIDE,
+    ROP_EQUAL_K,        // R[A] = R[B] == K[C]
+    ROP_NOT_EQUAL_K,
+    ROP_GREATER_K,
+    ROP_LESS_K,
+    ROP_GREATER_EQUAL_K,
+    ROP_LESS_EQUAL_K,
+    ROP_ADD_K,
+    ROP_SUBTRACT_K,
+    ROP_MULTIPLY_K,
+    ROP_DIVIDE_K,
+    ROP_NOT,            // R[A] = !R[B]
+    ROP_NEGATE,         // R[A] = -R[B]
+    ROP_PRINT,          // print R[A]
+    ROP_JUMP,           // pc += sBx
+    ROP_JUMP_IF_FALSE,  // if R[A] is falsey, pc += sBx
+    ROP_JUMP_IF_NOT_LESS,   // if !(R[B] < R[C]), pc += sBx of the word that follows
+    ROP_JUMP_IF_NOT_LESS_K, // if !(R[B] < K[C]), pc += sBx of the word that follows
+    ROP_FOR_RANGE,      // R[A] += K[B], then if R[A] < R[C], pc += sBx of the word that follows
+    ROP_FOR_RANGE_K,    // R[A] += K[B], then if R[A] < K[C], pc += sBx of the word that follows
+    ROP_CALL,           // call R[A] with the B arguments above it, the result lands in R[A]
+    ROP_TAIL_CALL,      // ROP_CALL that reuses the current frame for closures, ROP_RETURN R[A] follows it
+    ROP_INVOKE,         // call method K[C] of R[A] with the B arguments above it, inline cache index follows
+    ROP_SUPER_INVOKE,   // call method K[C] of superclass R[A + B + 1] on R[A]
+    ROP_TAIL_INVOKE,    // ROP_INVOKE that reuses the current frame for closures, ROP_RETURN R[A] follows it
+    ROP_TAIL_SUPER_INVOKE,  // ROP_SUPER_INVOKE that reuses the current frame for closures, ROP_RETURN R[A] follows it
+    ROP_CLOSURE,        // R[A] = closure of K[Bx], one word per upvalue follows (A = isLocal, B = index)
+    ROP_CLOSE_UPVALUE,  // close the upvalues at or above R[A]
+    ROP_RETURN,         // return R[A]
+    ROP_CLASS,          // R[A] = new class named K[Bx]
+    ROP_INHERIT,        // copy the methods of superclass R[A] into class R[A + 1]
+    ROP_METHOD          // add method R[A + 1] named K[Bx] to class R[A]
+} RegOpCode;
+
+#define REG_ENCODE(op, a, b, c) \
+    ((uint32_t)(op) | ((uint32_t)(a) << 8) | ((uint32_t)(b) << 16) | ((uint32_t)(c) << 24))
+#define REG_ENCODE_BX(op, a, bx) \
+    ((uint32_t)(op) | ((uint32_t)(a) << 8) | ((uint32_t)(bx) << 16))
+
+#define REG_OP(instruction) ((instruction) & 0xff)
+#define REG_A(instruction)  (((instruction) >> 8) & 0xff)
+#define REG_B(instruction)  (((instruction) >> 16) & 0xff)
+#define REG_C(instruction)  ((instruction) >> 24)
+#define REG_BX(instruction) ((instruction) >> 16)
+// Jump offsets are stored in Bx with a bias, so that they can go either way.
+#define REG_SBX_BIAS 0x7fff
+#define REG_SBX(instruction) ((int)REG_BX(instruction) - REG_SBX_BIAS)
+
+/**
+ * Source lines of a code array, run-length encoded: one LineStart for each run of
+ * words that come from the same line, holding the offset where the run begins.
+ * Only runtime errors and the disassembler ever look a line up.
+*/
+typedef struct {
+    int offset;
+    int line;
+} LineStart;
+
+typedef struct {
+    int count;
+    int capacity;
+    LineStart* starts;
+} LineTable;
+
 /**
- * Chunks store instructions within a dynamic array.
+ * The register machine translation of a Chunk's code, with its own line table.
+ * frameSize is the number of registers a call to the function needs.
+*/
+typedef struct {
+    int count;
+    int capacity;
+    uint32_t* code;
+    LineTable lines;
+    int frameSize;
+} RegisterCode;
+
+// Defined in object.h, since its entries point at classes, shapes and closures.
+typedef struct InlineCache InlineCache;
+
+/**
+ * Chunks store instructions within a dynamic array of 32-bit words.
  * Each Chunk is responsible for associated instructions, lines from source code that the instructions
  * are read from, and an array of values.
+ * The register field is only filled in when the VM runs on the register engine.
+ * Every property access and method invoke owns one of the inline caches, by index.
 */
 typedef struct {
     int count;
     int capacity;
-    uint8_t* code;
-    int* lines;
+    uint32_t* code;
+    LineTable lines;
     ValueArray constants;
+    int* constantSlots;     // Hash index of the numbers and strings in constants, see addConstant()
+    int constantSlotCount;
+    int constantSlotCapacity;
+    RegisterCode registers;
+    int cacheCount;
+    int cacheCapacity;
+    InlineCache* caches;
 } Chunk;
 
 /**
@@ -79,13 +235,78 @@ void initChunk(Chunk* chunk);
 void freeChunk(Chunk* chunk);
 
 /**
- * Writes the provided byte and the line number as well to the specified Chunk.
+ * Writes the provided instruction word and the line number as well to the specified Chunk.
+*/
+void writeChunk(Chunk* chunk, uint32_t instruction, int line);
+
+/**
+ * Takes back every word from offset count on, along with the lines they came from.
+*/
+void truncateChunk(Chunk* chunk, int count);
+
+/**
+ * Records that the word at offset, which is the next one written, comes from line.
+*/
+void addLine(LineTable* lines, int offset, int line);
+
+/**
+ * Returns the source line of the word at offset.
 */
-void writeChunk(Chunk* chunk, uint8_t byte, int line);
+int getLine(LineTable* lines, int offset);
 
 /**
- * Adds the provided constant instruction to the specified Chunk.
+ * Returns the index of value in the constants of the specified Chunk, adding it first
+ * if it isn't there yet. Numbers with the same bits and the same interned string
+ * share one constant, found through the Chunk's constant index.
 */
 int addConstant(Chunk* chunk, Value value);
 
+/**
+ * Adds value as the next constant even if the Chunk already has it, for loaders that
+ * have to keep the indices that the code they read was written with.
+*/
+void appendConstant(Chunk* chunk, Value value);
+
+/**
+ * Adds an empty inline cache to the specified Chunk and returns its index.
+*/
+int addInlineCache(Chunk* chunk);
+
+/**
+ * Empties every inline cache of the specified Chunk.
+*/
+void resetInlineCaches(Chunk* chunk);
+
+/**
+ * Returns how many words the instruction at offset takes up, extension words included.
+*/
+int instructionLength(Chunk* chunk, int offset);
+
+/**
+ * Returns how many instructions the code of the Chunk holds, not counting extension words.
+*/
+int instructionCount(Chunk* chunk);
+
+/**
+ * Returns the offset that the jump instruction at offset lands on.
+*/
+int jumpTarget(Chunk* chunk, int offset);
+
+/**
+ * Returns the instruction with a quickened opcode put back to its generic form.
+*/
+uint32_t genericInstruction(uint32_t instruction);
+
+/**
+ * Returns the deepest the stack code of the Chunk takes the stack, starting from
+ * depth values already in the frame.
+*/
+int maxStackDepth(Chunk* chunk, int depth);
+
+/**
+ * Returns the shallowest the stack code of the Chunk leaves the stack after any of its
+ * instructions, tracked the same way, starting from depth values already in the frame.
+*/
+int minStackDepth(Chunk* chunk, int depth);
+
 #endif
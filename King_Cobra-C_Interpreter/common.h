@@ -6,12 +6,27 @@
 #include <stdint.h>
 
 #define NAN_BOXING
+
+// run() dispatches through a table of label addresses (labels-as-values) when the
+// compiler supports it. Build with -DNO_COMPUTED_GOTO to use the portable switch loop.
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
+
 #define DEBUG_PRINT_CODE
 #define DUBUG_TRACE_EXECUTION
 
 #define DEBUG_STRESS_GC
 #define DEBUG_LOG_GC
 
+// The VM and the compiler keep their state in thread-local globals, so every thread
+// can run an interpreter of its own (initVM() through freeVM()) next to the others.
+#if defined(_MSC_VER)
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL _Thread_local
+#endif
+
 #define UINT8_COUNT (UINT8_MAX + 1)
 
 #endif
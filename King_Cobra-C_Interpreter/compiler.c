@@ -5,7 +5,10 @@
 #include "common.h"
 #include "compiler.h"
 #include "memory.h"
+#include "optimizer.h"
+#include "regcompiler.h"
 #include "scanner.h"
+#include "vm.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "debug.h"
@@ -20,7 +23,6 @@ typedef struct {
     Token previous;
     bool hadError;
     bool panicMode; // Since we don't have exceptions in C, we need to have a panic mode incase of an error
-    int loopDepth;
 } Parser;
 
 /**
@@ -67,10 +69,22 @@ typedef struct {
 } Local;
 
 typedef struct {
-  uint8_t index;
+  int index;
   bool isLocal;
 } Upvalue;
 
+/**
+ * A loop that is being compiled. A break statement pops the locals declared inside it,
+ * deeper than scopeDepth, and jumps to the loop's exit, which is patched in once the
+ * loop is done.
+*/
+typedef struct Loop {
+    struct Loop* enclosing;
+    int scopeDepth;
+    int breakJumps[UINT8_COUNT];
+    int breakCount;
+} Loop;
+
 typedef enum {
     TYPE_FUNCTION,
     TYPE_INITIALIZER,
@@ -83,10 +97,16 @@ typedef struct Compiler {
     ObjFunction* function;
     FunctionType type;
 
-    Local locals[UINT8_COUNT];
+    // Grows with the function, so locals are only limited by the 24 bit operand.
+    Local* locals;
     int localCount;
+    int localCapacity;
     Upvalue upvalues[UINT8_COUNT];
     int scopeDepth;
+    Loop* loop;     // Innermost loop being compiled in this function, which break leaves
+    int lastCall;   // Offset of the last call or invoke emitted, so a return can turn it into a tail call
+    int lastConstant;   // Offset of the last literal or folded constant, so an operator can fold it
+    int lastTarget;     // Offset that the last patched jump lands on
 } Compiler;
 
 typedef struct ClassCompiler {
@@ -105,25 +125,27 @@ static void advance();
 static void consume(TokenType type, const char* message);
 static bool check(TokenType type);
 static bool match(TokenType type);
-static void emitByte(uint8_t byte);
-static void emitBytes(uint8_t byte1, uint8_t byte2);
+static void emitWord(uint32_t word);
+static void emitOp(uint8_t instruction);
+static void emitOpArg(uint8_t instruction, int arg);
 static int emitJump(uint8_t instruction);
 static void emitReturn();
-static uint8_t makeConstant(Value value);
+static int makeConstant(Value value);
 static void emitConstant(Value value);
 static void patchJump(int offset);
 static void initCompiler(Compiler* compiler, FunctionType type);
 static ObjFunction* endCompiler();
 static void beginScope();
 static void endScope();
-static uint8_t identifierConstant(Token* name);
+static int identifierConstant(Token* name);
+static int globalVariable(Token* name);
 static bool identifiersEqual(Token* a, Token* b);
 static int resolveLocal(Compiler* compiler, Token* name);
 static void addLocal(Token name);
 static void declareVariable();
-static uint8_t parseVariable(const char* errorMessage);
+static int parseVariable(const char* errorMessage);
 static void markInitialized();
-static void defineVariable(uint8_t global);
+static void defineVariable(int global);
 static void binary(bool canAssign);
 static void literal(bool canAssign);
 static void grouping(bool canAssign);
@@ -148,10 +170,9 @@ static void synchronize();
 static void declaration();
 static void statement();
 
-Parser parser;
-Compiler* current = NULL;
-ClassCompiler* currentClass = NULL;
-int breakJump = -1;
+static THREAD_LOCAL Parser parser;
+static THREAD_LOCAL Compiler* current = NULL;
+static THREAD_LOCAL ClassCompiler* currentClass = NULL;
 /**
  * Returns the current chunk that is being compiled.
 */
@@ -242,35 +263,40 @@ static bool match(TokenType type) {
 }
 
 /**
- * Emits a singular byte to a chunk.
+ * Emits a singular instruction word to a chunk.
 */
-static void emitByte(uint8_t byte) {
-    writeChunk(currentChunk(), byte, parser.previous.line);
+static void emitWord(uint32_t word) {
+    writeChunk(currentChunk(), word, parser.previous.line);
 }
 
 /**
- * Emits bytes for input bytes 1 and 2 to the current chunk by calling emitByte.
+ * Emits an instruction that takes no operand.
 */
-static void emitBytes(uint8_t byte1, uint8_t byte2) {
-    emitByte(byte1);
-    emitByte(byte2);
+static void emitOp(uint8_t instruction) {
+    emitWord(INSTR_ENCODE(instruction, 0));
 }
 
-static void emitLoop(int loopStart) {
-    emitByte(OP_LOOP);
+/**
+ * Emits an instruction with its operand in the same word. Callers check that
+ * the operand fits in INSTR_ARG_MAX where it comes from.
+*/
+static void emitOpArg(uint8_t instruction, int arg) {
+    emitWord(INSTR_ENCODE(instruction, arg));
+}
 
-    int offset = currentChunk()->count - loopStart + 2;
-    if (offset > UINT16_MAX) error("Loop body too large.");
+static void emitLoop(int loopStart) {
+    int offset = currentChunk()->count - loopStart + 1;
+    if (offset > INSTR_ARG_MAX) error("Loop body too large.");
 
-    emitByte((offset >> 8) & 0xff);
-    emitByte(offset & 0xff);
+    emitOpArg(OP_LOOP, offset & INSTR_ARG_MAX);
 }
 
+/**
+ * Emits a jump with a placeholder distance and returns its offset for patchJump().
+*/
 static int emitJump(uint8_t instruction) {
-    emitByte(instruction);
-    emitByte(0xff);
-    emitByte(0xff);
-    return currentChunk()->count - 2;
+    emitOpArg(instruction, INSTR_ARG_MAX);
+    return currentChunk()->count - 1;
 }
 
 /**
@@ -278,61 +304,67 @@ static int emitJump(uint8_t instruction) {
 */
 static void emitReturn() {
     if (current->type == TYPE_INITIALIZER) {
-        emitBytes(OP_GET_LOCAL, 0);
+        emitOpArg(OP_GET_LOCAL, 0);
     } 
     else {
-        emitByte(OP_NULL);
+        emitOp(OP_NULL);
     }
-    emitByte(OP_RETURN);
+    emitOp(OP_RETURN);
 }
 
 /**
  * Creates an instruction from a constant value.
 */
-static uint8_t makeConstant(Value value) {
-    // Future Note:
-    // May want to make an instruction that is larger than UINT8_MAX, like OP_CONST_16 for two-byte operands.
+static int makeConstant(Value value) {
     int constant = addConstant(currentChunk(), value);
-    if (constant > UINT8_MAX) {
+    if (constant > INSTR_ARG_MAX) {
         error("Too many constants in one chunk.");
         return 0;
     }
 
-    return (uint8_t)constant;
+    return constant;
 }
 
 /**
  * Handles emitting a constant number.
 */
 static void emitConstant(Value value) {
-    emitBytes(OP_CONSTANT, makeConstant(value));
+    emitOpArg(OP_CONSTANT, makeConstant(value));
+    current->lastConstant = currentChunk()->count - 1;
 }
 
 static void patchJump(int offset) {
-    int jump = currentChunk()->count - offset - 2;
+    int jump = currentChunk()->count - offset - 1;
+    current->lastTarget = currentChunk()->count;
 
-    if (jump > UINT16_MAX) {
-        // potentially add  another function for jumping farther
-        // will also need to either create new emitJumpLong and edit vm.c for OP_JUMP_IF_FALSE case
+    if (jump > INSTR_ARG_MAX) {
         error("Too much code to jump over.");
     }
 
-    currentChunk()->code[offset] = (jump >> 8) & 0xff;
-    currentChunk()->code[offset + 1] = jump & 0xff;
+    uint32_t* code = currentChunk()->code;
+    code[offset] = INSTR_ENCODE(INSTR_OP(code[offset]), jump & INSTR_ARG_MAX);
 }
 
 static void initCompiler(Compiler* compiler, FunctionType type) {
     compiler->enclosing = current;
     compiler->function = NULL;
     compiler->type = type;
+    compiler->locals = NULL;
     compiler->localCount = 0;
+    compiler->localCapacity = 0;
     compiler->scopeDepth = 0;
+    compiler->loop = NULL;
+    compiler->lastCall = -1;
+    compiler->lastConstant = -1;
+    compiler->lastTarget = -1;
     compiler->function = newFunction();
     current = compiler;
     if (type != TYPE_SCRIPT) {
         current->function->name = copyString(parser.previous.start, parser.previous.length);
     }
 
+    current->localCapacity = GROW_CAPACITY(0);
+    current->locals = GROW_ARRAY(Local, current->locals, 0, current->localCapacity);
     Local* local = &current->locals[current->localCount++];
     local->depth = 0;
     local->isCaptured = false;
@@ -352,6 +384,29 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
 static ObjFunction* endCompiler() {
     emitReturn();
     ObjFunction* function = current->function;
+    if (!parser.hadError) {
+        // Build with -DDEBUG_PEEPHOLE to see what each pass takes out of every function.
+        #ifdef DEBUG_PEEPHOLE
+        int emitted = instructionCount(currentChunk());
+        #endif
+        pruneChunk(currentChunk());
+        #ifdef DEBUG_PEEPHOLE
+        int pruned = instructionCount(currentChunk());
+        #endif
+        peepholeChunk(currentChunk());
+        #ifdef DEBUG_PEEPHOLE
+        int simplified = instructionCount(currentChunk());
+        #endif
+        optimizeChunk(currentChunk());
+        #ifdef DEBUG_PEEPHOLE
+        fprintf(stderr, "%s: %d instructions, %d without dead code, %d after the peephole pass, %d after fusing\n",
+            function->name != NULL ? function->name->chars : "<script>",
+            emitted, pruned, simplified, instructionCount(currentChunk()));
+        #endif
+        // The callee and its arguments are already in the frame when the code starts.
+        function->maxStack = maxStackDepth(currentChunk(), function->arity + 1);
+        if (vm.registerEngine) compileRegisterCode(function);
+    }
     // This is only for printing out chunks
     /*
     #ifdef DEBUG_PRINT_CODE
@@ -360,6 +415,7 @@ static ObjFunction* endCompiler() {
     }
     #endif
     */
+    FREE_ARRAY(Local, current->locals, current->localCapacity);
     current = current->enclosing;
     return function;
 }
@@ -373,10 +429,10 @@ static void endScope() {
 
     while(current->localCount > 0 && current->locals[current->localCount -1].depth > current->scopeDepth) {
         if (current->locals[current->localCount - 1].isCaptured) {
-            emitByte(OP_CLOSE_UPVALUE);
+            emitOp(OP_CLOSE_UPVALUE);
         } 
         else {
-            emitByte(OP_POP);
+            emitOp(OP_POP);
         }
         current->localCount--;
     }
@@ -385,10 +441,23 @@ static void endScope() {
 /**
  * The name of a variable is stored as a string in a Chunk's constant table.
 */
-static uint8_t identifierConstant(Token* name) {
+static int identifierConstant(Token* name) {
     return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
 }
 
+/**
+ * Globals are resolved to their slot in vm.globalValues while compiling, so the global
+ * instructions carry a slot index instead of a name constant to look up.
+*/
+static int globalVariable(Token* name) {
+    int slot = globalSlot(copyString(name->start, name->length));
+    if (slot > INSTR_ARG_MAX) {
+        error("Too many global variables.");
+        return 0;
+    }
+    return slot;
+}
+
 static bool identifiersEqual(Token* a, Token* b) {
     if (a->length != b->length) return false;
     return memcmp(a->start, b->start, a->length) == 0;
@@ -408,7 +477,7 @@ static int resolveLocal(Compiler* compiler, Token* name) {
     return -1;
 }
 
-static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal) {
+static int addUpvalue(Compiler* compiler, int index, bool isLocal) {
     int upvalueCount = compiler->function->upvalueCount;
 
     for (int i = 0; i < upvalueCount; i++) {
@@ -434,27 +503,29 @@ static int resolveUpvalue(Compiler* compiler, Token* name) {
     int local = resolveLocal(compiler->enclosing, name);
     if (local != -1) {
         compiler->enclosing->locals[local].isCaptured = true;
-        return addUpvalue(compiler, (uint8_t)local, true);
+        return addUpvalue(compiler, local, true);
     }
 
     int upvalue = resolveUpvalue(compiler->enclosing, name);
     if (upvalue != -1) {
-        return addUpvalue(compiler, (uint8_t)upvalue, false);
+        return addUpvalue(compiler, upvalue, false);
     }
 
     return -1;
 }
 
 static void addLocal(Token name) {
-    // Ideally, try to increase this count to a much larger value or revamp the bytecode representation for more
-    // Currently, you can't have more than 256 local variables in a scope at a time.
-    // An idea is to have a dynamic array of local variables.
-    // Or a drop easy solution would be to use UINT32 (4 bytes) or some large value that will be highly unlikely to be acheived, like UINT64 (8 bytes)
-    if (current->localCount == UINT8_COUNT) {
+    if (current->localCount > INSTR_ARG_MAX) {
         error("Too many local variables in function.");
         return;
     }
 
+    if (current->localCapacity < current->localCount + 1) {
+        int oldCapacity = current->localCapacity;
+        current->localCapacity = GROW_CAPACITY(oldCapacity);
+        current->locals = GROW_ARRAY(Local, current->locals, oldCapacity, current->localCapacity);
+    }
+
     Local* local = &current->locals[current->localCount++];
     local->name = name;
     local->depth = -1;
@@ -482,13 +553,13 @@ static void declareVariable() {
 /**
  * Reads in a variable declaration with name and value.
 */
-static uint8_t parseVariable(const char* errorMessage) {
+static int parseVariable(const char* errorMessage) {
     consume(TOKEN_IDENTIFIER, errorMessage);
 
     declareVariable();
     if (current->scopeDepth > 0) return 0;
 
-    return identifierConstant(&parser.previous);
+    return globalVariable(&parser.previous);
 }
 
 static void markInitialized() {
@@ -497,16 +568,16 @@ static void markInitialized() {
 }
 
 /**
- * The index that a variable's name is assigned in the constant table within a Chunk.
+ * The slot that a global variable's name is assigned in vm.globalValues.
 */
-static void defineVariable(uint8_t global) {
+static void defineVariable(int global) {
     // If the variable that's being defined isn't in the global scope depth, then return
     if (current->scopeDepth > 0) {
         markInitialized();
         return;
     }
 
-    emitBytes(OP_DEFINE_GLOBAL, global);
+    emitOpArg(OP_DEFINE_GLOBAL, global);
 }
 
 static uint8_t argumentList() {
@@ -524,10 +595,86 @@ static uint8_t argumentList() {
     return argCount;
 }
 
+/**
+ * Returns true if the instruction at offset is a literal or an already folded constant
+ * that makes up a whole operand, and stores its value. The code of an operand can end
+ * with a constant and still be longer than it, as with the right side of 'and' and 'or',
+ * but then a jump lands right after it.
+*/
+static bool constantOperand(int offset, Value* value) {
+    Chunk* chunk = currentChunk();
+    if (offset != current->lastConstant || offset != chunk->count - 1 || current->lastTarget == chunk->count) {
+        return false;
+    }
+
+    uint32_t instruction = chunk->code[offset];
+    switch (INSTR_OP(instruction)) {
+        case OP_CONSTANT: *value = chunk->constants.values[INSTR_ARG(instruction)]; return true;
+        case OP_NULL:     *value = NULL_VAL; return true;
+        case OP_TRUE:     *value = BOOL_VAL(true); return true;
+        case OP_FALSE:    *value = BOOL_VAL(false); return true;
+        default:          return false;
+    }
+}
+
+/**
+ * Takes back the code from offset on, which only loads constants, and loads value instead.
+ * The operands stay in the constant table, since constants are shared by every load
+ * of the same value.
+*/
+static void replaceWithConstant(int offset, Value value) {
+    truncateChunk(currentChunk(), offset);
+
+    if (IS_BOOL(value)) {
+        emitOp(AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+    }
+    else if (IS_NULL(value)) {
+        emitOp(OP_NULL);
+    }
+    else {
+        emitConstant(value);
+    }
+    current->lastConstant = offset;
+}
+
+static bool isFalsey(Value value) {
+    return IS_NULL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+/**
+ * Works out a binary operator on two constants the way the VM would, or returns false
+ * if the VM would report an error, which is then left to happen at runtime.
+*/
+static bool foldBinary(TokenType operatorType, Value a, Value b, Value* result) {
+    if (operatorType == TOKEN_EQUAL_EQUAL || operatorType == TOKEN_BANG_EQUAL) {
+        *result = BOOL_VAL(valuesEqual(a, b) == (operatorType == TOKEN_EQUAL_EQUAL));
+        return true;
+    }
+    if (operatorType == TOKEN_PLUS && IS_STRING(a) && IS_STRING(b)) {
+        *result = OBJ_VAL(concatenateStrings(AS_STRING(a), AS_STRING(b)));
+        return true;
+    }
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+    switch (operatorType) {
+        case TOKEN_GREATER:         *result = BOOL_VAL(x > y); return true;
+        case TOKEN_GREATER_EQUAL:   *result = BOOL_VAL(x >= y); return true;
+        case TOKEN_LESS:            *result = BOOL_VAL(x < y); return true;
+        case TOKEN_LESS_EQUAL:      *result = BOOL_VAL(x <= y); return true;
+        case TOKEN_PLUS:            *result = NUMBER_VAL(x + y); return true;
+        case TOKEN_MINUS:           *result = NUMBER_VAL(x - y); return true;
+        case TOKEN_STAR:            *result = NUMBER_VAL(x * y); return true;
+        case TOKEN_SLASH:           *result = NUMBER_VAL(x / y); return true;
+        default:                    return false;
+    }
+}
+
 static void and_(bool canAssign) {
     int endJump = emitJump(OP_JUMP_IF_FALSE);
 
-    emitByte(OP_POP);
+    emitOp(OP_POP);
     parsePrecedence(PREC_AND);
 
     patchJump(endJump);
@@ -539,19 +686,30 @@ static void and_(bool canAssign) {
 static void binary(bool canAssign) {
     TokenType operatorType = parser.previous.type;
     ParseRule* rule = getRule(operatorType);
+    int left = currentChunk()->count - 1;
+    Value a;
+    bool leftConstant = constantOperand(left, &a);
     parsePrecedence((Precedence)(rule->precedence + 1));
 
+    // Two constant operands fold into the constant the operator would produce.
+    Value b;
+    Value result;
+    if (leftConstant && constantOperand(left + 1, &b) && foldBinary(operatorType, a, b, &result)) {
+        replaceWithConstant(left, result);
+        return;
+    }
+
     switch(operatorType) {
-        case TOKEN_BANG_EQUAL:      emitBytes(OP_EQUAL, OP_NOT); break;
-        case TOKEN_EQUAL_EQUAL:     emitByte(OP_EQUAL); break;
-        case TOKEN_GREATER:         emitByte(OP_GREATER); break; 
-        case TOKEN_GREATER_EQUAL:   emitByte(OP_GREATER_EQUAL); break; 
-        case TOKEN_LESS:            emitByte(OP_LESS); break;
-        case TOKEN_LESS_EQUAL:      emitByte(OP_LESS_EQUAL); break;
-        case TOKEN_PLUS:            emitByte(OP_ADD); break;
-        case TOKEN_MINUS:           emitByte(OP_SUBTRACT); break;
-        case TOKEN_STAR:            emitByte(OP_MULTIPLY); break;
-        case TOKEN_SLASH:           emitByte(OP_DIVIDE); break;
+        case TOKEN_BANG_EQUAL:      emitOp(OP_EQUAL); emitOp(OP_NOT); break;
+        case TOKEN_EQUAL_EQUAL:     emitOp(OP_EQUAL); break;
+        case TOKEN_GREATER:         emitOp(OP_GREATER); break; 
+        case TOKEN_GREATER_EQUAL:   emitOp(OP_GREATER_EQUAL); break; 
+        case TOKEN_LESS:            emitOp(OP_LESS); break;
+        case TOKEN_LESS_EQUAL:      emitOp(OP_LESS_EQUAL); break;
+        case TOKEN_PLUS:            emitOp(OP_ADD); break;
+        case TOKEN_MINUS:           emitOp(OP_SUBTRACT); break;
+        case TOKEN_STAR:            emitOp(OP_MULTIPLY); break;
+        case TOKEN_SLASH:           emitOp(OP_DIVIDE); break;
         default:
             return; // Shouldn't reach this part ever!
     }
@@ -586,24 +744,40 @@ static void postfix(bool canAssign) {
 
 static void call(bool canAssign) {
     uint8_t argCount = argumentList();
-    emitBytes(OP_CALL, argCount);
+    current->lastCall = currentChunk()->count;
+    emitOpArg(OP_CALL, argCount);
+}
+
+/**
+ * Adds a new inline cache for the property instruction being emitted and returns its index.
+*/
+static int inlineCache() {
+    int cache = addInlineCache(currentChunk());
+    if (cache > INSTR_ARG_MAX) {
+        error("Too many property accesses in one chunk.");
+        return 0;
+    }
+    return cache;
 }
 
 static void dot(bool canAssign) {
     consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
-    uint8_t name = identifierConstant(&parser.previous);
+    int name = identifierConstant(&parser.previous);
 
     if (canAssign && match(TOKEN_EQUAL)) {
         expression();
-        emitBytes(OP_SET_PROPERTY, name);
+        emitOpArg(OP_SET_PROPERTY, name);
+        emitWord(inlineCache());
     }
     else if (match(TOKEN_LEFT_PAREN)) {
         uint8_t argCount = argumentList();
-        emitBytes(OP_INVOKE, name);
-        emitByte(argCount);
+        current->lastCall = currentChunk()->count;
+        emitOpArg(OP_INVOKE, name);
+        emitWord(INSTR_ENCODE(argCount, inlineCache()));
     }
     else {
-        emitBytes(OP_GET_PROPERTY, name);
+        emitOpArg(OP_GET_PROPERTY, name);
+        emitWord(inlineCache());
     }
 }
 
@@ -614,11 +788,12 @@ static void dot(bool canAssign) {
 */
 static void literal(bool canAssign) {
     switch(parser.previous.type) {
-        case TOKEN_FALSE: emitByte(OP_FALSE); break;
-        case TOKEN_NULL: emitByte(OP_NULL); break;
-        case TOKEN_TRUE: emitByte(OP_TRUE); break;
+        case TOKEN_FALSE: emitOp(OP_FALSE); break;
+        case TOKEN_NULL: emitOp(OP_NULL); break;
+        case TOKEN_TRUE: emitOp(OP_TRUE); break;
         default: return;
     }
+    current->lastConstant = currentChunk()->count - 1;
 }
 
 /**
@@ -643,7 +818,7 @@ static void or_(bool canAssign) {
     int endJump = emitJump(OP_JUMP);
 
     patchJump(elseJump);
-    emitByte(OP_POP);
+    emitOp(OP_POP);
 
     parsePrecedence(PREC_OR);
     patchJump(endJump);
@@ -657,12 +832,12 @@ static void string(bool canAssign) {
 }
 
 static void list(bool canAssign) {
-    //emitByte(OBJ_LIST())
+    //emitOp(OBJ_LIST())
     // Use allocateList() like strings do to get this to work.
 }
 
 /**
- * Calls identifierConstant() for taking a token and adding it to a Chunk's constant table as a string.
+ * Calls globalVariable() for resolving a name that isn't a local or an upvalue to its global slot.
  * "Helper Function"
 */
 static void namedVariable(Token name, bool canAssign) {
@@ -677,40 +852,40 @@ static void namedVariable(Token name, bool canAssign) {
         setOp = OP_SET_UPVALUE;
     }
     else {
-        arg = identifierConstant(&name);
+        arg = globalVariable(&name);
         getOp = OP_GET_GLOBAL;
         setOp = OP_SET_GLOBAL;
     }
     if (canAssign && match(TOKEN_EQUAL)) {
         expression();
-        emitBytes(setOp, (uint8_t)arg);
+        emitOpArg(setOp, arg);
     }
     else if(canAssign && match(TOKEN_STAR_EQUAL)) {
-        emitBytes(getOp, (uint8_t)arg);
+        emitOpArg(getOp, arg);
         expression();
-        emitByte(OP_MULTIPLY);
-        emitBytes(setOp, (uint8_t)arg);
+        emitOp(OP_MULTIPLY);
+        emitOpArg(setOp, arg);
     }
     else if(canAssign && match(TOKEN_SLASH_EQUAL)) {
-        emitBytes(getOp, (uint8_t)arg);
+        emitOpArg(getOp, arg);
         expression();
-        emitByte(OP_DIVIDE);
-        emitBytes(setOp, (uint8_t)arg);
+        emitOp(OP_DIVIDE);
+        emitOpArg(setOp, arg);
     }
     else if(canAssign && match(TOKEN_PLUS_EQUAL)) {
-        emitBytes(getOp, (uint8_t)arg);
+        emitOpArg(getOp, arg);
         expression();
-        emitByte(OP_ADD);
-        emitBytes(setOp, (uint8_t)arg);
+        emitOp(OP_ADD);
+        emitOpArg(setOp, arg);
     }
     else if(canAssign && match(TOKEN_MINUS_EQUAL)) {
-        emitBytes(getOp, (uint8_t)arg);
+        emitOpArg(getOp, arg);
         expression();
-        emitByte(OP_SUBTRACT);
-        emitBytes(setOp, (uint8_t)arg);
+        emitOp(OP_SUBTRACT);
+        emitOpArg(setOp, arg);
     }
     else {
-        emitBytes(getOp, (uint8_t)arg);
+        emitOpArg(getOp, arg);
     }
 }
 
@@ -738,18 +913,19 @@ static void super_(bool canAssign) {
 
     consume(TOKEN_DOT, "Expect '.' after 'super'.");
     consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
-    uint8_t name = identifierConstant(&parser.previous);
+    int name = identifierConstant(&parser.previous);
 
     namedVariable(syntheticToken("this"), false);
     if (match(TOKEN_LEFT_PAREN)) {
         uint8_t argCount = argumentList();
         namedVariable(syntheticToken("super"), false);
-        emitBytes(OP_SUPER_INVOKE, name);
-        emitByte(argCount);
+        current->lastCall = currentChunk()->count;
+        emitOpArg(OP_SUPER_INVOKE, name);
+        emitWord(INSTR_ENCODE(argCount, 0));
     } 
     else {
         namedVariable(syntheticToken("super"), false);
-        emitBytes(OP_GET_SUPER, name);
+        emitOpArg(OP_GET_SUPER, name);
     }
 }
 
@@ -775,12 +951,26 @@ static void unary(bool canAssign) {
     TokenType operatorType = parser.previous.type;
 
     // Compile the operand
+    int operand = currentChunk()->count;
     parsePrecedence(PREC_UNARY);
 
+    // A constant operand folds into the result instead
+    Value value;
+    if (constantOperand(operand, &value)) {
+        if (operatorType == TOKEN_BANG) {
+            replaceWithConstant(operand, BOOL_VAL(isFalsey(value)));
+            return;
+        }
+        if (operatorType == TOKEN_MINUS && IS_NUMBER(value)) {
+            replaceWithConstant(operand, NUMBER_VAL(-AS_NUMBER(value)));
+            return;
+        }
+    }
+
     // Emit the operator instruction
     switch(operatorType) {
-        case TOKEN_BANG: emitByte(OP_NOT); break;
-        case TOKEN_MINUS: emitByte(OP_NEGATE); break;
+        case TOKEN_BANG: emitOp(OP_NOT); break;
+        case TOKEN_MINUS: emitOp(OP_NEGATE); break;
         default: return; // Unreachable
     }
 }
@@ -902,7 +1092,7 @@ static void function(FunctionType type) {
             if (current->function->arity > 255) {
                 errorAtCurrent("Can't have more than 255 parameters.");
             }
-            uint8_t constant = parseVariable("Expect parameter name.");
+            int constant = parseVariable("Expect parameter name.");
             defineVariable(constant);
         } while(match(TOKEN_COMMA));
     }
@@ -911,16 +1101,16 @@ static void function(FunctionType type) {
     block();
 
     ObjFunction* function = endCompiler();
-    emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
+    emitOpArg(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
     for (int i = 0; i < function->upvalueCount; i++) {
-        emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
-        emitByte(compiler.upvalues[i].index);
+        emitWord(INSTR_ENCODE(compiler.upvalues[i].isLocal ? 1 : 0, compiler.upvalues[i].index));
     }
 }
 
 static void method() {
     consume(TOKEN_IDENTIFIER, "Expect method name.");
-    uint8_t constant = identifierConstant(&parser.previous);
+    int constant = identifierConstant(&parser.previous);
+    methodSelector(AS_STRING(currentChunk()->constants.values[constant]));
 
     FunctionType type = TYPE_METHOD;
     if (parser.previous.length == 4 && memcmp(parser.previous.start, "init", 4) == 0) {
@@ -928,17 +1118,17 @@ static void method() {
     }
 
     function(type);
-    emitBytes(OP_METHOD, constant);
+    emitOpArg(OP_METHOD, constant);
 }
 
 static void classDeclaration() {
     consume(TOKEN_IDENTIFIER, "Expect class name.");
     Token className = parser.previous;
-    uint8_t nameConstant = identifierConstant(&parser.previous);
+    int nameConstant = identifierConstant(&parser.previous);
     declareVariable();
 
-    emitBytes(OP_CLASS, nameConstant);
-    defineVariable(nameConstant);
+    emitOpArg(OP_CLASS, nameConstant);
+    defineVariable(current->scopeDepth > 0 ? 0 : globalVariable(&className));
 
     ClassCompiler classCompiler;
     classCompiler.hasSuperclass = false;
@@ -960,7 +1150,7 @@ static void classDeclaration() {
 
         namedVariable(className, false);
         consume(TOKEN_RIGHT_PAREN, "Expected closing ')' parenthesis for declaring superclass for inheritance.");
-        emitByte(OP_INHERIT);
+        emitOp(OP_INHERIT);
         classCompiler.hasSuperclass = true;
     }
 
@@ -970,7 +1160,7 @@ static void classDeclaration() {
         method();
     }
     consume(TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
-    emitByte(OP_POP);
+    emitOp(OP_POP);
 
     if (classCompiler.hasSuperclass) {
         endScope();
@@ -980,7 +1170,7 @@ static void classDeclaration() {
 }
 
 static void functionDeclaration() {
-    uint8_t global = parseVariable("expect function name.");
+    int global = parseVariable("expect function name.");
     markInitialized();
     function(TYPE_FUNCTION);
     defineVariable(global);
@@ -990,13 +1180,13 @@ static void functionDeclaration() {
  * Compiles variable declarations.
 */
 static void varDeclaration() {
-    uint8_t global = parseVariable("Expect variable name.");
+    int global = parseVariable("Expect variable name.");
 
     if (match(TOKEN_EQUAL)) {
         expression();
     }
     else {
-        emitByte(OP_NULL);
+        emitOp(OP_NULL);
     }
     consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
 
@@ -1010,27 +1200,125 @@ static void varDeclaration() {
 static void expressionStatement() {
     expression();
     consume(TOKEN_SEMICOLON, "Expect ';' after expression.");
-    emitByte(OP_POP);
+    emitOp(OP_POP);
+}
+
+/**
+ * Starts compiling a loop whose body break statements can leave.
+*/
+static void beginLoop(Loop* loop) {
+    loop->enclosing = current->loop;
+    loop->scopeDepth = current->scopeDepth;
+    loop->breakCount = 0;
+    current->loop = loop;
 }
 
+/**
+ * Ends the innermost loop, whose break statements jump to the end of the chunk.
+*/
+static void endLoop() {
+    Loop* loop = current->loop;
+    for (int i = 0; i < loop->breakCount; i++) {
+        patchJump(loop->breakJumps[i]);
+    }
+    current->loop = loop->enclosing;
+}
+
+/**
+ * Compiles a break statement, which has to be inside of a loop. It pops the locals
+ * declared inside the innermost loop and jumps to its exit, which endLoop() patches in.
+*/
 static void breakStatement() {
-    // Just check if we're inside of a loop and consume the token
-    if(parser.loopDepth < 1) {
+    Loop* loop = current->loop;
+    if (loop == NULL) {
         error("ERROR: Can only use break statements inside of loops.");
+        return;
     }
-    else {
-        consume(TOKEN_SEMICOLON, "Expect ';' after break statement.");
-        breakJump = emitJump(OP_JUMP);
+    consume(TOKEN_SEMICOLON, "Expect ';' after break statement.");
+
+    // The locals of the loop body stay declared after the break, so they are only popped.
+    for (int i = current->localCount - 1; i >= 0 && current->locals[i].depth > loop->scopeDepth; i--) {
+        emitOp(current->locals[i].isCaptured ? OP_CLOSE_UPVALUE : OP_POP);
     }
+    if (loop->breakCount == UINT8_COUNT) {
+        error("Too many break statements in one loop.");
+        return;
+    }
+    loop->breakJumps[loop->breakCount++] = emitJump(OP_JUMP);
+}
+
+/**
+ * Returns true if the code from offset on is the condition of a range loop,
+ * 'counter < limit' with a local or a constant limit, and stores the limit as the
+ * word that follows OP_FOR_RANGE.
+*/
+static bool rangeCondition(int offset, int counter, uint32_t* limit) {
+    Chunk* chunk = currentChunk();
+    uint32_t* code = chunk->code + offset;
+    if (chunk->count - offset != 3 || code[0] != INSTR_ENCODE(OP_GET_LOCAL, counter) ||
+        INSTR_OP(code[2]) != OP_LESS) {
+        return false;
+    }
+
+    switch (INSTR_OP(code[1])) {
+        case OP_GET_LOCAL: *limit = INSTR_ENCODE(0, INSTR_ARG(code[1])); return true;
+        case OP_CONSTANT:  *limit = INSTR_ENCODE(1, INSTR_ARG(code[1])); return true;
+        default:           return false;
+    }
+}
+
+/**
+ * Returns true if the code from offset on is the increment of a range loop,
+ * 'counter = counter + step' or 'counter += step' with a number step, and stores
+ * the constant of the step.
+*/
+static bool rangeIncrement(int offset, int counter, int* step) {
+    Chunk* chunk = currentChunk();
+    uint32_t* code = chunk->code + offset;
+    if (chunk->count - offset != 5 || code[0] != INSTR_ENCODE(OP_GET_LOCAL, counter) ||
+        INSTR_OP(code[1]) != OP_CONSTANT || INSTR_OP(code[2]) != OP_ADD ||
+        code[3] != INSTR_ENCODE(OP_SET_LOCAL, counter) || INSTR_OP(code[4]) != OP_POP) {
+        return false;
+    }
+
+    *step = INSTR_ARG(code[1]);
+    return IS_NUMBER(chunk->constants.values[*step]) && counter <= INSTR_AB_MAX && *step <= INSTR_AB_MAX;
+}
+
+/**
+ * Compiles the body of a range loop, whose condition has already been tested once,
+ * and closes the loop with a single OP_FOR_RANGE that steps the counter and goes back
+ * to the body while it is below the limit. Falling out of it, like a break, skips the
+ * POP of the condition that the exit jump leaves behind.
+*/
+static void rangeLoop(int counter, uint32_t limit, int step, int exitJump, int line) {
+    int bodyStart = currentChunk()->count;
+    statement();
+
+    Chunk* chunk = currentChunk();
+    writeChunk(chunk, INSTR_ENCODE_AB(OP_FOR_RANGE, counter, step), line);
+    writeChunk(chunk, limit, line);
+    int offset = chunk->count - bodyStart + 1;
+    if (offset > INSTR_ARG_MAX) error("Loop body too large.");
+    writeChunk(chunk, INSTR_ENCODE(0, offset & INSTR_ARG_MAX), line);
+    int endJump = emitJump(OP_JUMP);
+
+    patchJump(exitJump);
+    emitOp(OP_POP);
+    patchJump(endJump);
+    endLoop();
 }
 
 static void forStatement() {
-    parser.loopDepth += 1;
+    Loop loop;
     beginScope();
+    beginLoop(&loop);
     consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
+    int counter = -1;
     if (match(TOKEN_SEMICOLON)) {} // This is one of those infinite loop conditions or no variable declared
     else if (match(TOKEN_VAR)) {
         varDeclaration();
+        counter = current->localCount - 1;
     }
     else {
         expressionStatement();
@@ -1038,23 +1326,38 @@ static void forStatement() {
 
     int loopStart = currentChunk()->count;
     int exitJump = -1;
-    breakJump = -1;
 
+    uint32_t limit = 0;
     if (!match(TOKEN_SEMICOLON)) {
         expression();
         consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
+        if (counter != -1 && !rangeCondition(loopStart, counter, &limit)) counter = -1;
 
         exitJump = emitJump(OP_JUMP_IF_FALSE);
-        emitByte(OP_POP);
+        emitOp(OP_POP);
+    }
+    else {
+        counter = -1;
     }
 
     if (!match(TOKEN_RIGHT_PAREN)) {
         int bodyJump = emitJump(OP_JUMP);
         int incrementStart = currentChunk()->count;
         expression();
-        emitByte(OP_POP);
+        emitOp(OP_POP);
         consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
 
+        int step;
+        if (counter != -1 && rangeIncrement(incrementStart, counter, &step)) {
+            // for (var i = a; i < b; i += c) steps, tests and loops in one instruction.
+            int line = parser.previous.line;
+            truncateChunk(currentChunk(), bodyJump);
+            current->lastConstant = -1;
+            rangeLoop(counter, limit, step, exitJump, line);
+            endScope();
+            return;
+        }
+
         emitLoop(loopStart);
         loopStart = incrementStart;
         patchJump(bodyJump);
@@ -1063,16 +1366,40 @@ static void forStatement() {
     statement();
     emitLoop(loopStart);
 
-    if (breakJump != -1) {
-        patchJump(breakJump);
-    }
     if (exitJump != -1) {
         patchJump(exitJump);
-        emitByte(OP_POP);
+        emitOp(OP_POP);
     }
-
+    endLoop();
     endScope();
-    parser.loopDepth -= 1;
+}
+
+/**
+ * Compiles a condition that starts at the end of the chunk. If it turns out to be a
+ * constant, its code is taken back and the constant is stored in value.
+*/
+static bool constantCondition(Value* value) {
+    int start = currentChunk()->count;
+    expression();
+    if (!constantOperand(start, value)) return false;
+
+    truncateChunk(currentChunk(), start);
+    current->lastConstant = -1;
+    return true;
+}
+
+/**
+ * Compiles a statement that can never run, so that its errors are still reported,
+ * and then takes its code back.
+*/
+static void deadStatement() {
+    int start = currentChunk()->count;
+    int breakCount = current->loop == NULL ? 0 : current->loop->breakCount;
+    statement();
+    truncateChunk(currentChunk(), start);
+    if (current->loop != NULL) current->loop->breakCount = breakCount;
+    current->lastCall = -1;
+    current->lastConstant = -1;
 }
 
 static void ifStatement() {
@@ -1080,16 +1407,28 @@ static void ifStatement() {
     // that way, we can have multiple ways to write an if statement, even the one like python}
 
     //consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'");
-    expression();
+    Value condition;
+    if (constantCondition(&condition)) {
+        // Only the branch that the constant picks gets any code.
+        if (isFalsey(condition)) {
+            deadStatement();
+            if (match(TOKEN_ELSE)) statement();
+        }
+        else {
+            statement();
+            if (match(TOKEN_ELSE)) deadStatement();
+        }
+        return;
+    }
     //consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
     int thenJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP);
+    emitOp(OP_POP);
     statement();
 
     int elseJump = emitJump(OP_JUMP);
 
     patchJump(thenJump);
-    emitByte(OP_POP);
+    emitOp(OP_POP);
 
     if (match(TOKEN_ELSE)) statement();
     patchJump(elseJump);
@@ -1101,7 +1440,7 @@ static void ifStatement() {
 static void printStatement() {
     expression();
     consume(TOKEN_SEMICOLON, "EXPECT ';' after value.");
-    emitByte(OP_PRINT);
+    emitOp(OP_PRINT);
 }
 
 static void returnStatement() {
@@ -1119,29 +1458,46 @@ static void returnStatement() {
         
         expression();
         consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
-        emitByte(OP_RETURN);
+        // A call that ends the return value is in tail position.
+        int lastCall = current->lastCall;
+        if (lastCall != -1 && lastCall + instructionLength(currentChunk(), lastCall) == currentChunk()->count) {
+            uint32_t* code = currentChunk()->code;
+            uint32_t op = INSTR_OP(code[lastCall]);
+            uint32_t tailOp = op == OP_CALL ? OP_TAIL_CALL : op == OP_INVOKE ? OP_TAIL_INVOKE : OP_TAIL_SUPER_INVOKE;
+            code[lastCall] = INSTR_ENCODE(tailOp, INSTR_ARG(code[lastCall]));
+        }
+        emitOp(OP_RETURN);
     }
 }
 
 static void whileStatement() {
-    parser.loopDepth += 1;
-    breakJump = -1;
+    Loop loop;
+    beginLoop(&loop);
     int loopStart = currentChunk()->count;
     //consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
-    expression();
+    Value condition;
+    if (constantCondition(&condition)) {
+        // A loop that never runs has no code and one that never stops has no exit test.
+        if (isFalsey(condition)) {
+            deadStatement();
+        }
+        else {
+            statement();
+            emitLoop(loopStart);
+        }
+        endLoop();
+        return;
+    }
     //consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
     int exitJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP);
+    emitOp(OP_POP);
     statement();
     emitLoop(loopStart);
 
     patchJump(exitJump);
-    if (breakJump != -1) {
-        patchJump(breakJump);
-    }
-    emitByte(OP_POP);
-    parser.loopDepth -= 1;
+    emitOp(OP_POP);
+    endLoop();
 }
 
 /**
@@ -1237,7 +1593,6 @@ ObjFunction* compile(const char* source) {
 
     parser.hadError = false;
     parser.panicMode = false;
-    parser.loopDepth = 0;
 
     advance();
     
@@ -2,6 +2,7 @@
 #include "debug.h"
 #include "object.h"
 #include "value.h"
+#include "vm.h"
 
 void disassembleChunk(Chunk* chunk, const char* name) {
     printf("== %s ==\n", name);
@@ -12,20 +13,39 @@ void disassembleChunk(Chunk* chunk, const char* name) {
 }
 
 static int constantInstruction(const char* name, Chunk* chunk, int offset) {
-    uint8_t constant = chunk->code[offset + 1];
+    uint32_t constant = INSTR_ARG(chunk->code[offset]);
     printf("%-16s %4d'", name, constant);
     printValue(chunk->constants.values[constant]);
     printf("'\n");
-    return offset+2;
+    return offset + 1;
 }
 
 static int invokeInstruction(const char* name, Chunk* chunk, int offset) {
-    uint8_t constant = chunk->code[offset + 1];
-    uint8_t argCount = chunk->code[offset + 2];
+    uint32_t constant = INSTR_ARG(chunk->code[offset]);
+    uint32_t argCount = INSTR_OP(chunk->code[offset + 1]);
     printf("%-16s (%d args) %4d '", name, argCount, constant);
     printValue(chunk->constants.values[constant]);
     printf("'\n");
-    return offset + 3;
+    return offset + 2;
+}
+
+static int propertyInstruction(const char* name, Chunk* chunk, int offset) {
+    uint32_t constant = INSTR_ARG(chunk->code[offset]);
+    uint32_t cache = chunk->code[offset + 1];
+    printf("%-16s %4d '", name, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("' ic %d\n", cache);
+    return offset + 2;
+}
+
+static int cachedInvokeInstruction(const char* name, Chunk* chunk, int offset) {
+    uint32_t constant = INSTR_ARG(chunk->code[offset]);
+    uint32_t argCount = INSTR_OP(chunk->code[offset + 1]);
+    uint32_t cache = INSTR_ARG(chunk->code[offset + 1]);
+    printf("%-16s (%d args) %4d '", name, argCount, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("' ic %d\n", cache);
+    return offset + 2;
 }
 
 static int simpleInstruction(const char* name, int offset) {
@@ -33,33 +53,62 @@ static int simpleInstruction(const char* name, int offset) {
     return offset + 1;
 }
 
-static int byteInstruction(const char* name, Chunk* chunk, int offset) {
-    uint8_t slot = chunk->code[offset + 1];
+static int operandInstruction(const char* name, Chunk* chunk, int offset) {
+    uint32_t slot = INSTR_ARG(chunk->code[offset]);
     printf("%-16s %4d\n", name, slot);
-    return offset + 2;
+    return offset + 1;
+}
+
+static int slotConstantInstruction(const char* name, Chunk* chunk, int offset) {
+    uint32_t slot = INSTR_A(chunk->code[offset]);
+    uint32_t constant = INSTR_B(chunk->code[offset]);
+    printf("%-16s %4d %4d'", name, slot, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + 1;
 }
 
-static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset) {
-    uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
-    jump |= chunk->code[offset + 2];
-    printf("%-16s %4d -> %d\n", name, offset, offset  + 3 + sign * jump);    
+static int twoSlotInstruction(const char* name, Chunk* chunk, int offset) {
+    uint32_t first = INSTR_A(chunk->code[offset]);
+    uint32_t second = INSTR_B(chunk->code[offset]);
+    printf("%-16s %4d %4d\n", name, first, second);
+    return offset + 1;
+}
+
+static int forRangeInstruction(const char* name, Chunk* chunk, int offset) {
+    uint32_t* code = chunk->code + offset;
+    printf("%-16s %4d %4d'", name, INSTR_A(code[0]), INSTR_B(code[0]));
+    printValue(chunk->constants.values[INSTR_B(code[0])]);
+    printf("' %s%d -> %d\n", INSTR_OP(code[1]) ? "k" : "slot ", INSTR_ARG(code[1]), jumpTarget(chunk, offset));
     return offset + 3;
 }
 
+static int globalInstruction(const char* name, Chunk* chunk, int offset) {
+    uint32_t slot = INSTR_ARG(chunk->code[offset]);
+    printf("%-16s %4d '%s'\n", name, slot, GLOBAL_NAME(slot)->chars);
+    return offset + 1;
+}
+
+static int jumpInstruction(const char* name, Chunk* chunk, int offset) {
+    printf("%-16s %4d -> %d\n", name, offset, jumpTarget(chunk, offset));
+    return offset + 1;
+}
+
 // Reads the instruction in each bit-field range 
 // which is referred to as the "offset" and gets the components
 // of that instruction. For example, the opcode portion of the instruction
 int disassembleInstruction(Chunk* chunk, int offset) {
     printf("%04d ", offset);
     
-    if(offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
+    int line = getLine(&chunk->lines, offset);
+    if(offset > 0 && line == getLine(&chunk->lines, offset - 1)) {
         printf("    | ");
     }
     else {
-        printf("%4d ", chunk->lines[offset]);
+        printf("%4d ", line);
     }
 
-    uint8_t instruction = chunk->code[offset];
+    uint8_t instruction = INSTR_OP(chunk->code[offset]);
     switch(instruction) {
         case OP_CONSTANT:
             return constantInstruction("OP_CONSTANT", chunk, offset);
@@ -72,23 +121,23 @@ int disassembleInstruction(Chunk* chunk, int offset) {
         case OP_POP:
             return simpleInstruction("OP_POP", offset);
         case OP_GET_LOCAL:
-            return byteInstruction("OP_GET_LOCAL", chunk, offset);  // In the future, return names of local variables with/without their slots
+            return operandInstruction("OP_GET_LOCAL", chunk, offset);  // In the future, return names of local variables with/without their slots
         case OP_SET_LOCAL:
-            return byteInstruction("OP_SET_LOCAL", chunk, offset);  // In the future, return names of local variables with/without their slots
+            return operandInstruction("OP_SET_LOCAL", chunk, offset);  // In the future, return names of local variables with/without their slots
         case OP_GET_GLOBAL:
-            return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+            return globalInstruction("OP_GET_GLOBAL", chunk, offset);
         case OP_DEFINE_GLOBAL:
-            return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+            return globalInstruction("OP_DEFINE_GLOBAL", chunk, offset);
         case OP_SET_GLOBAL:
-            return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+            return globalInstruction("OP_SET_GLOBAL", chunk, offset);
         case OP_GET_UPVALUE:
-            return byteInstruction("OP_GET_UPVALUE", chunk, offset);
+            return operandInstruction("OP_GET_UPVALUE", chunk, offset);
         case OP_SET_UPVALUE:
-            return byteInstruction("OP_SET_UPVALUE", chunk, offset);
+            return operandInstruction("OP_SET_UPVALUE", chunk, offset);
         case OP_GET_PROPERTY:
-            return constantInstruction("OP_GET_PROPERTY", chunk, offset);
+            return propertyInstruction("OP_GET_PROPERTY", chunk, offset);
         case OP_SET_PROPERTY:
-            return constantInstruction("OP_SET_PROPERTY", chunk, offset);
+            return propertyInstruction("OP_SET_PROPERTY", chunk, offset);
         case OP_GET_SUPER:
             return constantInstruction("OP_GET_SUPER", chunk, offset);
         case OP_EQUAL:
@@ -97,6 +146,12 @@ int disassembleInstruction(Chunk* chunk, int offset) {
             return simpleInstruction("OP_GREATER", offset);
         case OP_LESS:
             return simpleInstruction("OP_LESS", offset);
+        case OP_GREATER_EQUAL:
+            return simpleInstruction("OP_GREATER_EQUAL", offset);
+        case OP_LESS_EQUAL:
+            return simpleInstruction("OP_LESS_EQUAL", offset);
+        case OP_NOT_EQUAL:
+            return simpleInstruction("OP_NOT_EQUAL", offset);
         case OP_ADD:
             return simpleInstruction("OP_ADD", offset);
         case OP_SUBTRACT:
@@ -112,20 +167,25 @@ int disassembleInstruction(Chunk* chunk, int offset) {
         case OP_PRINT:
             return simpleInstruction("OP_PRINT", offset);
         case OP_JUMP:
-            return jumpInstruction("OP_JUMP", 1, chunk, offset);
+            return jumpInstruction("OP_JUMP", chunk, offset);
         case OP_JUMP_IF_FALSE:
-            return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
+            return jumpInstruction("OP_JUMP_IF_FALSE", chunk, offset);
         case OP_LOOP:
-            return jumpInstruction("OP_LOOP", -1, chunk, offset);
+            return jumpInstruction("OP_LOOP", chunk, offset);
         case OP_CALL:
-            return byteInstruction("OP_CALL", chunk, offset);
+            return operandInstruction("OP_CALL", chunk, offset);
+        case OP_TAIL_CALL:
+            return operandInstruction("OP_TAIL_CALL", chunk, offset);
         case OP_INVOKE:
-            return invokeInstruction("OP_INVOKE", chunk, offset);
+            return cachedInvokeInstruction("OP_INVOKE", chunk, offset);
         case OP_SUPER_INVOKE:
             return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
+        case OP_TAIL_INVOKE:
+            return cachedInvokeInstruction("OP_TAIL_INVOKE", chunk, offset);
+        case OP_TAIL_SUPER_INVOKE:
+            return invokeInstruction("OP_TAIL_SUPER_INVOKE", chunk, offset);
         case OP_CLOSURE: {
-            offset++;
-            uint8_t constant = chunk->code[offset++];
+            uint32_t constant = INSTR_ARG(chunk->code[offset++]);
             printf("%-16s %4d ", "OP_CLOSURE", constant);
             printValue(chunk->constants.values[constant]);
             printf("\n");
@@ -133,10 +193,9 @@ int disassembleInstruction(Chunk* chunk, int offset) {
             ObjFunction* function = AS_FUNCTION(
             chunk->constants.values[constant]);
             for (int j = 0; j < function->upvalueCount; j++) {
-                int isLocal = chunk->code[offset++];
-                int index = chunk->code[offset++];
+                uint32_t upvalue = chunk->code[offset++];
                 printf("%04d      |                     %s %d\n",
-                    offset - 2, isLocal ? "local" : "upvalue", index);
+                    offset - 1, INSTR_OP(upvalue) ? "local" : "upvalue", INSTR_ARG(upvalue));
             }
 
             return offset;
@@ -151,9 +210,257 @@ int disassembleInstruction(Chunk* chunk, int offset) {
             return simpleInstruction("OP_INHERIT", offset);
         case OP_METHOD:
             return constantInstruction("OP_METHOD", chunk, offset);
+        case OP_FOR_RANGE:
+            return forRangeInstruction("OP_FOR_RANGE", chunk, offset);
+        case OP_GET_LOCAL_CONSTANT:
+            return slotConstantInstruction("OP_GET_LOCAL_CONSTANT", chunk, offset);
+        case OP_ADD_LOCALS:
+            return twoSlotInstruction("OP_ADD_LOCALS", chunk, offset);
+        case OP_INCREMENT_LOCAL:
+            return slotConstantInstruction("OP_INCREMENT_LOCAL", chunk, offset);
+        case OP_SET_LOCAL_POP:
+            return operandInstruction("OP_SET_LOCAL_POP", chunk, offset);
+        case OP_JUMP_IF_FALSE_POP:
+            return jumpInstruction("OP_JUMP_IF_FALSE_POP", chunk, offset);
+        case OP_LESS_JUMP_IF_FALSE:
+            return jumpInstruction("OP_LESS_JUMP_IF_FALSE", chunk, offset);
+        case OP_EQUAL_NUM:
+            return simpleInstruction("OP_EQUAL_NUM", offset);
+        case OP_ADD_NUM:
+            return simpleInstruction("OP_ADD_NUM", offset);
+        case OP_ADD_STR:
+            return simpleInstruction("OP_ADD_STR", offset);
+        case OP_ADD_LOCALS_NUM:
+            return twoSlotInstruction("OP_ADD_LOCALS_NUM", chunk, offset);
+        case OP_EQUAL_ANY:
+            return simpleInstruction("OP_EQUAL_ANY", offset);
+        case OP_ADD_ANY:
+            return simpleInstruction("OP_ADD_ANY", offset);
+        case OP_ADD_LOCALS_ANY:
+            return twoSlotInstruction("OP_ADD_LOCALS_ANY", chunk, offset);
         default:
             printf("Unknown opcode %d\n", instruction);
             return offset + 1;
     }
 
 }
+
+/**
+ * Returns the printable name of an opcode.
+*/
+const char* opcodeName(uint8_t opcode) {
+    switch(opcode) {
+        case OP_CONSTANT: return "OP_CONSTANT";
+        case OP_NULL: return "OP_NULL";
+        case OP_TRUE: return "OP_TRUE";
+        case OP_FALSE: return "OP_FALSE";
+        case OP_POP: return "OP_POP";
+        case OP_GET_LOCAL: return "OP_GET_LOCAL";
+        case OP_SET_LOCAL: return "OP_SET_LOCAL";
+        case OP_GET_GLOBAL: return "OP_GET_GLOBAL";
+        case OP_DEFINE_GLOBAL: return "OP_DEFINE_GLOBAL";
+        case OP_SET_GLOBAL: return "OP_SET_GLOBAL";
+        case OP_GET_UPVALUE: return "OP_GET_UPVALUE";
+        case OP_SET_UPVALUE: return "OP_SET_UPVALUE";
+        case OP_GET_PROPERTY: return "OP_GET_PROPERTY";
+        case OP_SET_PROPERTY: return "OP_SET_PROPERTY";
+        case OP_GET_SUPER: return "OP_GET_SUPER";
+        case OP_EQUAL: return "OP_EQUAL";
+        case OP_GREATER: return "OP_GREATER";
+        case OP_LESS: return "OP_LESS";
+        case OP_GREATER_EQUAL: return "OP_GREATER_EQUAL";
+        case OP_LESS_EQUAL: return "OP_LESS_EQUAL";
+        case OP_NOT_EQUAL: return "OP_NOT_EQUAL";
+        case OP_ADD: return "OP_ADD";
+        case OP_SUBTRACT: return "OP_SUBTRACT";
+        case OP_MULTIPLY: return "OP_MULTIPLY";
+        case OP_DIVIDE: return "OP_DIVIDE";
+        case OP_NOT: return "OP_NOT";
+        case OP_NEGATE: return "OP_NEGATE";
+        case OP_PRINT: return "OP_PRINT";
+        case OP_JUMP: return "OP_JUMP";
+        case OP_JUMP_IF_FALSE: return "OP_JUMP_IF_FALSE";
+        case OP_LOOP: return "OP_LOOP";
+        case OP_CALL: return "OP_CALL";
+        case OP_TAIL_CALL: return "OP_TAIL_CALL";
+        case OP_INVOKE: return "OP_INVOKE";
+        case OP_SUPER_INVOKE: return "OP_SUPER_INVOKE";
+        case OP_TAIL_INVOKE: return "OP_TAIL_INVOKE";
+        case OP_TAIL_SUPER_INVOKE: return "OP_TAIL_SUPER_INVOKE";
+        case OP_CLOSURE: return "OP_CLOSURE";
+        case OP_CLOSE_UPVALUE: return "OP_CLOSE_UPVALUE";
+        case OP_RETURN: return "OP_RETURN";
+        case OP_CLASS: return "OP_CLASS";
+        case OP_INHERIT: return "OP_INHERIT";
+        case OP_METHOD: return "OP_METHOD";
+        case OP_FOR_RANGE: return "OP_FOR_RANGE";
+        case OP_GET_LOCAL_CONSTANT: return "OP_GET_LOCAL_CONSTANT";
+        case OP_ADD_LOCALS: return "OP_ADD_LOCALS";
+        case OP_INCREMENT_LOCAL: return "OP_INCREMENT_LOCAL";
+        case OP_SET_LOCAL_POP: return "OP_SET_LOCAL_POP";
+        case OP_JUMP_IF_FALSE_POP: return "OP_JUMP_IF_FALSE_POP";
+        case OP_LESS_JUMP_IF_FALSE: return "OP_LESS_JUMP_IF_FALSE";
+        case OP_EQUAL_NUM: return "OP_EQUAL_NUM";
+        case OP_ADD_NUM: return "OP_ADD_NUM";
+        case OP_ADD_STR: return "OP_ADD_STR";
+        case OP_ADD_LOCALS_NUM: return "OP_ADD_LOCALS_NUM";
+        case OP_EQUAL_ANY: return "OP_EQUAL_ANY";
+        case OP_ADD_ANY: return "OP_ADD_ANY";
+        case OP_ADD_LOCALS_ANY: return "OP_ADD_LOCALS_ANY";
+        default: return "OP_UNKNOWN";
+    }
+}
+
+void disassembleRegisterCode(Chunk* chunk, const char* name) {
+    printf("== %s (%d registers) ==\n", name, chunk->registers.frameSize);
+
+    for (int offset = 0; offset < chunk->registers.count;) {
+        offset = disassembleRegisterInstruction(chunk, offset);
+    }
+}
+
+static const char* registerOpcodeNames[] = {
+    [ROP_MOVE] = "MOVE",
+    [ROP_LOAD_CONSTANT] = "LOAD_CONSTANT",
+    [ROP_NULL] = "NULL",
+    [ROP_TRUE] = "TRUE",
+    [ROP_FALSE] = "FALSE",
+    [ROP_GET_GLOBAL] = "GET_GLOBAL",
+    [ROP_DEFINE_GLOBAL] = "DEFINE_GLOBAL",
+    [ROP_SET_GLOBAL] = "SET_GLOBAL",
+    [ROP_GET_UPVALUE] = "GET_UPVALUE",
+    [ROP_SET_UPVALUE] = "SET_UPVALUE",
+    [ROP_GET_PROPERTY] = "GET_PROPERTY",
+    [ROP_SET_PROPERTY] = "SET_PROPERTY",
+    [ROP_GET_SUPER] = "GET_SUPER",
+    [ROP_EQUAL] = "EQUAL",
+    [ROP_NOT_EQUAL] = "NOT_EQUAL",
+    [ROP_GREATER] = "GREATER",
+    [ROP_LESS] = "LESS",
+    [ROP_GREATER_EQUAL] = "GREATER_EQUAL",
+    [ROP_LESS_EQUAL] = "LESS_EQUAL",
+    [ROP_ADD] = "ADD",
+    [ROP_SUBTRACT] = "SUBTRACT",
+    [ROP_MULTIPLY] = "MULTIPLY",
+    [ROP_DIVIDE] = "DIVIDE",
+    [ROP_EQUAL_K] = "EQUAL_K",
+    [ROP_NOT_EQUAL_K] = "NOT_EQUAL_K",
+    [ROP_GREATER_K] = "GREATER_K",
+    [ROP_LESS_K] = "LESS_K",
+    [ROP_GREATER_EQUAL_K] = "GREATER_EQUAL_K",
+    [ROP_LESS_EQUAL_K] = "LESS_EQUAL_K",
+    [ROP_ADD_K] = "ADD_K",
+    [ROP_SUBTRACT_K] = "SUBTRACT_K",
+    [ROP_MULTIPLY_K] = "MULTIPLY_K",
+    [ROP_DIVIDE_K] = "DIVIDE_K",
+    [ROP_NOT] = "NOT",
+    [ROP_NEGATE] = "NEGATE",
+    [ROP_PRINT] = "PRINT",
+    [ROP_JUMP] = "JUMP",
+    [ROP_JUMP_IF_FALSE] = "JUMP_IF_FALSE",
+    [ROP_JUMP_IF_NOT_LESS] = "JUMP_IF_NOT_LESS",
+    [ROP_JUMP_IF_NOT_LESS_K] = "JUMP_IF_NOT_LESS_K",
+    [ROP_FOR_RANGE] = "FOR_RANGE",
+    [ROP_FOR_RANGE_K] = "FOR_RANGE_K",
+    [ROP_CALL] = "CALL",
+    [ROP_TAIL_CALL] = "TAIL_CALL",
+    [ROP_INVOKE] = "INVOKE",
+    [ROP_SUPER_INVOKE] = "SUPER_INVOKE",
+    [ROP_TAIL_INVOKE] = "TAIL_INVOKE",
+    [ROP_TAIL_SUPER_INVOKE] = "TAIL_SUPER_INVOKE",
+    [ROP_CLOSURE] = "CLOSURE",
+    [ROP_CLOSE_UPVALUE] = "CLOSE_UPVALUE",
+    [ROP_RETURN] = "RETURN",
+    [ROP_CLASS] = "CLASS",
+    [ROP_INHERIT] = "INHERIT",
+    [ROP_METHOD] = "METHOD"
+};
+
+int disassembleRegisterInstruction(Chunk* chunk, int offset) {
+    RegisterCode* registers = &chunk->registers;
+    uint32_t instruction = registers->code[offset];
+    printf("%04d ", offset);
+
+    int line = getLine(&registers->lines, offset);
+    if (offset > 0 && line == getLine(&registers->lines, offset - 1)) {
+        printf("    | ");
+    }
+    else {
+        printf("%4d ", line);
+    }
+
+    const char* name = registerOpcodeNames[REG_OP(instruction)];
+    switch (REG_OP(instruction)) {
+        case ROP_GET_GLOBAL:
+        case ROP_DEFINE_GLOBAL:
+        case ROP_SET_GLOBAL:
+            printf("%-18s r%-3d '%s'\n", name, REG_A(instruction), GLOBAL_NAME(REG_BX(instruction))->chars);
+            return offset + 1;
+        case ROP_LOAD_CONSTANT:
+        case ROP_CLASS:
+            printf("%-18s r%-3d '", name, REG_A(instruction));
+            printValue(chunk->constants.values[REG_BX(instruction)]);
+            printf("'\n");
+            return offset + 1;
+        case ROP_JUMP:
+        case ROP_JUMP_IF_FALSE:
+            printf("%-18s r%-3d -> %d\n", name, REG_A(instruction), offset + 1 + REG_SBX(instruction));
+            return offset + 1;
+        case ROP_JUMP_IF_NOT_LESS:
+        case ROP_JUMP_IF_NOT_LESS_K:
+            printf("%-18s r%-3d %s%-3d -> %d\n", name, REG_B(instruction),
+                REG_OP(instruction) == ROP_JUMP_IF_NOT_LESS ? "r" : "k", REG_C(instruction),
+                offset + 2 + REG_SBX(registers->code[offset + 1]));
+            return offset + 2;
+        case ROP_FOR_RANGE:
+        case ROP_FOR_RANGE_K:
+            printf("%-18s r%-3d k%-3d %s%-3d -> %d\n", name, REG_A(instruction), REG_B(instruction),
+                REG_OP(instruction) == ROP_FOR_RANGE ? "r" : "k", REG_C(instruction),
+                offset + 2 + REG_SBX(registers->code[offset + 1]));
+            return offset + 2;
+        case ROP_CLOSURE: {
+            ObjFunction* function = AS_FUNCTION(chunk->constants.values[REG_BX(instruction)]);
+            printf("%-18s r%-3d ", name, REG_A(instruction));
+            printValue(OBJ_VAL(function));
+            printf("\n");
+            for (int i = 0; i < function->upvalueCount; i++) {
+                uint32_t upvalue = registers->code[offset + 1 + i];
+                printf("%04d      |                     %s %d\n",
+                    offset + 1 + i, REG_A(upvalue) ? "local" : "upvalue", REG_B(upvalue));
+            }
+            return offset + 1 + function->upvalueCount;
+        }
+        case ROP_GET_PROPERTY:
+        case ROP_SET_PROPERTY:
+            printf("%-18s r%-3d '", name, REG_A(instruction));
+            printValue(chunk->constants.values[REG_BX(instruction)]);
+            printf("' ic %u\n", registers->code[offset + 1]);
+            return offset + 2;
+        case ROP_INVOKE:
+        case ROP_TAIL_INVOKE:
+            printf("%-18s r%-3d %-4d '", name, REG_A(instruction), REG_B(instruction));
+            printValue(chunk->constants.values[REG_C(instruction)]);
+            printf("' ic %u\n", registers->code[offset + 1]);
+            return offset + 2;
+        case ROP_GET_SUPER:
+        case ROP_METHOD:
+            printf("%-18s r%-3d '", name, REG_A(instruction));
+            printValue(chunk->constants.values[REG_BX(instruction)]);
+            printf("'\n");
+            return offset + 1;
+        case ROP_SUPER_INVOKE:
+        case ROP_TAIL_SUPER_INVOKE:
+            printf("%-18s r%-3d %-4d '", name, REG_A(instruction), REG_B(instruction));
+            printValue(chunk->constants.values[REG_C(instruction)]);
+            printf("'\n");
+            return offset + 1;
+        default:
+            if (REG_OP(instruction) >= ROP_EQUAL_K && REG_OP(instruction) <= ROP_DIVIDE_K) {
+                printf("%-18s r%-3d r%-3d k%d\n", name, REG_A(instruction), REG_B(instruction), REG_C(instruction));
+            }
+            else {
+                printf("%-18s r%-3d %-4d %d\n", name, REG_A(instruction), REG_B(instruction), REG_C(instruction));
+            }
+            return offset + 1;
+    }
+}
@@ -8,5 +8,10 @@
 // Chunk objects, thus the below methods decode them
 void disassembleChunk(Chunk* chunk, const char* name);
 int disassembleInstruction(Chunk* chunk, int offset);
+const char* opcodeName(uint8_t opcode);
+
+// The same for the register code of a Chunk
+void disassembleRegisterCode(Chunk* chunk, const char* name);
+int disassembleRegisterInstruction(Chunk* chunk, int offset);
 
 #endif
\ No newline at end of file
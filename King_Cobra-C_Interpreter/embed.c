@@ -0,0 +1,84 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "compiler.h"
+#include "embed.h"
+#include "memory.h"
+
+struct KcProgram {
+    ObjFunction* function;
+};
+
+void kcInit() {
+    initVM();
+}
+
+void kcFree() {
+    freeVM();
+}
+
+KcProgram* kcCompile(const char* source) {
+    ObjFunction* function = compile(source);
+    if (function == NULL) return NULL;
+
+    KcProgram* program = (KcProgram*)malloc(sizeof(KcProgram));
+    if (program == NULL) exit(1);
+    program->function = function;
+    kcRoot(OBJ_VAL(function));
+    return program;
+}
+
+InterpretResult kcRunProgram(KcProgram* program) {
+    return interpretFunction(program->function);
+}
+
+void kcFreeProgram(KcProgram* program) {
+    kcUnroot(OBJ_VAL(program->function));
+    free(program);
+}
+
+bool kcGetGlobal(const char* name, Value* value) {
+    ObjString* key = copyString(name, (int)strlen(name));
+    Value slot;
+    if (!tableGet(&vm.globalSlots, key, &slot)) return false;
+    *value = vm.globalValues.values[(int)AS_NUMBER(slot)];
+    return !IS_UNDEFINED(*value);
+}
+
+bool kcPush(Value value) {
+    if (vm.stackTop - vm.stack >= STACK_INITIAL - STACK_SLACK) return false;
+    push(value);
+    return true;
+}
+
+InterpretResult kcCall(int argCount) {
+    if (vm.frameCount != 0 || argCount < 0 || vm.stackTop - vm.stack < argCount + 1) {
+        return INTERPRET_RUNTIME_ERROR;
+    }
+    return runCall(argCount);
+}
+
+Value kcPop() {
+    return vm.stackTop > vm.stack ? pop() : NULL_VAL;
+}
+
+Value kcString(const char* chars) {
+    return OBJ_VAL(copyString(chars, (int)strlen(chars)));
+}
+
+void kcRoot(Value value) {
+    // Growing the array can collect, before value is in it.
+    push(value);
+    writeValueArray(&vm.hostRoots, value);
+    pop();
+}
+
+void kcUnroot(Value value) {
+    for (int i = vm.hostRoots.count - 1; i >= 0; i--) {
+        if (valuesEqual(vm.hostRoots.values[i], value)) {
+            vm.hostRoots.values[i] = vm.hostRoots.values[vm.hostRoots.count - 1];
+            vm.hostRoots.count--;
+            return;
+        }
+    }
+}
@@ -0,0 +1,73 @@
+#ifndef kc_embed_h
+#define kc_embed_h
+
+#include "vm.h"
+
+/**
+ * The embedding API, for programs that link the interpreter as a library (make library)
+ * and call into scripts. Every thread that uses it works with a VM of its own, which
+ * kcInit() makes.
+ *
+ * A script is compiled once into a KcProgram, and kcRunProgram() runs its top-level
+ * code once to define its globals. From then on, calling one of its functions only
+ * costs a call frame, with no scanning or compiling:
+ *
+ *     KcProgram* program = kcCompile(source);
+ *     kcRunProgram(program);
+ *     Value handler;
+ *     kcGetGlobal("handler", &handler);
+ *     kcRoot(handler);
+ *     for (...) {
+ *         kcPush(handler);
+ *         kcPush(NUMBER_VAL(request));
+ *         if (kcCall(1) == INTERPRET_OK) respond(kcPop());
+ *     }
+ *
+ * Values are the interpreter's own (see value.h and object.h). An object that only the
+ * host holds may be freed by the collector at any allocation, unless it is rooted.
+*/
+typedef struct KcProgram KcProgram;
+
+void kcInit();
+void kcFree();
+
+/**
+ * Compiles source into a program, or returns NULL after reporting the compile errors.
+*/
+KcProgram* kcCompile(const char* source);
+InterpretResult kcRunProgram(KcProgram* program);
+void kcFreeProgram(KcProgram* program);
+
+/**
+ * Stores the value of the global called name in value, or returns false if there is
+ * no such global.
+*/
+bool kcGetGlobal(const char* name, Value* value);
+
+/**
+ * Pushes the function to call and then its arguments. Returns false, pushing nothing,
+ * if the stack is full, which allows for a call with up to 250 arguments.
+*/
+bool kcPush(Value value);
+
+/**
+ * Calls the function below the argCount values pushed last, which can be anything that
+ * a script can call. On success its result is left on the stack for kcPop(); after a
+ * runtime error, which has already been reported, the stack is empty. Must not be used
+ * from a native, while the VM is running code.
+*/
+InterpretResult kcCall(int argCount);
+Value kcPop();
+
+/**
+ * Returns a string with a copy of chars. It is not rooted, so push or root it at once.
+*/
+Value kcString(const char* chars);
+
+/**
+ * Keeps an object alive until as many kcUnroot() calls have dropped it again.
+*/
+void kcRoot(Value value);
+void kcUnroot(Value value);
+
+#endif
@@ -0,0 +1,107 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "../embed.h"
+
+/**
+ * A small host program for the embedding API (embed.h), which `make embed_test` links
+ * against libkc.a and runs. It compiles a script once, calls its functions from C and
+ * exits with status 1 if any of the checks fail.
+*/
+
+static const char* source =
+    "var calls = 0;\n"
+    "func handler(n) {\n"
+    "    calls = calls + 1;\n"
+    "    return n * 2;\n"
+    "}\n"
+    "func greet(name) {\n"
+    "    return \"hello \" + name;\n"
+    "}\n"
+    "func fails(n) {\n"
+    "    return n + \"a\";\n"
+    "}\n"
+    "class Counter {\n"
+    "    init(start) {\n"
+    "        this.count = start;\n"
+    "    }\n"
+    "}\n";
+
+static int failures = 0;
+
+static void check(bool passed, const char* what) {
+    printf("%s: %s\n", passed ? "PASSED" : "FAILED", what);
+    if (!passed) failures++;
+}
+
+/**
+ * Calls function with one argument and stores what it returned in result. Returns
+ * false if the call failed.
+*/
+static bool callWith(Value function, Value argument, Value* result) {
+    if (!kcPush(function) || !kcPush(argument)) return false;
+    if (kcCall(1) != INTERPRET_OK) return false;
+    *result = kcPop();
+    return true;
+}
+
+int main() {
+    kcInit();
+
+    KcProgram* program = kcCompile(source);
+    check(program != NULL, "kcCompile() compiles the script");
+    if (program == NULL) return 1;
+    check(kcRunProgram(program) == INTERPRET_OK, "kcRunProgram() runs its top-level code");
+
+    Value handler, greet, fails, counter, clockNative, unused;
+    check(kcGetGlobal("handler", &handler) && kcGetGlobal("greet", &greet) &&
+          kcGetGlobal("fails", &fails) && kcGetGlobal("Counter", &counter) &&
+          kcGetGlobal("clock", &clockNative), "kcGetGlobal() finds functions, classes and natives");
+    check(!kcGetGlobal("missing", &unused), "kcGetGlobal() fails for a missing global");
+    kcRoot(handler);
+    kcRoot(greet);
+    kcRoot(fails);
+    kcRoot(counter);
+
+    Value result;
+    check(callWith(handler, NUMBER_VAL(21), &result) && IS_NUMBER(result) && AS_NUMBER(result) == 42,
+          "kcCall() calls a function with a number");
+
+    // The string is not rooted, but the handle of the function below it on the stack is.
+    check(callWith(greet, kcString("host"), &result) && IS_STRING(result) &&
+          strcmp(AS_CSTRING(result), "hello host") == 0, "kcCall() calls a function with a string");
+
+    check(callWith(counter, NUMBER_VAL(5), &result) && IS_INSTANCE(result),
+          "kcCall() calls a class, which makes an instance");
+
+    kcPush(clockNative);
+    check(kcCall(0) == INTERPRET_OK && IS_NUMBER(kcPop()), "kcCall() calls a native");
+
+    fprintf(stderr, "The next check expects a runtime error:\n");
+    check(!callWith(fails, NUMBER_VAL(1), &result), "kcCall() reports a runtime error");
+    check(callWith(handler, NUMBER_VAL(1), &result) && AS_NUMBER(result) == 2,
+          "a call after a runtime error still works");
+
+    // Lots of calls into a compiled program, which are only a call frame each.
+    clock_t start = clock();
+    double sum = 0;
+    bool called = true;
+    for (int i = 0; i < 1000000 && called; i++) {
+        called = callWith(handler, NUMBER_VAL(i), &result);
+        if (called) sum += AS_NUMBER(result);
+    }
+    double milliseconds = (double)(clock() - start) * 1000 / CLOCKS_PER_SEC;
+    Value calls;
+    check(called && sum == 999999000000.0 && kcGetGlobal("calls", &calls) && AS_NUMBER(calls) == 1000002,
+          "a million calls of the handler");
+    printf("A million calls took %.1f ms.\n", milliseconds);
+
+    kcUnroot(handler);
+    kcUnroot(greet);
+    kcUnroot(fails);
+    kcUnroot(counter);
+    kcFreeProgram(program);
+    kcFree();
+    return failures == 0 ? 0 : 1;
+}
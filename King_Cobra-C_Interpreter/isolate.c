@@ -0,0 +1,339 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "common.h"
+#include "isolate.h"
+#include "snapshot.h"
+#include "vm.h"
+
+#define CHANNEL_DEFAULT_CAPACITY 64
+#define CHANNEL_MAX_CAPACITY (1 << 20)
+#define CACHE_LINE 64
+
+/**
+ * A channel is a bounded multi-producer multi-consumer queue (Dmitry Vyukov's design).
+ * Each cell has a sequence number that says whose turn it is: a sender may fill the
+ * cell at position p once its sequence is p, a receiver may empty it once it is p + 1.
+ * Claiming a position is one compare-and-swap, so neither side ever takes a lock.
+ * The two positions sit on cache lines of their own, since senders and receivers
+ * usually run on different cores.
+*/
+typedef struct {
+    atomic_size_t sequence;
+    ByteBuffer message;
+} Cell;
+
+struct Channel {
+    Cell* cells;
+    size_t mask;
+    atomic_int references;
+    char sendPadding[CACHE_LINE];
+    atomic_size_t sendPosition;
+    char receivePadding[CACHE_LINE];
+    atomic_size_t receivePosition;
+    char endPadding[CACHE_LINE];
+};
+
+/**
+ * What a new isolate starts from: an image of the function it runs, its arguments and
+ * the globals that the function's code uses.
+*/
+typedef struct {
+    ByteBuffer image;
+    Channel* result;
+    bool registerEngine;
+} Isolate;
+
+static Channel* createChannel(size_t capacity) {
+    size_t size = 2;
+    while (size < capacity) size *= 2;
+
+    Channel* channel = (Channel*)malloc(sizeof(Channel));
+    Cell* cells = (Cell*)malloc(sizeof(Cell) * size);
+    if (channel == NULL || cells == NULL) exit(1);
+
+    channel->cells = cells;
+    channel->mask = size - 1;
+    for (size_t i = 0; i < size; i++) {
+        atomic_init(&cells[i].sequence, i);
+        initByteBuffer(&cells[i].message);
+    }
+    atomic_init(&channel->references, 1);
+    atomic_init(&channel->sendPosition, 0);
+    atomic_init(&channel->receivePosition, 0);
+    return channel;
+}
+
+void retainChannel(Channel* channel) {
+    atomic_fetch_add_explicit(&channel->references, 1, memory_order_relaxed);
+}
+
+void releaseChannel(Channel* channel) {
+    if (atomic_fetch_sub_explicit(&channel->references, 1, memory_order_acq_rel) != 1) return;
+
+    // Messages nobody received still hold the channels they carry.
+    size_t position = atomic_load_explicit(&channel->receivePosition, memory_order_relaxed);
+    size_t end = atomic_load_explicit(&channel->sendPosition, memory_order_relaxed);
+    for (; position != end; position++) {
+        Cell* cell = &channel->cells[position & channel->mask];
+        discardHeapImage(&cell->message);
+        freeByteBuffer(&cell->message);
+    }
+    free(channel->cells);
+    free(channel);
+}
+
+/**
+ * Moves message into the channel, or returns false if the channel is full.
+*/
+static bool trySend(Channel* channel, ByteBuffer* message) {
+    size_t position = atomic_load_explicit(&channel->sendPosition, memory_order_relaxed);
+    for (;;) {
+        Cell* cell = &channel->cells[position & channel->mask];
+        size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+        if (difference == 0) {
+            if (atomic_compare_exchange_weak_explicit(&channel->sendPosition, &position, position + 1,
+                    memory_order_relaxed, memory_order_relaxed)) {
+                cell->message = *message;
+                atomic_store_explicit(&cell->sequence, position + 1, memory_order_release);
+                return true;
+            }
+        }
+        else if (difference < 0) {
+            return false;
+        }
+        else {
+            position = atomic_load_explicit(&channel->sendPosition, memory_order_relaxed);
+        }
+    }
+}
+
+/**
+ * Moves the oldest message out of the channel, or returns false if the channel is empty.
+*/
+static bool tryReceive(Channel* channel, ByteBuffer* message) {
+    size_t position = atomic_load_explicit(&channel->receivePosition, memory_order_relaxed);
+    for (;;) {
+        Cell* cell = &channel->cells[position & channel->mask];
+        size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t difference = (intptr_t)sequence - (intptr_t)(position + 1);
+        if (difference == 0) {
+            if (atomic_compare_exchange_weak_explicit(&channel->receivePosition, &position, position + 1,
+                    memory_order_relaxed, memory_order_relaxed)) {
+                *message = cell->message;
+                atomic_store_explicit(&cell->sequence, position + channel->mask + 1, memory_order_release);
+                return true;
+            }
+        }
+        else if (difference < 0) {
+            return false;
+        }
+        else {
+            position = atomic_load_explicit(&channel->receivePosition, memory_order_relaxed);
+        }
+    }
+}
+
+/**
+ * Waits a little before a blocked send or receive tries again: first by giving up the
+ * rest of the time slice, then by sleeping, so that a long wait doesn't keep a core busy.
+*/
+void backoff(int* attempts) {
+    if (*attempts < 64) {
+        (*attempts)++;
+        sched_yield();
+        return;
+    }
+    struct timespec pause = {0, 100000};
+    nanosleep(&pause, NULL);
+}
+
+static void sendMessage(Channel* channel, ByteBuffer* message) {
+    int attempts = 0;
+    while (!trySend(channel, message)) backoff(&attempts);
+}
+
+static void receiveMessage(Channel* channel, ByteBuffer* message) {
+    int attempts = 0;
+    while (!tryReceive(channel, message)) backoff(&attempts);
+}
+
+/**
+ * Reads a message into the running VM's heap, which takes over the channels it holds.
+ * Returns UNDEFINED_VAL if the message is damaged, which only a bug can cause.
+*/
+static Value readMessage(ByteBuffer* message) {
+    Reader reader;
+    initReader(&reader, message->bytes, message->count);
+    Value value;
+    int count = readHeapImage(&reader, &value, 1, true);
+    freeReader(&reader);
+    freeByteBuffer(message);
+    return count == 1 ? value : UNDEFINED_VAL;
+}
+
+/**
+ * channel(capacity) creates a channel that holds up to capacity messages, 64 by default.
+*/
+Value channelNative(int argCount, Value* args) {
+    double capacity = CHANNEL_DEFAULT_CAPACITY;
+    if (argCount > 1 || (argCount == 1 && !IS_NUMBER(args[0]))) {
+        runtimeError("channel() takes an optional capacity.");
+        return UNDEFINED_VAL;
+    }
+    if (argCount == 1) capacity = AS_NUMBER(args[0]);
+    if (capacity < 1 || capacity > CHANNEL_MAX_CAPACITY) {
+        runtimeError("Channel capacity must be between 1 and %d.", CHANNEL_MAX_CAPACITY);
+        return UNDEFINED_VAL;
+    }
+    return OBJ_VAL(newChannel(createChannel((size_t)capacity)));
+}
+
+/**
+ * send(channel, value) copies value into the channel, waiting while the channel is full.
+*/
+Value sendNative(int argCount, Value* args) {
+    if (argCount != 2 || !IS_CHANNEL(args[0])) {
+        runtimeError("send() takes a channel and a value.");
+        return UNDEFINED_VAL;
+    }
+
+    ByteBuffer message;
+    initByteBuffer(&message);
+    if (!writeHeapImage(&message, &args[1], 1, IMAGE_VALUES_ONLY, true)) {
+        freeByteBuffer(&message);
+        runtimeError("Can't send a list, a future or a closure over a live local variable.");
+        return UNDEFINED_VAL;
+    }
+    sendMessage(AS_CHANNEL(args[0]), &message);
+    return NULL_VAL;
+}
+
+/**
+ * recv(channel) returns the oldest value in the channel, waiting while it is empty.
+ * Receiving the result of a spawned function that failed is an error.
+*/
+Value recvNative(int argCount, Value* args) {
+    if (argCount != 1 || !IS_CHANNEL(args[0])) {
+        runtimeError("recv() takes a channel.");
+        return UNDEFINED_VAL;
+    }
+
+    ByteBuffer message;
+    receiveMessage(AS_CHANNEL(args[0]), &message);
+    if (message.count == 0) {
+        runtimeError("The spawned function failed.");
+        return UNDEFINED_VAL;
+    }
+    Value value = readMessage(&message);
+    if (IS_UNDEFINED(value)) runtimeError("Received a damaged message.");
+    return value;
+}
+
+/**
+ * Checks the arguments of spawn() or async(), which native names in the errors, and
+ * writes an image of the call that runCallImage() can make in another VM.
+*/
+bool writeCallImage(ByteBuffer* image, const char* native, int argCount, Value* args) {
+    if (argCount < 1 || !IS_CLOSURE(args[0])) {
+        runtimeError("%s() takes a function and its arguments.", native);
+        return false;
+    }
+    ObjFunction* function = AS_CLOSURE(args[0])->function;
+    if (argCount - 1 != function->arity) {
+        runtimeError("Expected %d arguments but got %d.", function->arity, argCount - 1);
+        return false;
+    }
+    if (!writeHeapImage(image, args, argCount, IMAGE_USED_GLOBALS, true)) {
+        runtimeError("Can't %s a function that reaches a list, a future or a live local variable.", native);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Makes the call in image in the running VM and writes an image of what the function
+ * returned to result. If the call fails, which has been reported, result stays empty
+ * so that whoever receives it can tell the failure from a function that returned null.
+*/
+void runCallImage(ByteBuffer* image, ByteBuffer* result) {
+    Reader reader;
+    initReader(&reader, image->bytes, image->count);
+    Value values[UINT8_COUNT];
+    int count = readHeapImage(&reader, values, UINT8_COUNT, true);
+    freeReader(&reader);
+
+    if (count < 1 || !IS_CLOSURE(values[0])) {
+        runtimeError("The call to run on another thread is damaged.");
+        return;
+    }
+    for (int i = 0; i < count; i++) {
+        push(values[i]);
+    }
+    if (runClosure(AS_CLOSURE(values[0]), count - 1) != INTERPRET_OK) return;
+
+    if (!writeHeapImage(result, &vm.stackTop[-1], 1, IMAGE_VALUES_ONLY, true)) {
+        freeByteBuffer(result);
+        runtimeError("Can't return a list, a future or a closure over a live local variable to another thread.");
+        return;
+    }
+    pop();
+}
+
+/**
+ * The body of an isolate's thread.
+*/
+static void* runIsolate(void* argument) {
+    Isolate* isolate = (Isolate*)argument;
+    initVM();
+    vm.registerEngine = isolate->registerEngine;
+
+    ByteBuffer message;
+    initByteBuffer(&message);
+    runCallImage(&isolate->image, &message);
+    freeByteBuffer(&isolate->image);
+    sendMessage(isolate->result, &message);
+
+    releaseChannel(isolate->result);
+    freeVM();
+    free(isolate);
+    return NULL;
+}
+
+/**
+ * spawn(function, args...) calls function with args in a new isolate and returns a
+ * channel that will receive its return value.
+*/
+Value spawnNative(int argCount, Value* args) {
+    Isolate* isolate = (Isolate*)malloc(sizeof(Isolate));
+    if (isolate == NULL) exit(1);
+    initByteBuffer(&isolate->image);
+    if (!writeCallImage(&isolate->image, "spawn", argCount, args)) {
+        freeByteBuffer(&isolate->image);
+        free(isolate);
+        return UNDEFINED_VAL;
+    }
+    isolate->result = createChannel(2);
+    isolate->registerEngine = vm.registerEngine;
+
+    // The isolate holds a reference to the result channel until it has sent on it.
+    Channel* result = isolate->result;
+    retainChannel(result);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, runIsolate, isolate) != 0) {
+        discardHeapImage(&isolate->image);
+        freeByteBuffer(&isolate->image);
+        free(isolate);
+        releaseChannel(result);
+        releaseChannel(result);
+        runtimeError("Could not start a thread for the isolate.");
+        return UNDEFINED_VAL;
+    }
+    pthread_detach(thread);
+    return OBJ_VAL(newChannel(result));
+}
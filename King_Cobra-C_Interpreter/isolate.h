@@ -0,0 +1,34 @@
+#ifndef kc_isolate_h
+#define kc_isolate_h
+
+#include "bytecode.h"
+
+/**
+ * Isolates. spawn(function, args...) runs a function on a new OS thread in a VM of its
+ * own, with its own heap and collector, and returns a channel that receives what the
+ * function returned. Isolates share nothing but channels: bounded lock-free queues
+ * whose messages are heap images (see snapshot.h), so every value that is sent is
+ * copied into the receiver's heap. Numbers, booleans and null travel inside the
+ * message itself and strings are copied once, as bytes.
+*/
+
+/**
+ * A channel is freed with its last reference, which every ObjChannel handle and every
+ * message or image that holds the channel counts as.
+*/
+void retainChannel(Channel* channel);
+void releaseChannel(Channel* channel);
+
+/**
+ * The pieces that the task scheduler (scheduler.c) shares with isolates.
+*/
+void backoff(int* attempts);
+bool writeCallImage(ByteBuffer* image, const char* native, int argCount, Value* args);
+void runCallImage(ByteBuffer* image, ByteBuffer* result);
+
+Value channelNative(int argCount, Value* args);
+Value sendNative(int argCount, Value* args);
+Value recvNative(int argCount, Value* args);
+Value spawnNative(int argCount, Value* args);
+
+#endif
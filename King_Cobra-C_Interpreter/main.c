@@ -2,8 +2,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include "common.h"
+#include "bytecode.h"
 #include "chunk.h"
+#include "compiler.h"
 #include "debug.h"
+#include "snapshot.h"
 #include "vm.h"
 
 static void repl() {
@@ -48,11 +51,47 @@ static char* readFile(const char* path) {
 	return buffer;
 }
 
+/**
+ * Returns the path of the bytecode file kept next to a script: foo.kc caches to foo.kcc,
+ * and any other name gets .kcc appended.
+*/
+static char* bytecodePath(const char* path) {
+	size_t length = strlen(path);
+	char* cachePath = (char*)malloc(length + 5);
+	if(cachePath == NULL) {
+		fprintf(stderr, "Not enough memory to run \"%s\".\n", path);
+		exit(74);
+	}
+
+	memcpy(cachePath, path, length + 1);
+	if(length >= 3 && strcmp(path + length - 3, ".kc") == 0) {
+		strcat(cachePath, "c");
+	}
+	else {
+		strcat(cachePath, ".kcc");
+	}
+	return cachePath;
+}
+
+/**
+ * Runs a script, reusing its bytecode file when that was compiled from the same source.
+ * Otherwise the source is compiled and the bytecode file (re)written for the next run.
+*/
 static void runFile(const char* path) {
 	char* source = readFile(path);
-	InterpretResult result = interpret(source);
+	char* cachePath = bytecodePath(path);
+	uint64_t sourceHash = hashSource(source, strlen(source));
+
+	ObjFunction* function = loadBytecodeFile(cachePath, sourceHash);
+	if(function == NULL) {
+		function = compile(source);
+		if(function != NULL) writeBytecodeFile(cachePath, function, sourceHash);
+	}
+	free(cachePath);
 	free(source);
 
+	InterpretResult result = function == NULL ? INTERPRET_COMPILE_ERROR : interpretFunction(function);
+
 	if(result == INTERPRET_COMPILE_ERROR) exit(65);
 	if(result == INTERPRET_RUNTIME_ERROR) exit(70);
 }
@@ -60,16 +99,46 @@ static void runFile(const char* path) {
 int main(int argc, char** argv) {
 	initVM();
 
-	if(argc == 1) {
+	// --registers runs the register machine instead of the stack machine, except for
+	// functions that the register translator cannot handle.
+	if(argc > 1 && strcmp(argv[1], "--registers") == 0) {
+		vm.registerEngine = true;
+		argc--;
+		argv++;
+	}
+
+	// --write-snapshot runs an initialization script and saves the heap it leaves behind,
+	// and --snapshot starts out from such a heap instead of an empty one.
+	const char* snapshotPath = NULL;
+	bool writing = false;
+	if(argc > 2 && (strcmp(argv[1], "--snapshot") == 0 || strcmp(argv[1], "--write-snapshot") == 0)) {
+		writing = strcmp(argv[1], "--write-snapshot") == 0;
+		snapshotPath = argv[2];
+		argc -= 2;
+		argv += 2;
+	}
+
+	if(snapshotPath != NULL && !writing && !restoreSnapshot(snapshotPath)) {
+		fprintf(stderr, "Could not restore the snapshot \"%s\".\n", snapshotPath);
+		exit(74);
+	}
+
+	if(argc == 1 && !writing) {
 		repl();
 	}
 	else if(argc == 2) {
 		runFile(argv[1]);
 	}
 	else {
-		fprintf(stderr, "Usage: ./Interpreter [path] \n");
+		fprintf(stderr, "Usage: ./Interpreter [--registers] [--snapshot file] [path] \n");
+		fprintf(stderr, "       ./Interpreter [--registers] --write-snapshot file path \n");
 		exit(64);
 	}
+
+	if(writing && !writeSnapshot(snapshotPath)) {
+		fprintf(stderr, "Could not write the snapshot \"%s\".\n", snapshotPath);
+		exit(74);
+	}
 	
 	freeVM();
 	return 0;
@@ -1,7 +1,10 @@
 #include <stdlib.h>
 
 #include "compiler.h"
+#include "isolate.h"
+#include "scheduler.h"
 #include "memory.h"
+#include "snapshot.h"
 #include "vm.h"
 
 #ifdef DEBUG_LOG_GC
@@ -21,10 +24,11 @@ void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
         #ifdef DEBUG_STRESS_GC
             collectGarbage();
         #endif
-    }
 
-    if (vm.bytesAllocated > vm.nextGC) {
-        collectGarbage();
+        // Only allocations collect, so the frees done while sweeping never start another collection.
+        if (vm.bytesAllocated > vm.nextGC) {
+            collectGarbage();
+        }
     }
 
     if(newSize == 0) {
@@ -96,7 +100,9 @@ static void blackenObject(Obj* object) {
         case OBJ_CLASS: {
             ObjClass* Class = (ObjClass*)object;
             markObject((Obj*)Class->name);
-            markTable(&Class->methods);
+            for (int i = 0; i < Class->methodCount; i++) {
+                markObject((Obj*)Class->methods[i]);
+            }
             break;
         }
         case OBJ_CLOSURE: {
@@ -111,18 +117,41 @@ static void blackenObject(Obj* object) {
             ObjFunction* function = (ObjFunction*)object;
             markObject((Obj*)function->name);
             markArray(&function->chunk.constants);
+            for (int i = 0; i < function->chunk.cacheCount; i++) {
+                InlineCache* cache = &function->chunk.caches[i];
+                for (int j = 0; j < cache->count; j++) {
+                    markObject((Obj*)cache->entries[j].Class);
+                    markObject((Obj*)cache->entries[j].shape);
+                    markObject((Obj*)cache->entries[j].transition);
+                    markObject((Obj*)cache->entries[j].method);
+                }
+            }
             break;
         }
         case OBJ_INSTANCE: {
             ObjInstance* instance = (ObjInstance*)object;
             markObject((Obj*)instance->Class);
-            markTable(&instance->fields);
+            markObject((Obj*)instance->shape);
+            for (int i = 0; i < instance->shape->fieldCount; i++) {
+                markValue(*instanceField(instance, i));
+            }
+            break;
+        }
+        case OBJ_SHAPE: {
+            ObjShape* shape = (ObjShape*)object;
+            markObject((Obj*)shape->parent);
+            markObject((Obj*)shape->name);
+            markTable(&shape->slots);
+            markTable(&shape->transitions);
             break;
         }
         case OBJ_UPVALUE: {
             markValue(((ObjUpvalue*)object)->closed);
             break;
         }
+        case OBJ_ARRAY:
+        case OBJ_CHANNEL:
+        case OBJ_FUTURE:
         case OBJ_NATIVE:
         case OBJ_STRING:
         break;
@@ -144,9 +173,25 @@ static void freeObject(Obj* object) {
             FREE(ObjBoundMethod, object);
             break;
         }
+        case OBJ_ARRAY: {
+            ObjArray* array = (ObjArray*)object;
+            FREE_ARRAY(double, array->numbers, array->count);
+            FREE(ObjArray, object);
+            break;
+        }
+        case OBJ_CHANNEL: {
+            releaseChannel(((ObjChannel*)object)->channel);
+            FREE(ObjChannel, object);
+            break;
+        }
+        case OBJ_FUTURE: {
+            releaseFuture(((ObjFuture*)object)->future);
+            FREE(ObjFuture, object);
+            break;
+        }
         case OBJ_CLASS: {
             ObjClass* Class = (ObjClass*)object;
-            freeTable(&Class->methods);
+            FREE_ARRAY(ObjClosure*, Class->methods, Class->methodCount);
             FREE(ObjClass, object);
             break;
         } 
@@ -165,10 +210,18 @@ static void freeObject(Obj* object) {
         }
         case OBJ_INSTANCE: {
             ObjInstance* instance = (ObjInstance*)object;
-            freeTable(&instance->fields);
+            FREE_ARRAY(Value, instance->overflow, instance->overflowCapacity);
             FREE(ObjInstance, object);
             break;
         }
+        case OBJ_SHAPE: {
+            ObjShape* shape = (ObjShape*)object;
+            FREE_ARRAY(ObjString*, shape->names, shape->fieldCount);
+            freeTable(&shape->slots);
+            freeTable(&shape->transitions);
+            FREE(ObjShape, object);
+            break;
+        }
         case OBJ_NATIVE:
             FREE(ObjNative, object);
             break;
@@ -186,7 +239,19 @@ static void freeObject(Obj* object) {
 }
 
 static void markRoots() {
-    for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
+    // Every register of a register engine frame is a root while the frame is live,
+    // including while vm.stackTop is lowered to hand a call its arguments.
+    Value* stackTop = vm.stackTop;
+    if (vm.registerEngine) {
+        for (int i = 0; i < vm.frameCount; i++) {
+            CallFrame* frame = &vm.frames[i];
+            if (!onRegisterEngine(frame->closure->function)) continue;
+            Value* registersTop = frame->slots + frame->closure->function->chunk.registers.frameSize;
+            if (registersTop > stackTop) stackTop = registersTop;
+        }
+    }
+
+    for (Value* slot = vm.stack; slot < stackTop; slot++) {
         markValue(*slot);
     }
 
@@ -200,9 +265,15 @@ static void markRoots() {
         markObject((Obj*)upvalue);
     }
 
-    markTable(&vm.globals);
+    markTable(&vm.globalSlots);
+    markArray(&vm.globalNames);
+    markArray(&vm.globalValues);
     markCompilerRoots();
+    markSnapshotRoots();
+    markArray(&vm.selectorNames);
+    markArray(&vm.hostRoots);
     markObject((Obj*)vm.initString);
+    markObject((Obj*)vm.emptyShape);
 }
 
 static void traceReferences() {
@@ -33,6 +33,38 @@ ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method) {
     bound->method = method;
     return bound;
 }
+/**
+ * Creates an array of count zeros.
+*/
+ObjArray* newArray(int count) {
+    double* numbers = ALLOCATE(double, count);
+    for (int i = 0; i < count; i++) {
+        numbers[i] = 0;
+    }
+    ObjArray* array = ALLOCATE_OBJ(ObjArray, OBJ_ARRAY);
+    array->count = count;
+    array->numbers = numbers;
+    return array;
+}
+
+/**
+ * Creates a handle to channel, which takes over a reference that the caller holds.
+*/
+ObjChannel* newChannel(Channel* channel) {
+    ObjChannel* handle = ALLOCATE_OBJ(ObjChannel, OBJ_CHANNEL);
+    handle->channel = channel;
+    return handle;
+}
+
+/**
+ * Creates a handle to future, which takes over a reference that the caller holds.
+*/
+ObjFuture* newFuture(Future* future) {
+    ObjFuture* handle = ALLOCATE_OBJ(ObjFuture, OBJ_FUTURE);
+    handle->future = future;
+    return handle;
+}
+
 /*
 ObjList* newList(ObjString* name) {
     ObjList* list = ALLOCATE_OBJ(ObjList, OBJ_LIST);
@@ -49,10 +81,38 @@ ObjList* newList(ObjString* name) {
 ObjClass* newClass(ObjString* name) {
     ObjClass* Class = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
     Class->name = name;
-    initTable(&Class->methods); 
+    Class->methods = NULL;
+    Class->methodCount = 0;
+    Class->cached = false;
     return Class;
 }
 
+/**
+ * Puts method in the method table of the class at selector, growing the table if needed.
+*/
+void setMethod(ObjClass* Class, int selector, ObjClosure* method) {
+    if (selector >= Class->methodCount) {
+        int oldCount = Class->methodCount;
+        ObjClosure** methods = GROW_ARRAY(ObjClosure*, Class->methods, oldCount, selector + 1);
+        for (int i = oldCount; i <= selector; i++) {
+            methods[i] = NULL;
+        }
+        Class->methods = methods;
+        Class->methodCount = selector + 1;
+    }
+    Class->methods[selector] = method;
+}
+
+/**
+ * Copies every method of superclass down into subclass. Going from the highest
+ * selector down sizes the subclass's table once.
+*/
+void inheritMethods(ObjClass* subclass, ObjClass* superclass) {
+    for (int i = superclass->methodCount - 1; i >= 0; i--) {
+        if (superclass->methods[i] != NULL) setMethod(subclass, i, superclass->methods[i]);
+    }
+}
+
 ObjClosure* newClosure(ObjFunction* function) {
     ObjUpvalue** upvalues = ALLOCATE(ObjUpvalue*, function->upvalueCount);
     for (int i = 0; i < function->upvalueCount; i++) {
@@ -71,6 +131,7 @@ static ObjString* allocateString(char* chars, int length, uint32_t hash) {
     string->length = length;
     string->chars = chars;
     string->hash = hash;
+    string->selector = -1;
 
     push(OBJ_VAL(string));
     tableSet(&vm.strings, string, NULL_VAL);
@@ -98,6 +159,8 @@ ObjFunction* newFunction() {
     ObjFunction* function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
     function->arity = 0;
     function->upvalueCount = 0;
+    function->maxStack = 0;
+    function->stackOnly = false;
     function->name = NULL;
     initChunk(&function->chunk);
     return function;
@@ -106,10 +169,84 @@ ObjFunction* newFunction() {
 ObjInstance* newInstance(ObjClass* Class) {
     ObjInstance* instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
     instance->Class = Class;
-    initTable(&instance->fields);
+    instance->shape = vm.emptyShape;
+    instance->overflow = NULL;
+    instance->overflowCapacity = 0;
     return instance;
 }
 
+/**
+ * Creates the shape that adds the field name to parent and records it as the parent's
+ * transition for that name. With no parent this creates the root shape.
+*/
+ObjShape* newShape(ObjShape* parent, ObjString* name) {
+    ObjShape* shape = ALLOCATE_OBJ(ObjShape, OBJ_SHAPE);
+    shape->parent = parent;
+    shape->name = name;
+    shape->fieldCount = 0;
+    shape->names = NULL;
+    initTable(&shape->slots);
+    initTable(&shape->transitions);
+    if (parent == NULL) return shape;
+
+    push(OBJ_VAL(shape));
+    ObjString** names = ALLOCATE(ObjString*, parent->fieldCount + 1);
+    for (int i = 0; i < parent->fieldCount; i++) {
+        names[i] = parent->names[i];
+    }
+    names[parent->fieldCount] = name;
+    shape->names = names;
+    shape->fieldCount = parent->fieldCount + 1;
+
+    // Small shapes are searched through names, so only larger ones get a slots table.
+    if (shape->fieldCount > SHAPE_LINEAR_FIELDS) {
+        if (parent->fieldCount > SHAPE_LINEAR_FIELDS) {
+            tableAddAll(&parent->slots, &shape->slots);
+            tableSet(&shape->slots, name, NUMBER_VAL(parent->fieldCount));
+        }
+        else {
+            for (int i = 0; i < shape->fieldCount; i++) {
+                tableSet(&shape->slots, names[i], NUMBER_VAL(i));
+            }
+        }
+    }
+    tableSet(&parent->transitions, name, OBJ_VAL(shape));
+    pop();
+    return shape;
+}
+
+/**
+ * Grows the overflow storage of the instance until it has room for the given slot.
+ * The instance stays on its shape, so a collection while it grows only traces the
+ * fields that are already set.
+*/
+void reserveField(ObjInstance* instance, int slot) {
+    while (!hasFieldStorage(instance, slot)) {
+        int oldCapacity = instance->overflowCapacity;
+        instance->overflowCapacity = GROW_CAPACITY(oldCapacity);
+        instance->overflow = GROW_ARRAY(Value, instance->overflow, oldCapacity, instance->overflowCapacity);
+    }
+}
+
+/**
+ * Sets a field of the instance. A new field moves the instance to the next shape
+ * and takes the slot after the existing ones.
+*/
+void setField(ObjInstance* instance, ObjString* name, Value value) {
+    int slot = shapeSlot(instance->shape, name);
+    if (slot == -1) {
+        Value transition;
+        ObjShape* shape = tableGet(&instance->shape->transitions, name, &transition)
+            ? AS_SHAPE(transition)
+            : newShape(instance->shape, name);
+
+        slot = instance->shape->fieldCount;
+        reserveField(instance, slot);
+        instance->shape = shape;
+    }
+    *instanceField(instance, slot) = value;
+}
+
 ObjNative* newNative(NativeFn function) {
     ObjNative* native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
     native->function = function;
@@ -171,6 +308,21 @@ void printObject(Value value) {
         case OBJ_BOUND_METHOD:
             printFunction(AS_BOUND_METHOD(value)->method->function);
             break;
+        case OBJ_ARRAY: {
+            ObjArray* array = AS_ARRAY(value);
+            printf("[");
+            for (int i = 0; i < array->count; i++) {
+                printf(i == 0 ? "%g" : ", %g", array->numbers[i]);
+            }
+            printf("]");
+            break;
+        }
+        case OBJ_CHANNEL:
+            printf("<channel>");
+            break;
+        case OBJ_FUTURE:
+            printf("<future>");
+            break;
         case OBJ_LIST:
             ObjList* obj = AS_LIST(value);
             // Print out the name of the list:
@@ -200,6 +352,9 @@ void printObject(Value value) {
         case OBJ_NATIVE:
             printf("<native function>");
             break;
+        case OBJ_SHAPE:
+            printf("shape");
+            break;
         case OBJ_STRING: 
             printf("%s", AS_CSTRING(value));
             break;
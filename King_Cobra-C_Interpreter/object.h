@@ -12,36 +12,48 @@
 /**
  * Macros to check if the provided value is of a specific type of object.
 */
+#define IS_ARRAY(value)         isObjType(value, OBJ_ARRAY)
 #define IS_BOUND_METHOD(value)  isObjType(value, OBJ_BOUND_METHOD)
+#define IS_CHANNEL(value)       isObjType(value, OBJ_CHANNEL)
+#define IS_FUTURE(value)        isObjType(value, OBJ_FUTURE)
 #define IS_CLASS(value)         isObjType(value, OBJ_CLASS)
 #define IS_CLOSURE(value)       isObjType(value, OBJ_CLOSURE)
 #define IS_FUNCTION(value)      isObjType(value, OBJ_FUNCTION)
 #define IS_INSTANCE(value)      isObjType(value, OBJ_INSTANCE)
 #define IS_NATIVE(value)        isObjType(value, OBJ_NATIVE)
+#define IS_SHAPE(value)         isObjType(value, OBJ_SHAPE)
 #define IS_STRING(value)        isObjType(value, OBJ_STRING)
 #define IS_LIST(value)          isObjType(value, OBJ_LIST)
 /**
  * The AS_STRING macro returns the pointer to that string object,
  * and the AS_CSTRING macro returns the character array of that string object.
 */
+#define AS_ARRAY(value)         ((ObjArray*)AS_OBJ(value))
 #define AS_BOUND_METHOD(value)  ((ObjBoundMethod*)AS_OBJ(value))
+#define AS_CHANNEL(value)       (((ObjChannel*)AS_OBJ(value))->channel)
+#define AS_FUTURE(value)        (((ObjFuture*)AS_OBJ(value))->future)
 #define AS_CLASS(value)         ((ObjClass*)AS_OBJ(value))
 #define AS_CLOSURE(value)       ((ObjClosure*)AS_OBJ(value))
 #define AS_FUNCTION(value)      ((ObjFunction*)AS_OBJ(value))
 #define AS_INSTANCE(value)      ((ObjInstance*)AS_OBJ(value))
 #define AS_NATIVE(value)        (((ObjNative*)AS_OBJ(value))->function)
+#define AS_SHAPE(value)         ((ObjShape*)AS_OBJ(value))
 #define AS_STRING(value)        ((ObjString*)AS_OBJ(value))
 #define AS_CSTRING(value)       (((ObjString*)AS_OBJ(value)) -> chars)
 #define AS_LIST(value)          ((ObjList*)AS_OBJ(value))
 #define AS_CLIST(value)         (((ObjList*)AS_OBJ(value))->valArray->values)
 
 typedef enum {
+    OBJ_ARRAY,
     OBJ_BOUND_METHOD,
+    OBJ_CHANNEL,
     OBJ_CLASS,
     OBJ_CLOSURE,
+    OBJ_FUTURE,
     OBJ_FUNCTION,
     OBJ_INSTANCE,
     OBJ_NATIVE,
+    OBJ_SHAPE,
     OBJ_STRING,
     OBJ_LIST,
     OBJ_UPVALUE
@@ -57,12 +69,47 @@ typedef struct {
     Obj obj;
     int arity;
     int upvalueCount;
+    int maxStack;   // Most stack slots a call of the function uses, arguments and locals included
+    bool stackOnly; // The register translator couldn't handle it, so run() runs it on either engine
     Chunk chunk;
     ObjString* name;
 } ObjFunction;
 
 typedef Value (*NativeFn)(int argCount, Value* args);
 
+/**
+ * A fixed-length array of numbers, stored unboxed so that kernels (scheduler.c) can
+ * work on the elements directly and on several threads at once.
+*/
+typedef struct {
+    Obj obj;
+    int count;
+    double* numbers;
+} ObjArray;
+
+// Defined in isolate.c. One channel is shared by the heaps of every isolate holding it.
+typedef struct Channel Channel;
+
+/**
+ * A handle to a channel. Every handle holds a reference to the channel, which is freed
+ * when the last handle of any isolate is.
+*/
+typedef struct {
+    Obj obj;
+    Channel* channel;
+} ObjChannel;
+
+// Defined in scheduler.c, and shared the same way as channels.
+typedef struct Future Future;
+
+/**
+ * A handle to the future result of a task (see scheduler.h).
+*/
+typedef struct {
+    Obj obj;
+    Future* future;
+} ObjFuture;
+
 typedef struct {
     Obj obj;
     NativeFn function;
@@ -73,6 +120,7 @@ struct ObjString {
     int length;
     char* chars;
     uint32_t hash;
+    int selector;   // Method selector id of the name, -1 if no method has been compiled with it
 };
 
 // To easily integrate list objects with the current hashing system,
@@ -100,16 +148,46 @@ typedef struct {
     int upvalueCount;
 } ObjClosure;
 
+/**
+ * A class keeps its methods in a flat table indexed by selector id, which already
+ * holds the inherited ones, so looking up a method is a single indexed load.
+*/
 typedef struct {
     Obj obj;
     ObjString* name;
-    Table methods;
+    ObjClosure** methods;   // NULL for the selectors the class has no method for
+    int methodCount;        // One past the highest selector the class has a method for
+    bool cached;            // Some inline cache may hold an entry for this class
 } ObjClass;
 
+/**
+ * Shapes (hidden classes) describe where an instance keeps its fields. A shape maps each
+ * field name to a slot, and adding a field moves the instance to the child shape for
+ * that name, so instances that get the same fields in the same order share one shape.
+ * Every instance starts out at the root of the transition tree, vm.emptyShape.
+*/
+typedef struct ObjShape {
+    Obj obj;
+    struct ObjShape* parent;
+    ObjString* name;        // The field this shape adds to its parent, NULL for the root
+    int fieldCount;
+    ObjString** names;      // The name of the field in each slot
+    Table slots;            // Field name -> slot, only for shapes of more than SHAPE_LINEAR_FIELDS fields
+    Table transitions;      // Field name -> child shape that adds that field
+} ObjShape;
+
+// The first fields of an instance are stored in the instance itself.
+#define INSTANCE_INLINE_FIELDS 4
+// Shapes with up to this many fields are searched linearly instead of through slots.
+#define SHAPE_LINEAR_FIELDS 8
+
 typedef struct {
     Obj obj;
     ObjClass* Class;
-    Table fields; 
+    ObjShape* shape;
+    Value fields[INSTANCE_INLINE_FIELDS];
+    Value* overflow;        // The fields past the inline ones
+    int overflowCapacity;
 } ObjInstance;
 
 typedef struct {
@@ -118,13 +196,47 @@ typedef struct {
     ObjClosure* method;
 } ObjBoundMethod;
 
+#define INLINE_CACHE_ENTRIES 4
+#define INLINE_CACHE_MEGAMORPHIC -1
+
+/**
+ * What a property instruction found the last time it saw a receiver with this class
+ * and shape: either the slot of a field or the method closure the class resolved the
+ * name to. A store that added the field also records the shape the instance moved to.
+*/
+typedef struct {
+    ObjClass* Class;
+    ObjShape* shape;
+    ObjShape* transition;   // Shape after a store that adds the field, else NULL
+    ObjClosure* method;     // NULL when the entry is a field
+    int slot;
+} CacheEntry;
+
+/**
+ * The inline cache of one property access or invoke instruction. It holds up to
+ * INLINE_CACHE_ENTRIES receivers, after which the site is megamorphic and always
+ * does the full lookup.
+*/
+struct InlineCache {
+    int count;      // INLINE_CACHE_MEGAMORPHIC once the site has seen too many receivers
+    CacheEntry entries[INLINE_CACHE_ENTRIES];
+};
+
 ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method);
+ObjArray* newArray(int count);
+ObjChannel* newChannel(Channel* channel);
+ObjFuture* newFuture(Future* future);
 ObjList* newList(ObjString* name);
 ObjClass* newClass(ObjString* name);
+void setMethod(ObjClass* Class, int selector, ObjClosure* method);
+void inheritMethods(ObjClass* subclass, ObjClass* superclass);
 ObjClosure* newClosure(ObjFunction* function);
 ObjFunction* newFunction();
 ObjInstance* newInstance(ObjClass* Class);
 ObjNative* newNative(NativeFn function);
+ObjShape* newShape(ObjShape* parent, ObjString* name);
+void reserveField(ObjInstance* instance, int slot);
+void setField(ObjInstance* instance, ObjString* name, Value value);
 ObjString* takeString(char* chars, int length);
 ObjString* copyString(const char* chars, int length);
 ObjUpvalue* newUpvalue(Value* slot);
@@ -139,4 +251,54 @@ static inline bool isObjType(Value value, ObjType type) {
     return IS_OBJ(value) && AS_OBJ(value) -> type == type;
 }
 
+/**
+ * Returns the method of the class with the given name, or NULL if it has none.
+*/
+static inline ObjClosure* findMethod(ObjClass* Class, ObjString* name) {
+    if ((unsigned)name->selector >= (unsigned)Class->methodCount) return NULL;
+    return Class->methods[name->selector];
+}
+
+/**
+ * Returns the storage of the field in the given slot of an instance.
+*/
+static inline Value* instanceField(ObjInstance* instance, int slot) {
+    if (slot < INSTANCE_INLINE_FIELDS) return &instance->fields[slot];
+    return &instance->overflow[slot - INSTANCE_INLINE_FIELDS];
+}
+
+/**
+ * True if the instance already has room for a field in the given slot.
+*/
+static inline bool hasFieldStorage(ObjInstance* instance, int slot) {
+    return slot - INSTANCE_INLINE_FIELDS < instance->overflowCapacity;
+}
+
+/**
+ * Returns the cache entry for the class and shape of the instance, if the cache has one.
+*/
+static inline CacheEntry* findCacheEntry(InlineCache* cache, ObjInstance* instance) {
+    for (int i = 0; i < cache->count; i++) {
+        CacheEntry* entry = &cache->entries[i];
+        if (entry->shape == instance->shape && entry->Class == instance->Class) return entry;
+    }
+    return NULL;
+}
+
+/**
+ * Returns the slot of the named field in the shape, or -1 if the shape doesn't have it.
+*/
+static inline int shapeSlot(ObjShape* shape, ObjString* name) {
+    if (shape->fieldCount <= SHAPE_LINEAR_FIELDS) {
+        for (int i = 0; i < shape->fieldCount; i++) {
+            if (shape->names[i] == name) return i;
+        }
+        return -1;
+    }
+
+    Value slot;
+    if (!tableGet(&shape->slots, name, &slot)) return -1;
+    return (int)AS_NUMBER(slot);
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,474 @@
+#include <stdlib.h>
+
+#include "common.h"
+#include "memory.h"
+#include "object.h"
+#include "optimizer.h"
+
+/**
+ * A jump in the rewritten code whose operand still has to be filled in once
+ * every instruction has its new offset.
+*/
+typedef struct {
+    int word;       // Offset of the jump instruction in the new code
+    int target;     // Offset the jump has to land on in the old code
+    bool backward;
+} JumpPatch;
+
+typedef struct Rewriter Rewriter;
+
+/**
+ * Rewrites the instructions at offset if they match one of the pass's patterns,
+ * and returns the number of old words it consumed, or 0 to copy the instruction.
+*/
+typedef int (*RewriteFn)(Rewriter* rewriter, int offset);
+
+/**
+ * State for one pass over a Chunk. The rewritten code is built up in a separate
+ * Chunk and swapped in at the end.
+*/
+struct Rewriter {
+    Chunk* chunk;
+    RewriteFn rewrite;
+    bool analyzeFlow;   // Whether jumps are threaded and unreachable code is found first
+    Chunk out;
+    int* newOffsets;    // Old offset -> new offset, for every instruction that starts a group
+    bool* isTarget;     // Old offsets that some jump lands on
+    bool* isLive;       // Old offsets of the instructions that can run, if the flow is analyzed
+    JumpPatch* patches;
+    int patchCount;
+    int patchCapacity;
+};
+
+static bool isJump(uint8_t instruction) {
+    switch (instruction) {
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP:
+        case OP_JUMP_IF_FALSE_POP:
+        case OP_LESS_JUMP_IF_FALSE:
+        case OP_FOR_RANGE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/**
+ * True for a conditional jump whose false branch starts by popping the condition,
+ * which is how ifStatement(), whileStatement() and forStatement() emit them.
+ * Those can pop the condition themselves and land just past that OP_POP.
+*/
+static bool jumpsToPop(Chunk* chunk, int offset) {
+    int target = jumpTarget(chunk, offset);
+    return target < chunk->count && INSTR_OP(chunk->code[target]) == OP_POP;
+}
+
+/**
+ * Returns where the jump at offset ends up once it has followed every jump it lands
+ * on. An unconditional jump can be followed anywhere. A conditional one is followed
+ * forward only, and also through another conditional jump, which finds the same
+ * condition on the stack and so takes its branch as well. OP_FOR_RANGE always goes
+ * back to the start of the body it closes.
+*/
+static int threadedTarget(Chunk* chunk, int offset) {
+    if (INSTR_OP(chunk->code[offset]) == OP_FOR_RANGE) return jumpTarget(chunk, offset);
+    bool conditional = INSTR_OP(chunk->code[offset]) == OP_JUMP_IF_FALSE;
+    int target = jumpTarget(chunk, offset);
+    // A chain can't be longer than the code, unless it is a loop that jumps to itself.
+    for (int hops = 0; hops < chunk->count && target < chunk->count; hops++) {
+        uint8_t next = INSTR_OP(chunk->code[target]);
+        bool follows = next == OP_JUMP || (!conditional && next == OP_LOOP) ||
+            (conditional && next == OP_JUMP_IF_FALSE);
+        if (!follows) break;
+
+        int nextTarget = jumpTarget(chunk, target);
+        if (conditional && nextTarget <= offset) break;
+        target = nextTarget;
+    }
+    return target;
+}
+
+static int targetOf(Rewriter* rewriter, int offset) {
+    if (rewriter->analyzeFlow) return threadedTarget(rewriter->chunk, offset);
+    return jumpTarget(rewriter->chunk, offset);
+}
+
+/**
+ * Checks that the instructions starting at offset are the given opcodes, in order,
+ * and that no jump lands in the middle of them. Their offsets are written to offsets.
+*/
+static bool matchSequence(Rewriter* rewriter, int offset, const uint8_t* ops, int count, int* offsets) {
+    Chunk* chunk = rewriter->chunk;
+    for (int i = 0; i < count; i++) {
+        if (offset >= chunk->count || INSTR_OP(chunk->code[offset]) != ops[i]) return false;
+        if (i > 0 && rewriter->isTarget[offset]) return false;
+        offsets[i] = offset;
+        offset += instructionLength(chunk, offset);
+    }
+    return true;
+}
+
+static void emit(Rewriter* rewriter, uint32_t instruction, int line) {
+    writeChunk(&rewriter->out, instruction, line);
+}
+
+static void emitJumpTo(Rewriter* rewriter, uint8_t instruction, int target, int line) {
+    if (rewriter->patchCapacity < rewriter->patchCount + 1) {
+        int oldCapacity = rewriter->patchCapacity;
+        rewriter->patchCapacity = GROW_CAPACITY(oldCapacity);
+        rewriter->patches = GROW_ARRAY(JumpPatch, rewriter->patches, oldCapacity, rewriter->patchCapacity);
+    }
+
+    // A threaded unconditional jump may now go the other way than it used to. The
+    // targets that already have a new offset are the ones behind it.
+    if (instruction == OP_JUMP || instruction == OP_LOOP) {
+        instruction = rewriter->newOffsets[target] != -1 ? OP_LOOP : OP_JUMP;
+    }
+
+    // For OP_FOR_RANGE this is only its last word, which holds nothing but the distance.
+    JumpPatch* patch = &rewriter->patches[rewriter->patchCount++];
+    patch->word = rewriter->out.count;
+    patch->target = target;
+    patch->backward = instruction == OP_LOOP || instruction == OP_FOR_RANGE;
+    emit(rewriter, INSTR_ENCODE(instruction == OP_FOR_RANGE ? 0 : instruction, 0), line);
+}
+
+static const uint8_t increment[] = { OP_GET_LOCAL, OP_CONSTANT, OP_ADD, OP_SET_LOCAL, OP_POP };
+
+/**
+ * True if both operands of a superinstruction fit in its two 12 bit fields.
+*/
+static bool fitsAB(uint32_t a, uint32_t b) {
+    return a <= INSTR_AB_MAX && b <= INSTR_AB_MAX;
+}
+
+/**
+ * Tries each superinstruction at offset, longest first. On a match the fused
+ * instruction is emitted and the number of old words it replaces is returned,
+ * otherwise 0.
+*/
+static int fuseAt(Rewriter* rewriter, int offset) {
+    Chunk* chunk = rewriter->chunk;
+    uint32_t* code = chunk->code;
+    int line = getLine(&chunk->lines, offset);
+    int at[5];
+
+    // local += constant; and local = local + constant; as statements.
+    if (matchSequence(rewriter, offset, increment, 5, at) &&
+        INSTR_ARG(code[at[0]]) == INSTR_ARG(code[at[3]]) &&
+        IS_NUMBER(chunk->constants.values[INSTR_ARG(code[at[1]])]) &&
+        fitsAB(INSTR_ARG(code[at[0]]), INSTR_ARG(code[at[1]]))) {
+        emit(rewriter, INSTR_ENCODE_AB(OP_INCREMENT_LOCAL, INSTR_ARG(code[at[0]]), INSTR_ARG(code[at[1]])), line);
+        return at[4] + 1 - offset;
+    }
+
+    static const uint8_t addLocals[] = { OP_GET_LOCAL, OP_GET_LOCAL, OP_ADD };
+    if (matchSequence(rewriter, offset, addLocals, 3, at) &&
+        fitsAB(INSTR_ARG(code[at[0]]), INSTR_ARG(code[at[1]]))) {
+        emit(rewriter, INSTR_ENCODE_AB(OP_ADD_LOCALS, INSTR_ARG(code[at[0]]), INSTR_ARG(code[at[1]])), line);
+        return at[2] + 1 - offset;
+    }
+
+    static const uint8_t lessJump[] = { OP_LESS, OP_JUMP_IF_FALSE, OP_POP };
+    if (matchSequence(rewriter, offset, lessJump, 3, at) && jumpsToPop(chunk, at[1])) {
+        emitJumpTo(rewriter, OP_LESS_JUMP_IF_FALSE, jumpTarget(chunk, at[1]) + 1, line);
+        return at[2] + 1 - offset;
+    }
+
+    static const uint8_t jumpPop[] = { OP_JUMP_IF_FALSE, OP_POP };
+    if (matchSequence(rewriter, offset, jumpPop, 2, at) && jumpsToPop(chunk, at[0])) {
+        emitJumpTo(rewriter, OP_JUMP_IF_FALSE_POP, jumpTarget(chunk, at[0]) + 1, line);
+        return at[1] + 1 - offset;
+    }
+
+    static const uint8_t localConstant[] = { OP_GET_LOCAL, OP_CONSTANT };
+    if (matchSequence(rewriter, offset, localConstant, 2, at) &&
+        fitsAB(INSTR_ARG(code[at[0]]), INSTR_ARG(code[at[1]]))) {
+        emit(rewriter, INSTR_ENCODE_AB(OP_GET_LOCAL_CONSTANT, INSTR_ARG(code[at[0]]), INSTR_ARG(code[at[1]])), line);
+        return at[1] + 1 - offset;
+    }
+
+    static const uint8_t setLocalPop[] = { OP_SET_LOCAL, OP_POP };
+    if (matchSequence(rewriter, offset, setLocalPop, 2, at)) {
+        emit(rewriter, INSTR_ENCODE(OP_SET_LOCAL_POP, INSTR_ARG(code[at[0]])), line);
+        return at[1] + 1 - offset;
+    }
+
+    return 0;
+}
+
+/**
+ * The peephole patterns, which only take out waste that the single pass compiler
+ * leaves behind and never fuse instructions.
+*/
+static bool pushesWithoutEffects(uint8_t instruction) {
+    switch (instruction) {
+        case OP_CONSTANT:
+        case OP_NULL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_LOCAL:
+        case OP_GET_UPVALUE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static int simplifyAt(Rewriter* rewriter, int offset) {
+    Chunk* chunk = rewriter->chunk;
+    uint32_t* code = chunk->code;
+    int line = getLine(&chunk->lines, offset);
+    int at[3];
+
+    // An assignment statement followed by a read of the same local: the assigned
+    // value is still on top of the stack. Increments are left for OP_INCREMENT_LOCAL,
+    // which is worth more than the read.
+    static const uint8_t setPopGet[] = { OP_SET_LOCAL, OP_POP, OP_GET_LOCAL };
+    int before[5];
+    if (matchSequence(rewriter, offset, setPopGet, 3, at) &&
+        INSTR_ARG(code[at[0]]) == INSTR_ARG(code[at[2]]) &&
+        !(offset >= 3 && matchSequence(rewriter, offset - 3, increment, 5, before))) {
+        emit(rewriter, code[at[0]], line);
+        return at[2] + 1 - offset;
+    }
+
+    // != compiles to both of these.
+    static const uint8_t equalNot[] = { OP_EQUAL, OP_NOT };
+    if (matchSequence(rewriter, offset, equalNot, 2, at)) {
+        emit(rewriter, INSTR_ENCODE(OP_NOT_EQUAL, 0), line);
+        return at[1] + 1 - offset;
+    }
+
+    // A value that is popped right after being pushed, like an expression statement
+    // without effects leaves, doesn't need either instruction.
+    if (pushesWithoutEffects(INSTR_OP(code[offset])) && offset + 1 < chunk->count &&
+        INSTR_OP(code[offset + 1]) == OP_POP && !rewriter->isTarget[offset + 1]) {
+        return 2;
+    }
+
+    return 0;
+}
+
+/**
+ * The control flow pass. The code splits into basic blocks at every jump target and
+ * after every jump and return. Starting from the first block, each block that can run
+ * is walked, together with the blocks that it jumps or falls through to. The code of
+ * every other block is left out, jumps go straight to the end of a chain of jumps,
+ * and a jump to the instruction that follows it goes away.
+*/
+typedef enum {
+    BRANCH_UNKNOWN,
+    BRANCH_NEVER,   // Push, OP_JUMP_IF_FALSE of a value that is never false
+    BRANCH_ALWAYS   // Push, OP_JUMP_IF_FALSE of a value that is always false
+} ConstantBranch;
+
+/**
+ * Tells whether the instruction at offset pushes a constant that the conditional
+ * jump right after it tests, which then goes the same way every time.
+*/
+static ConstantBranch constantBranch(Rewriter* rewriter, int offset) {
+    Chunk* chunk = rewriter->chunk;
+    uint32_t* code = chunk->code;
+    if (offset + 1 >= chunk->count || INSTR_OP(code[offset + 1]) != OP_JUMP_IF_FALSE ||
+        rewriter->isTarget[offset + 1]) {
+        return BRANCH_UNKNOWN;
+    }
+
+    switch (INSTR_OP(code[offset])) {
+        case OP_NULL:
+        case OP_FALSE:
+            return BRANCH_ALWAYS;
+        case OP_TRUE:
+        case OP_CONSTANT:   // Numbers and strings
+            return BRANCH_NEVER;
+        default:
+            return BRANCH_UNKNOWN;
+    }
+}
+
+/**
+ * Returns the first offset from offset on that holds live code, or the end of the code.
+*/
+static int nextLive(Rewriter* rewriter, int offset) {
+    while (offset < rewriter->chunk->count && !rewriter->isLive[offset]) offset++;
+    return offset;
+}
+
+static void findLiveCode(Rewriter* rewriter) {
+    Chunk* chunk = rewriter->chunk;
+    // Every live jump adds at most one block to walk.
+    int* blocks = ALLOCATE(int, chunk->count + 1);
+    int blockCount = 0;
+    blocks[blockCount++] = 0;
+
+    while (blockCount > 0) {
+        int offset = blocks[--blockCount];
+        while (offset < chunk->count && !rewriter->isLive[offset]) {
+            rewriter->isLive[offset] = true;
+            uint8_t instruction = INSTR_OP(chunk->code[offset]);
+            int next = offset + instructionLength(chunk, offset);
+
+            ConstantBranch branch = constantBranch(rewriter, offset);
+            if (branch == BRANCH_NEVER) {
+                rewriter->isLive[offset + 1] = true;
+                offset += 2;
+                continue;
+            }
+            if (branch == BRANCH_ALWAYS) {
+                rewriter->isLive[offset + 1] = true;
+                blocks[blockCount++] = targetOf(rewriter, offset + 1);
+                break;
+            }
+
+            if (isJump(instruction)) {
+                blocks[blockCount++] = targetOf(rewriter, offset);
+            }
+            if (instruction == OP_JUMP || instruction == OP_LOOP || instruction == OP_RETURN) break;
+            offset = next;
+        }
+    }
+
+    FREE_ARRAY(int, blocks, chunk->count + 1);
+}
+
+static int pruneAt(Rewriter* rewriter, int offset) {
+    Chunk* chunk = rewriter->chunk;
+    if (!rewriter->isLive[offset]) return instructionLength(chunk, offset);
+
+    uint32_t* code = chunk->code;
+    int line = getLine(&chunk->lines, offset);
+    switch (constantBranch(rewriter, offset)) {
+        case BRANCH_NEVER:
+            // The OP_POP that usually starts the branch that runs goes with the value.
+            if (offset + 2 < chunk->count && INSTR_OP(code[offset + 2]) == OP_POP && !rewriter->isTarget[offset + 2]) {
+                return 3;
+            }
+            emit(rewriter, code[offset], line);
+            return 2;
+        case BRANCH_ALWAYS: {
+            // The value stays for the OP_POP at the target.
+            emit(rewriter, code[offset], line);
+            int target = targetOf(rewriter, offset + 1);
+            if (target != nextLive(rewriter, offset + 2)) emitJumpTo(rewriter, OP_JUMP, target, line);
+            return 2;
+        }
+        default:
+            break;
+    }
+
+    if (INSTR_OP(code[offset]) == OP_JUMP && targetOf(rewriter, offset) == nextLive(rewriter, offset + 1)) {
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Marks every offset that a jump lands on, so that no superinstruction swallows it.
+ * The instruction after a popped-condition target counts too, since the fused
+ * conditional jumps land there.
+*/
+static void findJumpTargets(Rewriter* rewriter) {
+    Chunk* chunk = rewriter->chunk;
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+        uint8_t instruction = INSTR_OP(chunk->code[offset]);
+        if (!isJump(instruction)) continue;
+
+        int target = targetOf(rewriter, offset);
+        rewriter->isTarget[target] = true;
+        if (instruction == OP_JUMP_IF_FALSE && jumpsToPop(chunk, offset)) {
+            rewriter->isTarget[target + 1] = true;
+        }
+    }
+}
+
+/**
+ * Runs one pass over chunk, rewriting with rewrite wherever it matches and copying
+ * every other instruction, and relocates the jumps and the line table.
+*/
+static void rewriteChunk(Chunk* chunk, RewriteFn rewrite, bool analyzeFlow) {
+    Rewriter rewriter;
+    rewriter.chunk = chunk;
+    rewriter.rewrite = rewrite;
+    rewriter.analyzeFlow = analyzeFlow;
+    initChunk(&rewriter.out);
+    rewriter.newOffsets = ALLOCATE(int, chunk->count + 1);
+    rewriter.isTarget = ALLOCATE(bool, chunk->count + 1);
+    rewriter.isLive = analyzeFlow ? ALLOCATE(bool, chunk->count + 1) : NULL;
+    rewriter.patches = NULL;
+    rewriter.patchCount = 0;
+    rewriter.patchCapacity = 0;
+
+    for (int i = 0; i <= chunk->count; i++) {
+        rewriter.newOffsets[i] = -1;
+        rewriter.isTarget[i] = false;
+        if (analyzeFlow) rewriter.isLive[i] = false;
+    }
+    findJumpTargets(&rewriter);
+    if (analyzeFlow) findLiveCode(&rewriter);
+
+    int offset = 0;
+    while (offset < chunk->count) {
+        rewriter.newOffsets[offset] = rewriter.out.count;
+
+        int rewritten = rewriter.rewrite(&rewriter, offset);
+        if (rewritten > 0) {
+            offset += rewritten;
+            continue;
+        }
+
+        int length = instructionLength(chunk, offset);
+        int line = getLine(&chunk->lines, offset);
+        if (INSTR_OP(chunk->code[offset]) == OP_FOR_RANGE) {
+            // The distance back to the body is in the last word.
+            emit(&rewriter, chunk->code[offset], line);
+            emit(&rewriter, chunk->code[offset + 1], line);
+            emitJumpTo(&rewriter, OP_FOR_RANGE, targetOf(&rewriter, offset), line);
+        }
+        else if (isJump(INSTR_OP(chunk->code[offset]))) {
+            emitJumpTo(&rewriter, INSTR_OP(chunk->code[offset]), targetOf(&rewriter, offset), line);
+        }
+        else {
+            for (int i = 0; i < length; i++) {
+                emit(&rewriter, chunk->code[offset + i], line);
+            }
+        }
+        offset += length;
+    }
+    rewriter.newOffsets[chunk->count] = rewriter.out.count;
+
+    // The code only ever shrinks and every jump stays inside it, so the relocated
+    // jumps still fit in their operand.
+    for (int i = 0; i < rewriter.patchCount; i++) {
+        JumpPatch* patch = &rewriter.patches[i];
+        int target = rewriter.newOffsets[patch->target];
+        int jump = patch->backward ? patch->word + 1 - target : target - (patch->word + 1);
+        uint32_t* word = &rewriter.out.code[patch->word];
+        *word = INSTR_ENCODE(INSTR_OP(*word), jump);
+    }
+
+    FREE_ARRAY(int, rewriter.newOffsets, chunk->count + 1);
+    FREE_ARRAY(bool, rewriter.isTarget, chunk->count + 1);
+    if (analyzeFlow) FREE_ARRAY(bool, rewriter.isLive, chunk->count + 1);
+    FREE_ARRAY(JumpPatch, rewriter.patches, rewriter.patchCapacity);
+
+    FREE_ARRAY(uint32_t, chunk->code, chunk->capacity);
+    FREE_ARRAY(LineStart, chunk->lines.starts, chunk->lines.capacity);
+    chunk->code = rewriter.out.code;
+    chunk->lines = rewriter.out.lines;
+    chunk->count = rewriter.out.count;
+    chunk->capacity = rewriter.out.capacity;
+}
+
+void peepholeChunk(Chunk* chunk) {
+    rewriteChunk(chunk, simplifyAt, false);
+}
+
+void pruneChunk(Chunk* chunk) {
+    rewriteChunk(chunk, pruneAt, true);
+}
+
+void optimizeChunk(Chunk* chunk) {
+    rewriteChunk(chunk, fuseAt, false);
+}
@@ -0,0 +1,29 @@
+#ifndef kc_optimizer_h
+#define kc_optimizer_h
+
+#include "chunk.h"
+
+/**
+ * Splits a finished Chunk into basic blocks and drops the ones that can never run,
+ * such as code after a return or a break, or a branch behind a constant condition.
+ * Jumps that land on jumps go straight to where the chain ends. Runs first, so
+ * peepholeChunk() sees the code that is left.
+*/
+void pruneChunk(Chunk* chunk);
+
+/**
+ * Cleans up a finished Chunk in place: OP_EQUAL OP_NOT becomes OP_NOT_EQUAL, a value
+ * popped right after being pushed goes away, and so does a read of the local that was
+ * just assigned. Jump offsets and the line table are relocated to match the new code.
+ * Runs before optimizeChunk(), and leaves the increments that it fuses alone.
+*/
+void peepholeChunk(Chunk* chunk);
+
+/**
+ * Rewrites a finished Chunk in place, replacing common opcode sequences with
+ * the fused superinstructions from chunk.h. Jump offsets and the line table are
+ * relocated to match the new code.
+*/
+void optimizeChunk(Chunk* chunk);
+
+#endif
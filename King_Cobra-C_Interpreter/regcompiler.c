@@ -0,0 +1,579 @@
+#include <stdlib.h>
+
+#include "common.h"
+#include "memory.h"
+#include "regcompiler.h"
+
+/**
+ * Where the value at one position of the stack code's stack currently is.
+ * Locals and constants are not copied into a register when they are pushed. The
+ * instruction that uses them reads the local or the constant directly instead, and
+ * a value is only moved into the register at its own position once something needs
+ * it there: a call, a jump, a helper working on the VM stack or a write to the local.
+*/
+typedef enum {
+    OPERAND_REGISTER,   // In the register at its own stack position
+    OPERAND_LOCAL,      // Still in the register of local `index`
+    OPERAND_CONSTANT    // Still constant `index`
+} OperandType;
+
+typedef struct {
+    OperandType type;
+    int index;
+} Operand;
+
+/**
+ * A jump in the register code whose offset is filled in once every stack
+ * instruction has a register code offset.
+*/
+typedef struct {
+    int word;       // Register code word that holds the offset
+    int target;     // Offset the jump has to land on in the stack code
+} RegisterJump;
+
+typedef struct {
+    Chunk* chunk;
+    RegisterCode* out;
+    Operand stack[UINT8_COUNT];
+    int depth;
+    int maxDepth;
+    bool reachable;     // False after a jump or return, until the next jump target
+    bool failed;
+    int line;
+    int lastWrite;      // Last emitted instruction if it only writes R[A], else -1
+    int* depthAt;       // Stack depth at each jump target, -1 until a jump records it
+    int* newOffsets;    // Stack code offset -> register code offset
+    bool* isTarget;
+    RegisterJump* jumps;
+    int jumpCount;
+    int jumpCapacity;
+} Translator;
+
+static int emit(Translator* translator, uint32_t instruction) {
+    RegisterCode* out = translator->out;
+    if (out->capacity < out->count + 1) {
+        int oldCapacity = out->capacity;
+        out->capacity = GROW_CAPACITY(oldCapacity);
+        out->code = GROW_ARRAY(uint32_t, out->code, oldCapacity, out->capacity);
+    }
+
+    out->code[out->count] = instruction;
+    addLine(&out->lines, out->count, translator->line);
+    translator->lastWrite = -1;
+    return out->count++;
+}
+
+/**
+ * Emits an instruction that only writes R[A], which setLocal() may later point
+ * straight at a local instead of a temporary.
+*/
+static void emitWrite(Translator* translator, uint32_t instruction) {
+    int word = emit(translator, instruction);
+    translator->lastWrite = word;
+}
+
+static void emitJump(Translator* translator, uint32_t instruction, int target) {
+    if (translator->jumpCapacity < translator->jumpCount + 1) {
+        int oldCapacity = translator->jumpCapacity;
+        translator->jumpCapacity = GROW_CAPACITY(oldCapacity);
+        translator->jumps = GROW_ARRAY(RegisterJump, translator->jumps, oldCapacity, translator->jumpCapacity);
+    }
+
+    RegisterJump* jump = &translator->jumps[translator->jumpCount++];
+    jump->word = emit(translator, instruction);
+    jump->target = target;
+}
+
+/**
+ * Remembers the stack depth a jump arrives with. The first jump to reach a
+ * target decides its depth.
+*/
+static void recordDepth(Translator* translator, int target, int depth) {
+    if (translator->depthAt[target] == -1) translator->depthAt[target] = depth;
+}
+
+static void pushOperand(Translator* translator, OperandType type, int index) {
+    if (translator->depth == UINT8_COUNT) {
+        translator->failed = true;
+        return;
+    }
+
+    translator->stack[translator->depth].type = type;
+    translator->stack[translator->depth].index = index;
+    translator->depth++;
+    if (translator->depth > translator->maxDepth) translator->maxDepth = translator->depth;
+}
+
+static void popOperands(Translator* translator, int count) {
+    if (translator->depth < count) {
+        translator->failed = true;
+        return;
+    }
+    translator->depth -= count;
+}
+
+/**
+ * Moves the value at position into its own register if it is not there yet.
+*/
+static void materialize(Translator* translator, int position) {
+    if (position >= translator->depth) return;
+
+    Operand* operand = &translator->stack[position];
+    if (operand->type == OPERAND_LOCAL) {
+        emit(translator, REG_ENCODE(ROP_MOVE, position, operand->index, 0));
+    }
+    else if (operand->type == OPERAND_CONSTANT) {
+        emit(translator, REG_ENCODE_BX(ROP_LOAD_CONSTANT, position, operand->index));
+    }
+    operand->type = OPERAND_REGISTER;
+}
+
+static void materializeBelow(Translator* translator, int depth) {
+    for (int i = 0; i < depth; i++) materialize(translator, i);
+}
+
+/**
+ * Returns the register holding the value at position, which is the local it
+ * still refers to if it was never copied out.
+*/
+static int operandRegister(Translator* translator, int position) {
+    Operand* operand = &translator->stack[position];
+    if (operand->type == OPERAND_LOCAL) return operand->index;
+    materialize(translator, position);
+    return position;
+}
+
+/**
+ * Gets everything that still refers to local slot out of the way before the
+ * local is written.
+*/
+static void writeLocal(Translator* translator, int slot, int keep) {
+    for (int i = 0; i < translator->depth; i++) {
+        Operand* operand = &translator->stack[i];
+        if (i != keep && operand->type == OPERAND_LOCAL && operand->index == slot) {
+            materialize(translator, i);
+        }
+    }
+    if (slot < translator->depth) translator->stack[slot].type = OPERAND_REGISTER;
+}
+
+static void binary(Translator* translator, RegOpCode registerOp, RegOpCode constantOp) {
+    int target = translator->depth - 2;
+    Operand right = translator->stack[translator->depth - 1];
+    int left = operandRegister(translator, target);
+
+    // Constants past the byte-sized C field are read from a register instead.
+    uint32_t instruction;
+    if (right.type == OPERAND_CONSTANT && right.index <= UINT8_MAX) {
+        instruction = REG_ENCODE(constantOp, target, left, right.index);
+    }
+    else {
+        instruction = REG_ENCODE(registerOp, target, left, operandRegister(translator, target + 1));
+    }
+
+    popOperands(translator, 2);
+    emitWrite(translator, instruction);
+    pushOperand(translator, OPERAND_REGISTER, 0);
+}
+
+static void unary(Translator* translator, RegOpCode op) {
+    int target = translator->depth - 1;
+    int operand = operandRegister(translator, target);
+    popOperands(translator, 1);
+    emitWrite(translator, REG_ENCODE(op, target, operand, 0));
+    pushOperand(translator, OPERAND_REGISTER, 0);
+}
+
+/**
+ * Stores the value on top of the stack into local slot. When that value was just
+ * computed into its temporary, the instruction that computed it is made to write
+ * the local instead, so `i = i + 1` is a single ROP_ADD_K.
+*/
+static void setLocal(Translator* translator, int slot, bool pop) {
+    int top = translator->depth - 1;
+    Operand value = translator->stack[top];
+
+    if (slot == top) {
+        materialize(translator, top);
+    }
+    else if (value.type != OPERAND_LOCAL || value.index != slot) {
+        writeLocal(translator, slot, top);
+
+        RegisterCode* out = translator->out;
+        if (value.type == OPERAND_REGISTER && translator->lastWrite == out->count - 1 &&
+            translator->lastWrite != -1 && REG_A(out->code[translator->lastWrite]) == (uint32_t)top) {
+            out->code[translator->lastWrite] = (out->code[translator->lastWrite] & ~0xff00u) | ((uint32_t)slot << 8);
+            translator->stack[top].type = OPERAND_LOCAL;
+            translator->stack[top].index = slot;
+        }
+        else if (value.type == OPERAND_CONSTANT) {
+            emit(translator, REG_ENCODE_BX(ROP_LOAD_CONSTANT, slot, value.index));
+        }
+        else {
+            emit(translator, REG_ENCODE(ROP_MOVE, slot, operandRegister(translator, top), 0));
+        }
+    }
+
+    translator->lastWrite = -1;
+    if (pop) popOperands(translator, 1);
+}
+
+/**
+ * Pops the condition and jumps to target when it is false. A comparison that was
+ * just computed into the condition's temporary is fused into the jump.
+*/
+static void jumpIfFalsePop(Translator* translator, int target) {
+    int top = translator->depth - 1;
+    materializeBelow(translator, top);
+
+    RegisterCode* out = translator->out;
+    uint32_t last = translator->lastWrite == -1 ? 0 : out->code[translator->lastWrite];
+    if (translator->stack[top].type == OPERAND_REGISTER && translator->lastWrite == out->count - 1 &&
+        translator->lastWrite != -1 && REG_A(last) == (uint32_t)top &&
+        (REG_OP(last) == ROP_LESS || REG_OP(last) == ROP_LESS_K)) {
+        RegOpCode op = REG_OP(last) == ROP_LESS ? ROP_JUMP_IF_NOT_LESS : ROP_JUMP_IF_NOT_LESS_K;
+        out->count--;
+        emit(translator, REG_ENCODE(op, 0, REG_B(last), REG_C(last)));
+        emitJump(translator, REG_ENCODE_BX(ROP_JUMP, 0, 0), target);
+    }
+    else {
+        emitJump(translator, REG_ENCODE_BX(ROP_JUMP_IF_FALSE, operandRegister(translator, top), 0), target);
+    }
+
+    popOperands(translator, 1);
+    recordDepth(translator, target, translator->depth);
+}
+
+/**
+ * Returns operand, failing the translation if it does not fit in a register
+ * instruction field that holds at most max.
+*/
+static uint32_t narrow(Translator* translator, uint32_t operand, uint32_t max) {
+    if (operand > max) {
+        translator->failed = true;
+        return 0;
+    }
+    return operand;
+}
+
+static void translateInstruction(Translator* translator, int offset) {
+    Chunk* chunk = translator->chunk;
+    uint32_t* code = chunk->code + offset;
+    uint32_t arg = INSTR_ARG(code[0]);
+    int top = translator->depth - 1;
+
+    switch (INSTR_OP(code[0])) {
+        case OP_CONSTANT:
+            pushOperand(translator, OPERAND_CONSTANT, narrow(translator, arg, UINT16_MAX));
+            break;
+        case OP_NULL:
+            emitWrite(translator, REG_ENCODE(ROP_NULL, top + 1, 0, 0));
+            pushOperand(translator, OPERAND_REGISTER, 0);
+            break;
+        case OP_TRUE:
+            emitWrite(translator, REG_ENCODE(ROP_TRUE, top + 1, 0, 0));
+            pushOperand(translator, OPERAND_REGISTER, 0);
+            break;
+        case OP_FALSE:
+            emitWrite(translator, REG_ENCODE(ROP_FALSE, top + 1, 0, 0));
+            pushOperand(translator, OPERAND_REGISTER, 0);
+            break;
+        case OP_POP:
+            popOperands(translator, 1);
+            translator->lastWrite = -1;
+            break;
+        case OP_GET_LOCAL:
+            materialize(translator, arg);
+            pushOperand(translator, OPERAND_LOCAL, arg);
+            break;
+        case OP_SET_LOCAL:
+            setLocal(translator, arg, false);
+            break;
+        case OP_GET_GLOBAL:
+            emitWrite(translator, REG_ENCODE_BX(ROP_GET_GLOBAL, top + 1, narrow(translator, arg, UINT16_MAX)));
+            pushOperand(translator, OPERAND_REGISTER, 0);
+            break;
+        case OP_DEFINE_GLOBAL:
+            emit(translator, REG_ENCODE_BX(ROP_DEFINE_GLOBAL, operandRegister(translator, top),
+                narrow(translator, arg, UINT16_MAX)));
+            popOperands(translator, 1);
+            break;
+        case OP_SET_GLOBAL:
+            emit(translator, REG_ENCODE_BX(ROP_SET_GLOBAL, operandRegister(translator, top),
+                narrow(translator, arg, UINT16_MAX)));
+            break;
+        case OP_GET_UPVALUE:
+            emitWrite(translator, REG_ENCODE(ROP_GET_UPVALUE, top + 1, arg, 0));
+            pushOperand(translator, OPERAND_REGISTER, 0);
+            break;
+        case OP_SET_UPVALUE:
+            emit(translator, REG_ENCODE(ROP_SET_UPVALUE, operandRegister(translator, top), arg, 0));
+            break;
+        case OP_GET_PROPERTY:
+            materialize(translator, top);
+            emit(translator, REG_ENCODE_BX(ROP_GET_PROPERTY, top, narrow(translator, arg, UINT16_MAX)));
+            emit(translator, code[1]);
+            break;
+        case OP_SET_PROPERTY:
+            materialize(translator, top - 1);
+            materialize(translator, top);
+            emit(translator, REG_ENCODE_BX(ROP_SET_PROPERTY, top - 1, narrow(translator, arg, UINT16_MAX)));
+            emit(translator, code[1]);
+            popOperands(translator, 1);
+            break;
+        case OP_GET_SUPER:
+            materialize(translator, top - 1);
+            materialize(translator, top);
+            emit(translator, REG_ENCODE_BX(ROP_GET_SUPER, top - 1, narrow(translator, arg, UINT16_MAX)));
+            popOperands(translator, 1);
+            break;
+        case OP_EQUAL:          binary(translator, ROP_EQUAL, ROP_EQUAL_K); break;
+        case OP_NOT_EQUAL:      binary(translator, ROP_NOT_EQUAL, ROP_NOT_EQUAL_K); break;
+        case OP_GREATER:        binary(translator, ROP_GREATER, ROP_GREATER_K); break;
+        case OP_LESS:           binary(translator, ROP_LESS, ROP_LESS_K); break;
+        case OP_GREATER_EQUAL:  binary(translator, ROP_GREATER_EQUAL, ROP_GREATER_EQUAL_K); break;
+        case OP_LESS_EQUAL:     binary(translator, ROP_LESS_EQUAL, ROP_LESS_EQUAL_K); break;
+        case OP_ADD:            binary(translator, ROP_ADD, ROP_ADD_K); break;
+        case OP_SUBTRACT:       binary(translator, ROP_SUBTRACT, ROP_SUBTRACT_K); break;
+        case OP_MULTIPLY:       binary(translator, ROP_MULTIPLY, ROP_MULTIPLY_K); break;
+        case OP_DIVIDE:         binary(translator, ROP_DIVIDE, ROP_DIVIDE_K); break;
+        case OP_NOT:            unary(translator, ROP_NOT); break;
+        case OP_NEGATE:         unary(translator, ROP_NEGATE); break;
+        case OP_PRINT:
+            emit(translator, REG_ENCODE(ROP_PRINT, operandRegister(translator, top), 0, 0));
+            popOperands(translator, 1);
+            break;
+        case OP_JUMP:
+        case OP_LOOP: {
+            int target = jumpTarget(chunk, offset);
+            materializeBelow(translator, translator->depth);
+            emitJump(translator, REG_ENCODE_BX(ROP_JUMP, 0, 0), target);
+            recordDepth(translator, target, translator->depth);
+            translator->reachable = false;
+            break;
+        }
+        case OP_JUMP_IF_FALSE: {
+            int target = jumpTarget(chunk, offset);
+            materializeBelow(translator, translator->depth);
+            emitJump(translator, REG_ENCODE_BX(ROP_JUMP_IF_FALSE, top, 0), target);
+            recordDepth(translator, target, translator->depth);
+            break;
+        }
+        case OP_JUMP_IF_FALSE_POP:
+            jumpIfFalsePop(translator, jumpTarget(chunk, offset));
+            break;
+        case OP_LESS_JUMP_IF_FALSE:
+            // Everything under the operands goes first, so nothing separates the
+            // comparison from the jump it gets fused into.
+            materializeBelow(translator, translator->depth - 2);
+            binary(translator, ROP_LESS, ROP_LESS_K);
+            jumpIfFalsePop(translator, jumpTarget(chunk, offset));
+            break;
+        case OP_FOR_RANGE: {
+            // The body is entered with every value in its own register.
+            int target = jumpTarget(chunk, offset);
+            materializeBelow(translator, translator->depth);
+            RegOpCode op = INSTR_OP(code[1]) ? ROP_FOR_RANGE_K : ROP_FOR_RANGE;
+            emit(translator, REG_ENCODE(op, narrow(translator, INSTR_A(code[0]), UINT8_MAX),
+                narrow(translator, INSTR_B(code[0]), UINT8_MAX), narrow(translator, INSTR_ARG(code[1]), UINT8_MAX)));
+            emitJump(translator, REG_ENCODE_BX(ROP_JUMP, 0, 0), target);
+            recordDepth(translator, target, translator->depth);
+            break;
+        }
+        case OP_CALL:
+        case OP_TAIL_CALL: {
+            int base = translator->depth - arg - 1;
+            materializeBelow(translator, translator->depth);
+            emit(translator, REG_ENCODE(INSTR_OP(code[0]) == OP_CALL ? ROP_CALL : ROP_TAIL_CALL, base, arg, 0));
+            popOperands(translator, arg + 1);
+            pushOperand(translator, OPERAND_REGISTER, 0);
+            break;
+        }
+        case OP_INVOKE:
+        case OP_TAIL_INVOKE: {
+            int argCount = INSTR_OP(code[1]);
+            int base = translator->depth - argCount - 1;
+            materializeBelow(translator, translator->depth);
+            emit(translator, REG_ENCODE(INSTR_OP(code[0]) == OP_INVOKE ? ROP_INVOKE : ROP_TAIL_INVOKE, base, argCount, narrow(translator, arg, UINT8_MAX)));
+            emit(translator, INSTR_ARG(code[1]));
+            popOperands(translator, argCount + 1);
+            pushOperand(translator, OPERAND_REGISTER, 0);
+            break;
+        }
+        case OP_SUPER_INVOKE:
+        case OP_TAIL_SUPER_INVOKE: {
+            int argCount = INSTR_OP(code[1]);
+            int base = translator->depth - argCount - 2;
+            materializeBelow(translator, translator->depth);
+            emit(translator, REG_ENCODE(INSTR_OP(code[0]) == OP_SUPER_INVOKE ? ROP_SUPER_INVOKE : ROP_TAIL_SUPER_INVOKE, base, argCount, narrow(translator, arg, UINT8_MAX)));
+            popOperands(translator, argCount + 2);
+            pushOperand(translator, OPERAND_REGISTER, 0);
+            break;
+        }
+        case OP_CLOSURE: {
+            ObjFunction* function = AS_FUNCTION(chunk->constants.values[arg]);
+            materializeBelow(translator, translator->depth);
+            emit(translator, REG_ENCODE_BX(ROP_CLOSURE, top + 1, narrow(translator, arg, UINT16_MAX)));
+            for (int i = 0; i < function->upvalueCount; i++) {
+                uint32_t upvalue = code[1 + i];
+                emit(translator, REG_ENCODE(0, INSTR_OP(upvalue), narrow(translator, INSTR_ARG(upvalue), UINT8_MAX), 0));
+            }
+            pushOperand(translator, OPERAND_REGISTER, 0);
+            break;
+        }
+        case OP_CLOSE_UPVALUE:
+            materialize(translator, top);
+            emit(translator, REG_ENCODE(ROP_CLOSE_UPVALUE, top, 0, 0));
+            popOperands(translator, 1);
+            break;
+        case OP_RETURN:
+            emit(translator, REG_ENCODE(ROP_RETURN, operandRegister(translator, top), 0, 0));
+            translator->reachable = false;
+            break;
+        case OP_CLASS:
+            emit(translator, REG_ENCODE_BX(ROP_CLASS, top + 1, narrow(translator, arg, UINT16_MAX)));
+            pushOperand(translator, OPERAND_REGISTER, 0);
+            break;
+        case OP_INHERIT:
+            materialize(translator, top - 1);
+            materialize(translator, top);
+            emit(translator, REG_ENCODE(ROP_INHERIT, top - 1, 0, 0));
+            popOperands(translator, 1);
+            break;
+        case OP_METHOD:
+            materialize(translator, top - 1);
+            materialize(translator, top);
+            emit(translator, REG_ENCODE_BX(ROP_METHOD, top - 1, narrow(translator, arg, UINT16_MAX)));
+            popOperands(translator, 1);
+            break;
+        case OP_GET_LOCAL_CONSTANT:
+            materialize(translator, INSTR_A(code[0]));
+            pushOperand(translator, OPERAND_LOCAL, INSTR_A(code[0]));
+            pushOperand(translator, OPERAND_CONSTANT, INSTR_B(code[0]));
+            break;
+        case OP_ADD_LOCALS:
+            materialize(translator, INSTR_A(code[0]));
+            materialize(translator, INSTR_B(code[0]));
+            emitWrite(translator, REG_ENCODE(ROP_ADD, top + 1,
+                narrow(translator, INSTR_A(code[0]), UINT8_MAX), narrow(translator, INSTR_B(code[0]), UINT8_MAX)));
+            pushOperand(translator, OPERAND_REGISTER, 0);
+            break;
+        case OP_INCREMENT_LOCAL: {
+            uint32_t slot = narrow(translator, INSTR_A(code[0]), UINT8_MAX);
+            materialize(translator, slot);
+            writeLocal(translator, slot, -1);
+            emit(translator, REG_ENCODE(ROP_ADD_K, slot, slot, narrow(translator, INSTR_B(code[0]), UINT8_MAX)));
+            break;
+        }
+        case OP_SET_LOCAL_POP:
+            setLocal(translator, arg, true);
+            break;
+        default:
+            translator->failed = true;
+            break;
+    }
+}
+
+/**
+ * Starts a jump target. Jumps land with every value in its own register, so the
+ * code falling through into the target has to get there too. The jumps to a target
+ * and the code falling through agree on its depth, so the depth recorded by the
+ * jumps is taken whenever there is one.
+*/
+static void enterTarget(Translator* translator, int offset) {
+    if (translator->reachable) {
+        materializeBelow(translator, translator->depth);
+    }
+
+    if (translator->depthAt[offset] != -1) {
+        translator->depth = translator->depthAt[offset];
+        if (translator->depth > translator->maxDepth) translator->maxDepth = translator->depth;
+        for (int i = 0; i < translator->depth; i++) {
+            translator->stack[i].type = OPERAND_REGISTER;
+        }
+    }
+    translator->reachable = true;
+    translator->lastWrite = -1;
+}
+
+void compileRegisterCode(ObjFunction* function) {
+    Chunk* chunk = &function->chunk;
+    Translator translator;
+    translator.chunk = chunk;
+    translator.out = &chunk->registers;
+    translator.out->count = 0;
+    translator.out->lines.count = 0;
+    translator.depth = 0;
+    translator.maxDepth = 0;
+    translator.reachable = true;
+    translator.failed = false;
+    translator.line = 0;
+    translator.lastWrite = -1;
+    translator.jumps = NULL;
+    translator.jumpCount = 0;
+    translator.jumpCapacity = 0;
+    translator.depthAt = ALLOCATE(int, chunk->count + 1);
+    translator.newOffsets = ALLOCATE(int, chunk->count + 1);
+    translator.isTarget = ALLOCATE(bool, chunk->count + 1);
+
+    for (int i = 0; i <= chunk->count; i++) {
+        translator.depthAt[i] = -1;
+        translator.newOffsets[i] = -1;
+        translator.isTarget[i] = false;
+    }
+
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+        switch (INSTR_OP(chunk->code[offset])) {
+            case OP_JUMP:
+            case OP_JUMP_IF_FALSE:
+            case OP_LOOP:
+            case OP_JUMP_IF_FALSE_POP:
+            case OP_LESS_JUMP_IF_FALSE:
+            case OP_FOR_RANGE:
+                translator.isTarget[jumpTarget(chunk, offset)] = true;
+                break;
+            default:
+                break;
+        }
+    }
+
+    // Slot zero holds the function itself, the parameters follow it.
+    for (int i = 0; i <= function->arity; i++) {
+        pushOperand(&translator, OPERAND_REGISTER, 0);
+    }
+
+    int offset = 0;
+    while (offset < chunk->count && !translator.failed) {
+        if (translator.isTarget[offset]) {
+            enterTarget(&translator, offset);
+        }
+
+        // Nothing jumps to code after a jump or return, so it is left out.
+        if (translator.reachable) {
+            translator.newOffsets[offset] = translator.out->count;
+            translator.line = getLine(&chunk->lines, offset);
+            translateInstruction(&translator, offset);
+        }
+        offset += instructionLength(chunk, offset);
+    }
+    translator.newOffsets[chunk->count] = translator.out->count;
+
+    for (int i = 0; i < translator.jumpCount && !translator.failed; i++) {
+        RegisterJump* jump = &translator.jumps[i];
+        int jumpOffset = translator.newOffsets[jump->target] - (jump->word + 1);
+        if (translator.newOffsets[jump->target] == -1 ||
+            jumpOffset < -REG_SBX_BIAS || jumpOffset > UINT16_MAX - REG_SBX_BIAS) {
+            translator.failed = true;
+            break;
+        }
+        uint32_t* word = &translator.out->code[jump->word];
+        *word = (*word & 0xffff) | ((uint32_t)(jumpOffset + REG_SBX_BIAS) << 16);
+    }
+    translator.out->frameSize = translator.maxDepth;
+
+    FREE_ARRAY(int, translator.depthAt, chunk->count + 1);
+    FREE_ARRAY(int, translator.newOffsets, chunk->count + 1);
+    FREE_ARRAY(bool, translator.isTarget, chunk->count + 1);
+    FREE_ARRAY(RegisterJump, translator.jumps, translator.jumpCapacity);
+    function->stackOnly = translator.failed;
+}
@@ -0,0 +1,15 @@
+#ifndef kc_regcompiler_h
+#define kc_regcompiler_h
+
+#include "object.h"
+
+/**
+ * Register machine backend. Translates the finished stack code of a function into
+ * the three-address RegisterCode stored next to it in its Chunk, which is what
+ * runRegisters() in vm.c executes. A function that needs more than 256 registers,
+ * or a jump or an operand that does not fit in the register format, is marked
+ * stackOnly instead and keeps running on run() under the register engine too.
+*/
+void compileRegisterCode(ObjFunction* function);
+
+#endif
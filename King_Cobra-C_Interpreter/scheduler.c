@@ -0,0 +1,644 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "isolate.h"
+#include "scheduler.h"
+#include "snapshot.h"
+#include "vm.h"
+
+#define MAX_WORKERS 64
+// The number of elements a kernel task takes on at a time.
+#define KERNEL_CHUNK 4096
+#define DEQUE_INITIAL 64
+#define CACHE_LINE 64
+// How long an idle worker sleeps before it looks for tasks again, should a wake-up be missed.
+#define IDLE_SLEEP_NS 10000000
+
+struct Future {
+    atomic_bool done;
+    ByteBuffer result;      // Image of the return value, once done is set
+    atomic_int references;
+};
+
+/**
+ * One run of a kernel over an array. The array is cut into chunks whose bounds only
+ * depend on its length, and the tasks of the batch claim chunks until none are left.
+ * Every chunk has its own place in output, so the result is the same however many
+ * threads took part and in whatever order they finished.
+*/
+typedef struct {
+    ByteBuffer kernel;      // Image of the kernel closure, read by every task
+    const double* input;
+    double* output;         // The result array of a map, the result of each chunk of a reduce
+    int count;
+    int chunkCount;
+    bool reduce;
+    bool registerEngine;
+    atomic_int nextChunk;
+    atomic_int running;     // Tasks that haven't finished yet
+    atomic_bool failed;
+    atomic_bool notNumber;
+} Batch;
+
+typedef struct Task {
+    ByteBuffer call;        // Image of the function and its arguments (see writeCallImage())
+    Future* future;
+    Batch* batch;           // The kernel run that the task is part of, instead of a call
+    bool registerEngine;
+    struct Task* next;      // Next in the shared queue
+} Task;
+
+typedef struct TaskArray {
+    int64_t capacity;
+    // A thief may still be reading an array that the owner has outgrown, so the old
+    // arrays are kept for as long as the deque is. Together they take up less than
+    // the newest one.
+    struct TaskArray* previous;
+    _Atomic(Task*) tasks[];
+} TaskArray;
+
+/**
+ * A work-stealing deque (Chase and Lev, with the memory orders of Lê et al.). Only the
+ * worker that owns it pushes and takes, at the bottom, without ever taking a lock;
+ * any other thread can steal from the top, which costs one compare-and-swap.
+*/
+typedef struct {
+    _Atomic(int64_t) top;
+    char topPadding[CACHE_LINE];
+    _Atomic(int64_t) bottom;
+    _Atomic(TaskArray*) array;
+    char bottomPadding[CACHE_LINE];
+} Deque;
+
+typedef struct {
+    Deque deque;
+    int index;
+} Worker;
+
+static Worker* workers;
+static int workerCount;
+static pthread_once_t workersStarted = PTHREAD_ONCE_INIT;
+
+// Tasks started by threads that aren't workers, which have no deque to push them on.
+static pthread_mutex_t sharedLock = PTHREAD_MUTEX_INITIALIZER;
+static Task* sharedHead;
+static Task* sharedTail;
+static atomic_int sharedCount;
+
+// Idle workers sleep on wakeUp, under sharedLock.
+static pthread_cond_t wakeUp = PTHREAD_COND_INITIALIZER;
+static atomic_int sleepers;
+
+static THREAD_LOCAL Worker* currentWorker;
+static THREAD_LOCAL uint32_t randomState;
+
+static TaskArray* newTaskArray(int64_t capacity) {
+    TaskArray* array = (TaskArray*)malloc(sizeof(TaskArray) + sizeof(Task*) * capacity);
+    if (array == NULL) exit(1);
+    array->capacity = capacity;
+    array->previous = NULL;
+    return array;
+}
+
+static void initDeque(Deque* deque) {
+    atomic_init(&deque->top, 0);
+    atomic_init(&deque->bottom, 0);
+    atomic_init(&deque->array, newTaskArray(DEQUE_INITIAL));
+}
+
+static void pushTask(Deque* deque, Task* task) {
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    TaskArray* array = atomic_load_explicit(&deque->array, memory_order_relaxed);
+
+    if (bottom - top > array->capacity - 1) {
+        TaskArray* grown = newTaskArray(array->capacity * 2);
+        for (int64_t i = top; i < bottom; i++) {
+            Task* moved = atomic_load_explicit(&array->tasks[i & (array->capacity - 1)], memory_order_relaxed);
+            atomic_store_explicit(&grown->tasks[i & (grown->capacity - 1)], moved, memory_order_relaxed);
+        }
+        grown->previous = array;
+        atomic_store_explicit(&deque->array, grown, memory_order_release);
+        array = grown;
+    }
+
+    atomic_store_explicit(&array->tasks[bottom & (array->capacity - 1)], task, memory_order_relaxed);
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_release);
+}
+
+/**
+ * Takes the newest task off the bottom of the owner's own deque.
+*/
+static Task* takeTask(Deque* deque) {
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    TaskArray* array = atomic_load_explicit(&deque->array, memory_order_relaxed);
+    atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+    if (top > bottom) {
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+        return NULL;
+    }
+    Task* task = atomic_load_explicit(&array->tasks[bottom & (array->capacity - 1)], memory_order_relaxed);
+    if (top == bottom) {
+        // The last task: a thief may be after it as well.
+        if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+                memory_order_seq_cst, memory_order_relaxed)) {
+            task = NULL;
+        }
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    }
+    return task;
+}
+
+/**
+ * Steals the oldest task off the top of another worker's deque.
+*/
+static Task* stealTask(Deque* deque) {
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+    if (top >= bottom) return NULL;
+
+    TaskArray* array = atomic_load_explicit(&deque->array, memory_order_acquire);
+    Task* task = atomic_load_explicit(&array->tasks[top & (array->capacity - 1)], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+            memory_order_seq_cst, memory_order_relaxed)) {
+        return NULL;
+    }
+    return task;
+}
+
+static bool dequeEmpty(Deque* deque) {
+    return atomic_load_explicit(&deque->bottom, memory_order_acquire) <=
+        atomic_load_explicit(&deque->top, memory_order_acquire);
+}
+
+static Task* takeSharedTask() {
+    if (atomic_load_explicit(&sharedCount, memory_order_acquire) == 0) return NULL;
+
+    pthread_mutex_lock(&sharedLock);
+    Task* task = sharedHead;
+    if (task != NULL) {
+        sharedHead = task->next;
+        if (sharedHead == NULL) sharedTail = NULL;
+        atomic_fetch_sub_explicit(&sharedCount, 1, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&sharedLock);
+    return task;
+}
+
+/**
+ * Finds a task for the current thread to run: the newest one on its own deque, else
+ * the oldest one started outside the pool, else one stolen from a random worker.
+*/
+static Task* findTask() {
+    Task* task = NULL;
+    if (currentWorker != NULL) task = takeTask(&currentWorker->deque);
+    if (task == NULL) task = takeSharedTask();
+    if (task != NULL) return task;
+
+    if (randomState == 0) randomState = 2463534242u;
+    randomState ^= randomState << 13;
+    randomState ^= randomState >> 17;
+    randomState ^= randomState << 5;
+    int start = (int)(randomState % (uint32_t)workerCount);
+    for (int i = 0; i < workerCount; i++) {
+        Worker* victim = &workers[(start + i) % workerCount];
+        if (victim == currentWorker) continue;
+        task = stealTask(&victim->deque);
+        if (task != NULL) return task;
+    }
+    return NULL;
+}
+
+static bool workQueued() {
+    if (atomic_load_explicit(&sharedCount, memory_order_seq_cst) > 0) return true;
+    for (int i = 0; i < workerCount; i++) {
+        if (!dequeEmpty(&workers[i].deque)) return true;
+    }
+    return false;
+}
+
+/**
+ * Puts a worker with nothing to do to sleep until a task is queued.
+*/
+static void sleepUntilQueued() {
+    pthread_mutex_lock(&sharedLock);
+    atomic_fetch_add_explicit(&sleepers, 1, memory_order_seq_cst);
+    if (!workQueued()) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += IDLE_SLEEP_NS;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&wakeUp, &sharedLock, &deadline);
+    }
+    atomic_fetch_sub_explicit(&sleepers, 1, memory_order_relaxed);
+    pthread_mutex_unlock(&sharedLock);
+}
+
+static void queueTask(Task* task) {
+    if (currentWorker != NULL) {
+        pushTask(&currentWorker->deque, task);
+    }
+    else {
+        pthread_mutex_lock(&sharedLock);
+        if (sharedTail == NULL) {
+            sharedHead = task;
+        }
+        else {
+            sharedTail->next = task;
+        }
+        sharedTail = task;
+        atomic_fetch_add_explicit(&sharedCount, 1, memory_order_seq_cst);
+        pthread_mutex_unlock(&sharedLock);
+    }
+
+    if (atomic_load_explicit(&sleepers, memory_order_seq_cst) > 0) {
+        pthread_mutex_lock(&sharedLock);
+        pthread_cond_signal(&wakeUp);
+        pthread_mutex_unlock(&sharedLock);
+    }
+}
+
+void releaseFuture(Future* future) {
+    if (atomic_fetch_sub_explicit(&future->references, 1, memory_order_acq_rel) != 1) return;
+
+    if (atomic_load_explicit(&future->done, memory_order_acquire)) discardHeapImage(&future->result);
+    freeByteBuffer(&future->result);
+    free(future);
+}
+
+/**
+ * Reads the kernel of batch into the running VM and leaves it on the stack.
+*/
+static ObjClosure* loadKernel(Batch* batch) {
+    vm.registerEngine = batch->registerEngine;
+    // Every copy of the kernel takes over its own references to the channels in it.
+    retainHeapImage(&batch->kernel);
+    Reader reader;
+    initReader(&reader, batch->kernel.bytes, batch->kernel.count);
+    Value kernel;
+    int count = readHeapImage(&reader, &kernel, 1, true);
+    freeReader(&reader);
+    if (count != 1 || !IS_CLOSURE(kernel)) return NULL;
+    push(kernel);
+    return AS_CLOSURE(kernel);
+}
+
+/**
+ * Calls kernel with x, and with y too if it is a reduce, and stores the number it
+ * returns in result. Returns false if the call fails or returns something else.
+*/
+static bool callKernel(Batch* batch, ObjClosure* kernel, double x, double y, double* result) {
+    push(OBJ_VAL(kernel));
+    push(NUMBER_VAL(x));
+    if (batch->reduce) push(NUMBER_VAL(y));
+    if (runClosure(kernel, batch->reduce ? 2 : 1) != INTERPRET_OK) {
+        atomic_store_explicit(&batch->failed, true, memory_order_relaxed);
+        return false;
+    }
+
+    Value value = pop();
+    if (!IS_NUMBER(value)) {
+        atomic_store_explicit(&batch->notNumber, true, memory_order_relaxed);
+        atomic_store_explicit(&batch->failed, true, memory_order_relaxed);
+        return false;
+    }
+    *result = AS_NUMBER(value);
+    return true;
+}
+
+/**
+ * Runs the kernel over chunks of the array until there are none left, or until some
+ * call of the kernel, on any thread, has failed.
+*/
+static void runChunks(Batch* batch, ObjClosure* kernel) {
+    while (!atomic_load_explicit(&batch->failed, memory_order_relaxed)) {
+        int chunk = atomic_fetch_add_explicit(&batch->nextChunk, 1, memory_order_relaxed);
+        if (chunk >= batch->chunkCount) return;
+        int start = chunk * KERNEL_CHUNK;
+        int end = batch->count - start < KERNEL_CHUNK ? batch->count : start + KERNEL_CHUNK;
+
+        if (batch->reduce) {
+            double accumulator = batch->input[start];
+            for (int i = start + 1; i < end; i++) {
+                if (!callKernel(batch, kernel, accumulator, batch->input[i], &accumulator)) return;
+            }
+            batch->output[chunk] = accumulator;
+        }
+        else {
+            for (int i = start; i < end; i++) {
+                if (!callKernel(batch, kernel, batch->input[i], 0, &batch->output[i])) return;
+            }
+        }
+    }
+}
+
+/**
+ * Runs a task in the running VM and fills in its future, or does its share of a batch.
+*/
+static void runTask(Task* task) {
+    if (task->batch != NULL) {
+        Batch* batch = task->batch;
+        ObjClosure* kernel = loadKernel(batch);
+        if (kernel == NULL) {
+            atomic_store_explicit(&batch->failed, true, memory_order_relaxed);
+        }
+        else {
+            runChunks(batch, kernel);
+            // A runtime error has already emptied the stack.
+            if (vm.stackTop > vm.stack) pop();
+        }
+        atomic_fetch_sub_explicit(&batch->running, 1, memory_order_release);
+        free(task);
+        return;
+    }
+
+    Future* future = task->future;
+    vm.registerEngine = task->registerEngine;
+    runCallImage(&task->call, &future->result);
+    atomic_store_explicit(&future->done, true, memory_order_release);
+
+    freeByteBuffer(&task->call);
+    releaseFuture(future);
+    free(task);
+}
+
+static void* runWorker(void* argument) {
+    currentWorker = (Worker*)argument;
+    randomState = 2654435761u * (uint32_t)(currentWorker->index + 1);
+    initVM();
+
+    int idle = 0;
+    for (;;) {
+        Task* task = findTask();
+        if (task != NULL) {
+            runTask(task);
+            idle = 0;
+        }
+        else if (idle < 64) {
+            idle++;
+            sched_yield();
+        }
+        else {
+            sleepUntilQueued();
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Starts one worker per processor, the first time a task is started. The workers run
+ * until the process exits.
+*/
+static void startWorkers() {
+    long processors = sysconf(_SC_NPROCESSORS_ONLN);
+    workerCount = processors < 1 ? 1 : processors > MAX_WORKERS ? MAX_WORKERS : (int)processors;
+    workers = (Worker*)malloc(sizeof(Worker) * workerCount);
+    if (workers == NULL) exit(1);
+    for (int i = 0; i < workerCount; i++) {
+        initDeque(&workers[i].deque);
+        workers[i].index = i;
+    }
+
+    // Should no worker start, the threads that await their futures run the tasks.
+    for (int i = 0; i < workerCount; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, runWorker, &workers[i]) == 0) pthread_detach(thread);
+    }
+}
+
+/**
+ * async(function, args...) queues a call of function with args and returns a future.
+*/
+Value asyncNative(int argCount, Value* args) {
+    pthread_once(&workersStarted, startWorkers);
+
+    Task* task = (Task*)malloc(sizeof(Task));
+    if (task == NULL) exit(1);
+    initByteBuffer(&task->call);
+    if (!writeCallImage(&task->call, "async", argCount, args)) {
+        freeByteBuffer(&task->call);
+        free(task);
+        return UNDEFINED_VAL;
+    }
+
+    Future* future = (Future*)malloc(sizeof(Future));
+    if (future == NULL) exit(1);
+    atomic_init(&future->done, false);
+    initByteBuffer(&future->result);
+    atomic_init(&future->references, 2);    // The handle and the task
+
+    task->future = future;
+    task->batch = NULL;
+    task->registerEngine = vm.registerEngine;
+    task->next = NULL;
+    ObjFuture* handle = newFuture(future);
+    queueTask(task);
+    return OBJ_VAL(handle);
+}
+
+/**
+ * Runs a task that the current thread found while it waits for a future. The VM of
+ * the thread is in the middle of a call, so the task gets a VM of its own, which is
+ * swapped in for as long as the task runs.
+*/
+static void runTaskAside(Task* task) {
+    VM waiting = vm;
+    initVM();
+    runTask(task);
+    freeVM();
+    vm = waiting;
+}
+
+/**
+ * Runs a queued task while the current thread waits for something, or backs off if
+ * there are none.
+*/
+static void helpOrWait(int* attempts) {
+    Task* task = findTask();
+    if (task != NULL) {
+        runTaskAside(task);
+        *attempts = 0;
+    }
+    else {
+        backoff(attempts);
+    }
+}
+
+/**
+ * await(future) waits for the task of future to finish and returns a copy of its
+ * result. Awaiting a task that failed is an error. A future can be awaited any
+ * number of times.
+*/
+Value awaitNative(int argCount, Value* args) {
+    if (argCount != 1 || !IS_FUTURE(args[0])) {
+        runtimeError("await() takes a future.");
+        return UNDEFINED_VAL;
+    }
+
+    Future* future = AS_FUTURE(args[0]);
+    int attempts = 0;
+    while (!atomic_load_explicit(&future->done, memory_order_acquire)) {
+        helpOrWait(&attempts);
+    }
+    if (future->result.count == 0) {
+        runtimeError("The awaited task failed.");
+        return UNDEFINED_VAL;
+    }
+
+    // Every copy of the result takes over its own references to the channels in it.
+    retainHeapImage(&future->result);
+    Reader reader;
+    initReader(&reader, future->result.bytes, future->result.count);
+    Value value;
+    int count = readHeapImage(&reader, &value, 1, true);
+    freeReader(&reader);
+    if (count != 1) {
+        runtimeError("The result of the task is damaged.");
+        return UNDEFINED_VAL;
+    }
+    return value;
+}
+
+/**
+ * Runs the kernel closure of a parallelMap() or parallelReduce() call over array. It
+ * starts no more tasks than there are threads to run them, the waiting one included.
+ * Returns false if the kernel failed, having reported why.
+*/
+static bool runBatch(Batch* batch, const char* native, Value kernel, ObjArray* array) {
+    int arity = batch->reduce ? 2 : 1;
+    if (!IS_CLOSURE(kernel) || AS_CLOSURE(kernel)->function->arity != arity) {
+        runtimeError("The kernel of %s() must be a function of %d argument%s.", native, arity, arity == 1 ? "" : "s");
+        return false;
+    }
+
+    initByteBuffer(&batch->kernel);
+    if (!writeHeapImage(&batch->kernel, &kernel, 1, IMAGE_USED_GLOBALS, true)) {
+        freeByteBuffer(&batch->kernel);
+        runtimeError("The kernel of %s() can't reach a list, a future or a live local variable.", native);
+        return false;
+    }
+    pthread_once(&workersStarted, startWorkers);
+
+    batch->input = array->numbers;
+    batch->count = array->count;
+    batch->chunkCount = (array->count + KERNEL_CHUNK - 1) / KERNEL_CHUNK;
+    batch->registerEngine = vm.registerEngine;
+    int taskCount = batch->chunkCount < workerCount + 1 ? batch->chunkCount : workerCount + 1;
+    atomic_init(&batch->nextChunk, 0);
+    atomic_init(&batch->running, taskCount);
+    atomic_init(&batch->failed, false);
+    atomic_init(&batch->notNumber, false);
+
+    for (int i = 0; i < taskCount; i++) {
+        Task* task = (Task*)malloc(sizeof(Task));
+        if (task == NULL) exit(1);
+        initByteBuffer(&task->call);
+        task->future = NULL;
+        task->batch = batch;
+        task->registerEngine = batch->registerEngine;
+        task->next = NULL;
+        queueTask(task);
+    }
+
+    int attempts = 0;
+    while (atomic_load_explicit(&batch->running, memory_order_acquire) > 0) {
+        helpOrWait(&attempts);
+    }
+
+    if (atomic_load_explicit(&batch->failed, memory_order_relaxed)) {
+        discardHeapImage(&batch->kernel);
+        freeByteBuffer(&batch->kernel);
+        if (atomic_load_explicit(&batch->notNumber, memory_order_relaxed)) {
+            runtimeError("The kernel of %s() must return a number.", native);
+        }
+        else {
+            runtimeError("The kernel of %s() failed.", native);
+        }
+        return false;
+    }
+    return true;
+}
+
+/**
+ * parallelMap(kernel, array) returns a new array of kernel(x) for every number x in
+ * array. The calls run on the worker pool, each thread with its own copy of kernel and
+ * of the globals it uses, so a kernel should only compute its result from x.
+*/
+Value parallelMapNative(int argCount, Value* args) {
+    if (argCount != 2 || !IS_ARRAY(args[1])) {
+        runtimeError("parallelMap() takes a function and an array.");
+        return UNDEFINED_VAL;
+    }
+
+    ObjArray* array = AS_ARRAY(args[1]);
+    ObjArray* result = newArray(array->count);
+    push(OBJ_VAL(result));
+    Batch batch;
+    batch.reduce = false;
+    batch.output = result->numbers;
+    if (!runBatch(&batch, "parallelMap", args[0], array)) return UNDEFINED_VAL;
+
+    discardHeapImage(&batch.kernel);
+    freeByteBuffer(&batch.kernel);
+    return pop();
+}
+
+/**
+ * parallelReduce(kernel, array, initial) combines initial and the numbers of array
+ * with kernel(accumulator, x), like a loop from left to right would if kernel is
+ * associative. Each chunk of the array is reduced on its own, on the worker pool,
+ * and the calling VM then combines the results of the chunks in order, so the result
+ * is always the same for the same array, even when kernel only is associative up to
+ * rounding.
+*/
+Value parallelReduceNative(int argCount, Value* args) {
+    if (argCount != 3 || !IS_ARRAY(args[1]) || !IS_NUMBER(args[2])) {
+        runtimeError("parallelReduce() takes a function, an array and an initial number.");
+        return UNDEFINED_VAL;
+    }
+
+    ObjArray* array = AS_ARRAY(args[1]);
+    int chunkCount = (array->count + KERNEL_CHUNK - 1) / KERNEL_CHUNK;
+    double* partials = (double*)malloc(sizeof(double) * (chunkCount > 0 ? chunkCount : 1));
+    if (partials == NULL) exit(1);
+    Batch batch;
+    batch.reduce = true;
+    batch.output = partials;
+    if (!runBatch(&batch, "parallelReduce", args[0], array)) {
+        free(partials);
+        return UNDEFINED_VAL;
+    }
+
+    discardHeapImage(&batch.kernel);
+    freeByteBuffer(&batch.kernel);
+
+    // The chunks are combined right here, by the kernel that was passed in. A nested
+    // run may move the stack, so nothing is read through args from here on.
+    ObjClosure* kernel = AS_CLOSURE(args[0]);
+    double result = AS_NUMBER(args[2]);
+    bool combined = true;
+    for (int i = 0; i < chunkCount && combined; i++) {
+        combined = callKernel(&batch, kernel, result, partials[i], &result);
+    }
+    free(partials);
+    if (!combined) {
+        // A kernel that failed has already reported the error.
+        if (atomic_load_explicit(&batch.notNumber, memory_order_relaxed)) {
+            runtimeError("The kernel of parallelReduce() must return a number.");
+        }
+        return UNDEFINED_VAL;
+    }
+    return NUMBER_VAL(result);
+}
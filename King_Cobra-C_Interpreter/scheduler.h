@@ -0,0 +1,36 @@
+#ifndef kc_scheduler_h
+#define kc_scheduler_h
+
+#include "object.h"
+
+/**
+ * Tasks. async(function, args...) queues a call of function on a fixed pool of worker
+ * threads and returns a future; await(future) waits for the call to finish and returns
+ * a copy of its result, or fails if the call did. Every worker owns a VM and a heap that
+ * it keeps from task to task, so tasks never share a collector, and the call travels
+ * to the worker as a heap image just like the call of a spawned isolate.
+ * A worker queues the tasks it starts on a deque of its own and takes the newest one
+ * back first; a worker that runs out of tasks steals the oldest ones of the others.
+ * A thread that awaits a future runs queued tasks meanwhile, so tasks may start and
+ * await tasks of their own without tying up the pool.
+*/
+
+/**
+ * A future is freed with its last reference: its ObjFuture handles and the task that
+ * fills it in count as one each.
+*/
+void releaseFuture(Future* future);
+
+Value asyncNative(int argCount, Value* args);
+Value awaitNative(int argCount, Value* args);
+
+/**
+ * Kernels. parallelMap(kernel, array) and parallelReduce(kernel, array, initial) run a
+ * function of numbers over a numeric array (array.h) on the worker pool, a chunk of
+ * the array at a time. Which chunks there are only depends on the array's length, so
+ * the result does not depend on how many threads there are.
+*/
+Value parallelMapNative(int argCount, Value* args);
+Value parallelReduceNative(int argCount, Value* args);
+
+#endif
@@ -0,0 +1,793 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "bytecode.h"
+#include "isolate.h"
+#include "memory.h"
+#include "regcompiler.h"
+#include "snapshot.h"
+#include "vm.h"
+
+/**
+ * Layout of a heap image, in the 32-bit words of bytecode files (see bytecode.c):
+ *
+ *   channels:  channel count, then the address of each channel (in-process images only)
+ *   names:     the global slot names, or none if the image holds no code
+ *   objects:   object count, then the type and the allocation data of each object
+ *   links:     the references of each object, in the same order
+ *   globals:   binding count, then a name and a value for each global that is kept
+ *   values:    value count, then the values the image was written for
+ *
+ * A snapshot file is a header (magic, SNAPSHOT_VERSION, BYTECODE_VERSION) followed by
+ * an image of all the globals. Objects refer to each other by index. They are sorted so that everything an object
+ * needs to be allocated (the function of a closure, the class of an instance) comes
+ * before it, and every other reference is only filled in once all of them exist.
+ * Shapes are left out: restoring the fields of an instance in slot order walks the
+ * same transitions again. Natives are saved as the name of the global holding them.
+*/
+#define SNAPSHOT_MAGIC 0x0053434b  // "KCS\0" when written little-endian
+
+typedef enum {
+    VALUE_NULL,
+    VALUE_FALSE,
+    VALUE_TRUE,
+    VALUE_NUMBER,
+    VALUE_OBJECT
+} ValueTag;
+
+/**
+ * The objects that a snapshot holds, collected by walking the heap from the globals.
+ * The table maps each object to its index and is open addressed on the object's address.
+*/
+typedef struct {
+    Obj** objects;
+    int count;
+    int capacity;
+    Obj** keys;
+    int* indices;
+    int tableCapacity;
+    bool* boundGlobals;     // The global slots whose bindings go into the image
+    bool usedGlobalsOnly;   // Whether globals are added as the code reaching them is found
+    bool inProcess;
+    int functionCount;
+    int channelCount;
+    bool failed;
+} Graph;
+
+// Objects restored so far, by index. Everything in it is a root until the restore is done.
+static THREAD_LOCAL ValueArray restoring;
+
+// The channel addresses of the image being read, and how many of them have handles yet.
+static THREAD_LOCAL const uint8_t* channelAddresses;
+static THREAD_LOCAL int channelCount;
+static THREAD_LOCAL int channelsAdopted;
+
+void markSnapshotRoots() {
+    for (int i = 0; i < restoring.count; i++) {
+        markValue(restoring.values[i]);
+    }
+}
+
+static int findKey(Obj** keys, int capacity, Obj* object) {
+    uint32_t index = (uint32_t)(((uintptr_t)object >> 3) * 2654435761u) & (capacity - 1);
+    while (keys[index] != NULL && keys[index] != object) {
+        index = (index + 1) & (capacity - 1);
+    }
+    return (int)index;
+}
+
+/**
+ * Returns the index of object in the graph, or -1 if it is not part of it.
+*/
+static int objectIndex(Graph* graph, Obj* object) {
+    if (graph->tableCapacity == 0) return -1;
+    int key = findKey(graph->keys, graph->tableCapacity, object);
+    return graph->keys[key] == NULL ? -1 : graph->indices[key];
+}
+
+static void setObjectIndex(Graph* graph, Obj* object, int index) {
+    if ((graph->count + 1) * 4 > graph->tableCapacity * 3) {
+        int oldCapacity = graph->tableCapacity;
+        Obj** oldKeys = graph->keys;
+        int* oldIndices = graph->indices;
+
+        graph->tableCapacity = GROW_CAPACITY(oldCapacity);
+        graph->keys = ALLOCATE(Obj*, graph->tableCapacity);
+        graph->indices = ALLOCATE(int, graph->tableCapacity);
+        for (int i = 0; i < graph->tableCapacity; i++) {
+            graph->keys[i] = NULL;
+        }
+        for (int i = 0; i < oldCapacity; i++) {
+            if (oldKeys[i] == NULL) continue;
+            int key = findKey(graph->keys, graph->tableCapacity, oldKeys[i]);
+            graph->keys[key] = oldKeys[i];
+            graph->indices[key] = oldIndices[i];
+        }
+
+        FREE_ARRAY(Obj*, oldKeys, oldCapacity);
+        FREE_ARRAY(int, oldIndices, oldCapacity);
+    }
+
+    int key = findKey(graph->keys, graph->tableCapacity, object);
+    graph->keys[key] = object;
+    graph->indices[key] = index;
+}
+
+static void addObject(Graph* graph, Obj* object) {
+    if (object == NULL || objectIndex(graph, object) != -1) return;
+    if (object->type == OBJ_SHAPE || object->type == OBJ_LIST || object->type == OBJ_FUTURE ||
+        (object->type == OBJ_CHANNEL && !graph->inProcess)) {
+        graph->failed = true;
+        return;
+    }
+    if (object->type == OBJ_FUNCTION) graph->functionCount++;
+    if (object->type == OBJ_CHANNEL) graph->channelCount++;
+
+    if (graph->capacity < graph->count + 1) {
+        int oldCapacity = graph->capacity;
+        graph->capacity = GROW_CAPACITY(oldCapacity);
+        graph->objects = GROW_ARRAY(Obj*, graph->objects, oldCapacity, graph->capacity);
+    }
+    setObjectIndex(graph, object, graph->count);
+    graph->objects[graph->count++] = object;
+}
+
+static void addValue(Graph* graph, Value value) {
+    if (IS_OBJ(value)) addObject(graph, AS_OBJ(value));
+}
+
+/**
+ * Adds the global in slot, its name and its value, unless it is already in the graph or unset.
+*/
+static void addGlobal(Graph* graph, int slot) {
+    if (graph->boundGlobals[slot] || IS_UNDEFINED(vm.globalValues.values[slot])) return;
+    graph->boundGlobals[slot] = true;
+    addObject(graph, (Obj*)GLOBAL_NAME(slot));
+    addValue(graph, vm.globalValues.values[slot]);
+}
+
+/**
+ * Adds the globals that the code of function reads or assigns.
+*/
+static void addUsedGlobals(Graph* graph, ObjFunction* function) {
+    Chunk* chunk = &function->chunk;
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+        uint32_t instruction = genericInstruction(chunk->code[offset]);
+        if (INSTR_OP(instruction) == OP_GET_GLOBAL || INSTR_OP(instruction) == OP_SET_GLOBAL) {
+            addGlobal(graph, INSTR_ARG(instruction));
+        }
+    }
+}
+
+/**
+ * Returns the name of the global that holds native, the only way to find it again in another process.
+*/
+static ObjString* nativeName(Obj* native) {
+    for (int i = 0; i < vm.globalValues.count; i++) {
+        Value value = vm.globalValues.values[i];
+        if (IS_OBJ(value) && AS_OBJ(value) == native) return GLOBAL_NAME(i);
+    }
+    return NULL;
+}
+
+/**
+ * Adds everything that object refers to, which is what blackenObject() in memory.c marks.
+*/
+static void addReferences(Graph* graph, Obj* object) {
+    switch (object->type) {
+        case OBJ_NATIVE: {
+            ObjString* name = nativeName(object);
+            if (name == NULL) graph->failed = true;
+            addObject(graph, (Obj*)name);
+            break;
+        }
+        case OBJ_FUNCTION: {
+            ObjFunction* function = (ObjFunction*)object;
+            addObject(graph, (Obj*)function->name);
+            for (int i = 0; i < function->chunk.constants.count; i++) {
+                addValue(graph, function->chunk.constants.values[i]);
+            }
+            if (graph->usedGlobalsOnly) addUsedGlobals(graph, function);
+            break;
+        }
+        case OBJ_UPVALUE: {
+            ObjUpvalue* upvalue = (ObjUpvalue*)object;
+            // An open upvalue points into the stack, which a snapshot does not keep.
+            if (upvalue->location != &upvalue->closed) graph->failed = true;
+            addValue(graph, upvalue->closed);
+            break;
+        }
+        case OBJ_CLASS: {
+            ObjClass* Class = (ObjClass*)object;
+            addObject(graph, (Obj*)Class->name);
+            for (int i = 0; i < Class->methodCount; i++) {
+                if (Class->methods[i] == NULL) continue;
+                addValue(graph, vm.selectorNames.values[i]);
+                addObject(graph, (Obj*)Class->methods[i]);
+            }
+            break;
+        }
+        case OBJ_CLOSURE: {
+            ObjClosure* closure = (ObjClosure*)object;
+            addObject(graph, (Obj*)closure->function);
+            for (int i = 0; i < closure->upvalueCount; i++) {
+                addObject(graph, (Obj*)closure->upvalues[i]);
+            }
+            break;
+        }
+        case OBJ_INSTANCE: {
+            ObjInstance* instance = (ObjInstance*)object;
+            addObject(graph, (Obj*)instance->Class);
+            for (int i = 0; i < instance->shape->fieldCount; i++) {
+                addObject(graph, (Obj*)instance->shape->names[i]);
+                addValue(graph, *instanceField(instance, i));
+            }
+            break;
+        }
+        case OBJ_BOUND_METHOD: {
+            ObjBoundMethod* bound = (ObjBoundMethod*)object;
+            addValue(graph, bound->receiver);
+            addObject(graph, (Obj*)bound->method);
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+/**
+ * The order in which the objects are allocated when the snapshot is restored.
+*/
+static int allocationRank(ObjType type) {
+    switch (type) {
+        case OBJ_STRING:        return 0;
+        case OBJ_ARRAY:         return 0;
+        case OBJ_CHANNEL:       return 1;
+        case OBJ_NATIVE:        return 2;   // After the name of its global
+        case OBJ_FUNCTION:      return 3;
+        case OBJ_UPVALUE:       return 4;
+        case OBJ_CLASS:         return 5;   // After its name
+        case OBJ_CLOSURE:       return 6;   // After its function
+        case OBJ_INSTANCE:      return 7;   // After its class
+        case OBJ_BOUND_METHOD:  return 8;   // After its method
+        default:                return 9;
+    }
+}
+
+/**
+ * Collects every object that values and the kept globals reach, in allocation order,
+ * and indexes them.
+*/
+static void buildGraph(Graph* graph, Value* values, int valueCount, ImageGlobals globals) {
+    graph->objects = NULL;
+    graph->count = 0;
+    graph->capacity = 0;
+    graph->keys = NULL;
+    graph->indices = NULL;
+    graph->tableCapacity = 0;
+    graph->boundGlobals = ALLOCATE(bool, vm.globalValues.count);
+    graph->usedGlobalsOnly = globals == IMAGE_USED_GLOBALS;
+    graph->functionCount = 0;
+    graph->channelCount = 0;
+    graph->failed = false;
+
+    for (int i = 0; i < vm.globalValues.count; i++) {
+        graph->boundGlobals[i] = false;
+    }
+    for (int i = 0; i < valueCount; i++) {
+        addValue(graph, values[i]);
+    }
+    if (globals == IMAGE_ALL_GLOBALS) {
+        for (int i = 0; i < vm.globalValues.count; i++) {
+            addGlobal(graph, i);
+        }
+    }
+    // The objects array doubles as the worklist.
+    for (int i = 0; i < graph->count && !graph->failed; i++) {
+        addReferences(graph, graph->objects[i]);
+    }
+    if (graph->failed) return;
+
+    Obj** sorted = ALLOCATE(Obj*, graph->capacity);
+    int count = 0;
+    for (int rank = 0; rank < 9; rank++) {
+        for (int i = 0; i < graph->count; i++) {
+            if (allocationRank(graph->objects[i]->type) == rank) sorted[count++] = graph->objects[i];
+        }
+    }
+    FREE_ARRAY(Obj*, graph->objects, graph->capacity);
+    graph->objects = sorted;
+    for (int i = 0; i < count; i++) {
+        setObjectIndex(graph, sorted[i], i);
+    }
+}
+
+static void writeObject(ByteBuffer* buffer, Graph* graph, Obj* object) {
+    writeWord(buffer, (uint32_t)objectIndex(graph, object));
+}
+
+static void writeValue(ByteBuffer* buffer, Graph* graph, Value value) {
+    if (IS_NUMBER(value)) {
+        double number = AS_NUMBER(value);
+        writeWord(buffer, VALUE_NUMBER);
+        writeNumber(buffer, number);
+    }
+    else if (IS_BOOL(value)) {
+        writeWord(buffer, AS_BOOL(value) ? VALUE_TRUE : VALUE_FALSE);
+    }
+    else if (IS_OBJ(value)) {
+        writeWord(buffer, VALUE_OBJECT);
+        writeObject(buffer, graph, AS_OBJ(value));
+    }
+    else {
+        writeWord(buffer, VALUE_NULL);
+    }
+}
+
+/**
+ * Writes what it takes to allocate object, with nothing that refers to a later object.
+*/
+static void writeAllocation(ByteBuffer* buffer, Graph* graph, Obj* object) {
+    writeWord(buffer, object->type);
+    switch (object->type) {
+        case OBJ_STRING: {
+            ObjString* string = (ObjString*)object;
+            writeString(buffer, string->chars, string->length);
+            break;
+        }
+        case OBJ_ARRAY: {
+            ObjArray* array = (ObjArray*)object;
+            writeWord(buffer, (uint32_t)array->count);
+            writeBytes(buffer, array->numbers, sizeof(double) * array->count);
+            break;
+        }
+        case OBJ_NATIVE:
+            writeObject(buffer, graph, (Obj*)nativeName(object));
+            break;
+        case OBJ_FUNCTION: {
+            ObjFunction* function = (ObjFunction*)object;
+            writeWord(buffer, (uint32_t)function->arity);
+            writeWord(buffer, (uint32_t)function->upvalueCount);
+            writeWord(buffer, (uint32_t)function->maxStack);
+            break;
+        }
+        case OBJ_CLASS:
+            writeObject(buffer, graph, (Obj*)((ObjClass*)object)->name);
+            break;
+        case OBJ_CLOSURE:
+            writeObject(buffer, graph, (Obj*)((ObjClosure*)object)->function);
+            break;
+        case OBJ_INSTANCE:
+            writeObject(buffer, graph, (Obj*)((ObjInstance*)object)->Class);
+            break;
+        case OBJ_BOUND_METHOD:
+            writeObject(buffer, graph, (Obj*)((ObjBoundMethod*)object)->method);
+            break;
+        default:
+            break;
+    }
+}
+
+/**
+ * Writes the rest of the references of object, once every object has an index.
+*/
+static void writeLinks(ByteBuffer* buffer, Graph* graph, Obj* object) {
+    switch (object->type) {
+        case OBJ_FUNCTION: {
+            ObjFunction* function = (ObjFunction*)object;
+            writeWord(buffer, function->name == NULL ? (uint32_t)-1 : (uint32_t)objectIndex(graph, (Obj*)function->name));
+            writeCode(buffer, &function->chunk);
+            writeWord(buffer, (uint32_t)function->chunk.constants.count);
+            for (int i = 0; i < function->chunk.constants.count; i++) {
+                writeValue(buffer, graph, function->chunk.constants.values[i]);
+            }
+            break;
+        }
+        case OBJ_UPVALUE:
+            writeValue(buffer, graph, ((ObjUpvalue*)object)->closed);
+            break;
+        case OBJ_CLASS: {
+            ObjClass* Class = (ObjClass*)object;
+            int count = 0;
+            for (int i = 0; i < Class->methodCount; i++) {
+                if (Class->methods[i] != NULL) count++;
+            }
+            writeWord(buffer, (uint32_t)count);
+            for (int i = 0; i < Class->methodCount; i++) {
+                if (Class->methods[i] == NULL) continue;
+                writeObject(buffer, graph, AS_OBJ(vm.selectorNames.values[i]));
+                writeObject(buffer, graph, (Obj*)Class->methods[i]);
+            }
+            break;
+        }
+        case OBJ_CLOSURE: {
+            ObjClosure* closure = (ObjClosure*)object;
+            for (int i = 0; i < closure->upvalueCount; i++) {
+                writeObject(buffer, graph, (Obj*)closure->upvalues[i]);
+            }
+            break;
+        }
+        case OBJ_INSTANCE: {
+            ObjInstance* instance = (ObjInstance*)object;
+            writeWord(buffer, (uint32_t)instance->shape->fieldCount);
+            for (int i = 0; i < instance->shape->fieldCount; i++) {
+                writeObject(buffer, graph, (Obj*)instance->shape->names[i]);
+                writeValue(buffer, graph, *instanceField(instance, i));
+            }
+            break;
+        }
+        case OBJ_BOUND_METHOD:
+            writeValue(buffer, graph, ((ObjBoundMethod*)object)->receiver);
+            break;
+        default:
+            break;
+    }
+}
+
+static void freeGraph(Graph* graph) {
+    FREE_ARRAY(Obj*, graph->objects, graph->capacity);
+    FREE_ARRAY(Obj*, graph->keys, graph->tableCapacity);
+    FREE_ARRAY(int, graph->indices, graph->tableCapacity);
+    FREE_ARRAY(bool, graph->boundGlobals, vm.globalValues.count);
+}
+
+/**
+ * Appends an image of values and the globals that are kept to buffer. Returns false,
+ * leaving the buffer as it was, if the heap holds something that images cannot keep:
+ * a list, a future, an upvalue that is still open because a function that captured it
+ * is running, or a channel when the image is not read back by this process.
+*/
+bool writeHeapImage(ByteBuffer* buffer, Value* values, int valueCount, ImageGlobals globals, bool inProcess) {
+    Graph graph;
+    graph.inProcess = inProcess;
+    buildGraph(&graph, values, valueCount, globals);
+    if (graph.failed) {
+        freeGraph(&graph);
+        return false;
+    }
+
+    // Every channel in the image holds a reference, which the reader's handle takes over.
+    writeWord(buffer, (uint32_t)graph.channelCount);
+    for (int i = 0; i < graph.count; i++) {
+        if (graph.objects[i]->type != OBJ_CHANNEL) continue;
+        Channel* channel = ((ObjChannel*)graph.objects[i])->channel;
+        uint64_t address = (uint64_t)(uintptr_t)channel;
+        retainChannel(channel);
+        writeBytes(buffer, &address, sizeof(uint64_t));
+    }
+
+    if (graph.functionCount > 0) {
+        writeGlobalNames(buffer);
+    }
+    else {
+        writeWord(buffer, 0);
+    }
+
+    writeWord(buffer, (uint32_t)graph.count);
+    for (int i = 0; i < graph.count; i++) {
+        writeAllocation(buffer, &graph, graph.objects[i]);
+    }
+    for (int i = 0; i < graph.count; i++) {
+        writeLinks(buffer, &graph, graph.objects[i]);
+    }
+
+    int bindingCount = 0;
+    for (int i = 0; i < vm.globalValues.count; i++) {
+        if (graph.boundGlobals[i]) bindingCount++;
+    }
+    writeWord(buffer, (uint32_t)bindingCount);
+    for (int i = 0; i < vm.globalValues.count; i++) {
+        if (!graph.boundGlobals[i]) continue;
+        writeObject(buffer, &graph, (Obj*)GLOBAL_NAME(i));
+        writeValue(buffer, &graph, vm.globalValues.values[i]);
+    }
+
+    writeWord(buffer, (uint32_t)valueCount);
+    for (int i = 0; i < valueCount; i++) {
+        writeValue(buffer, &graph, values[i]);
+    }
+
+    freeGraph(&graph);
+    return true;
+}
+
+/**
+ * Saves the globals of the VM and everything they reach to path, which is written under
+ * a temporary name first like a bytecode file. Returns false if the file could not be
+ * written or the heap holds something that snapshots cannot keep.
+*/
+bool writeSnapshot(const char* path) {
+    ByteBuffer buffer;
+    initByteBuffer(&buffer);
+    writeWord(&buffer, SNAPSHOT_MAGIC);
+    writeWord(&buffer, SNAPSHOT_VERSION);
+    writeWord(&buffer, BYTECODE_VERSION);
+
+    bool written = writeHeapImage(&buffer, NULL, 0, IMAGE_ALL_GLOBALS, false) &&
+        writeByteBufferFile(&buffer, path);
+    freeByteBuffer(&buffer);
+    return written;
+}
+
+static void visitChannels(ByteBuffer* buffer, void (*visit)(Channel* channel)) {
+    Reader reader;
+    initReader(&reader, buffer->bytes, buffer->count);
+    int count = readCount(&reader, 2);
+    for (int i = 0; i < count; i++) {
+        uint64_t address;
+        memcpy(&address, reader.current, sizeof(uint64_t));
+        reader.current += sizeof(uint64_t);
+        visit((Channel*)(uintptr_t)address);
+    }
+    freeReader(&reader);
+}
+
+/**
+ * Takes another reference to every channel in an image, so that it can be read once more.
+*/
+void retainHeapImage(ByteBuffer* buffer) {
+    visitChannels(buffer, retainChannel);
+}
+
+/**
+ * Drops the channel references held by an image that will never be read.
+*/
+void discardHeapImage(ByteBuffer* buffer) {
+    visitChannels(buffer, releaseChannel);
+}
+
+/**
+ * Returns the restored object at index, which must be of the given type.
+*/
+static Obj* objectAt(Reader* reader, uint32_t index, ObjType type) {
+    if (reader->failed || index >= (uint32_t)restoring.count ||
+        AS_OBJ(restoring.values[index])->type != type) {
+        reader->failed = true;
+        return NULL;
+    }
+    return AS_OBJ(restoring.values[index]);
+}
+
+static Obj* readObject(Reader* reader, ObjType type) {
+    return objectAt(reader, readWord(reader), type);
+}
+
+static Value readValue(Reader* reader) {
+    switch (readWord(reader)) {
+        case VALUE_NULL:
+            return NULL_VAL;
+        case VALUE_FALSE:
+            return BOOL_VAL(false);
+        case VALUE_TRUE:
+            return BOOL_VAL(true);
+        case VALUE_NUMBER: {
+            double number = 0;
+            if (canRead(reader, sizeof(double))) {
+                memcpy(&number, reader->current, sizeof(double));
+                reader->current += sizeof(double);
+            }
+            return NUMBER_VAL(number);
+        }
+        case VALUE_OBJECT: {
+            uint32_t index = readWord(reader);
+            if (index < (uint32_t)restoring.count) return restoring.values[index];
+            break;
+        }
+    }
+    reader->failed = true;
+    return NULL_VAL;
+}
+
+/**
+ * Allocates the next object from what writeAllocation() wrote.
+*/
+static Obj* allocateRestored(Reader* reader) {
+    switch (readWord(reader)) {
+        case OBJ_STRING:
+            return (Obj*)readString(reader);
+        case OBJ_ARRAY: {
+            int count = readCount(reader, 2);
+            if (reader->failed) return NULL;
+            ObjArray* array = newArray(count);
+            memcpy(array->numbers, reader->current, sizeof(double) * count);
+            reader->current += sizeof(double) * count;
+            return (Obj*)array;
+        }
+        case OBJ_CHANNEL: {
+            if (channelsAdopted == channelCount) return NULL;
+            uint64_t address;
+            memcpy(&address, channelAddresses + sizeof(uint64_t) * channelsAdopted++, sizeof(uint64_t));
+            return (Obj*)newChannel((Channel*)(uintptr_t)address);
+        }
+        case OBJ_NATIVE: {
+            // The natives are defined when the VM starts, the file only names the global.
+            ObjString* name = (ObjString*)readObject(reader, OBJ_STRING);
+            if (name == NULL) return NULL;
+            Value native = vm.globalValues.values[globalSlot(name)];
+            return IS_NATIVE(native) ? AS_OBJ(native) : NULL;
+        }
+        case OBJ_FUNCTION: {
+            ObjFunction* function = newFunction();
+            function->arity = (int)readWord(reader);
+            function->upvalueCount = (int)readWord(reader);
+            function->maxStack = (int)readWord(reader);
+            return (Obj*)function;
+        }
+        case OBJ_UPVALUE: {
+            ObjUpvalue* upvalue = newUpvalue(NULL);
+            upvalue->location = &upvalue->closed;
+            return (Obj*)upvalue;
+        }
+        case OBJ_CLASS: {
+            ObjString* name = (ObjString*)readObject(reader, OBJ_STRING);
+            return name == NULL ? NULL : (Obj*)newClass(name);
+        }
+        case OBJ_CLOSURE: {
+            ObjFunction* function = (ObjFunction*)readObject(reader, OBJ_FUNCTION);
+            return function == NULL ? NULL : (Obj*)newClosure(function);
+        }
+        case OBJ_INSTANCE: {
+            ObjClass* Class = (ObjClass*)readObject(reader, OBJ_CLASS);
+            return Class == NULL ? NULL : (Obj*)newInstance(Class);
+        }
+        case OBJ_BOUND_METHOD: {
+            ObjClosure* method = (ObjClosure*)readObject(reader, OBJ_CLOSURE);
+            return method == NULL ? NULL : (Obj*)newBoundMethod(NULL_VAL, method);
+        }
+        default:
+            return NULL;
+    }
+}
+
+/**
+ * Fills in the references of a restored object from what writeLinks() wrote.
+*/
+static void linkObject(Reader* reader, Obj* object) {
+    switch (object->type) {
+        case OBJ_FUNCTION: {
+            ObjFunction* function = (ObjFunction*)object;
+            uint32_t name = readWord(reader);
+            if (name != (uint32_t)-1) function->name = (ObjString*)objectAt(reader, name, OBJ_STRING);
+            readCode(reader, &function->chunk);
+            int constantCount = readCount(reader, 1);
+            for (int i = 0; i < constantCount && !reader->failed; i++) {
+                appendConstant(&function->chunk, readValue(reader));
+            }
+            if (!reader->failed) relocateCode(reader, function);
+            break;
+        }
+        case OBJ_UPVALUE:
+            ((ObjUpvalue*)object)->closed = readValue(reader);
+            break;
+        case OBJ_CLASS: {
+            ObjClass* Class = (ObjClass*)object;
+            int count = readCount(reader, 2);
+            for (int i = 0; i < count && !reader->failed; i++) {
+                ObjString* name = (ObjString*)readObject(reader, OBJ_STRING);
+                ObjClosure* method = (ObjClosure*)readObject(reader, OBJ_CLOSURE);
+                if (method != NULL) setMethod(Class, methodSelector(name), method);
+            }
+            break;
+        }
+        case OBJ_CLOSURE: {
+            ObjClosure* closure = (ObjClosure*)object;
+            for (int i = 0; i < closure->upvalueCount; i++) {
+                closure->upvalues[i] = (ObjUpvalue*)readObject(reader, OBJ_UPVALUE);
+            }
+            break;
+        }
+        case OBJ_INSTANCE: {
+            ObjInstance* instance = (ObjInstance*)object;
+            int count = readCount(reader, 2);
+            for (int i = 0; i < count && !reader->failed; i++) {
+                ObjString* name = (ObjString*)readObject(reader, OBJ_STRING);
+                Value value = readValue(reader);
+                if (!reader->failed) setField(instance, name, value);
+            }
+            break;
+        }
+        case OBJ_BOUND_METHOD:
+            ((ObjBoundMethod*)object)->receiver = readValue(reader);
+            break;
+        default:
+            break;
+    }
+
+    // The register code is built from the stack code, just like after compiling.
+    if (object->type == OBJ_FUNCTION && !reader->failed && vm.registerEngine) {
+        compileRegisterCode((ObjFunction*)object);
+    }
+}
+
+/**
+ * Reads an image that writeHeapImage() wrote. The objects are allocated like any others
+ * and linked into vm.objects as they are made, then their references are relocated from
+ * image indices to the new addresses. The globals that the image keeps are only defined
+ * once all of it has been read. Stores up to valueCapacity of the values it was written
+ * for in values, which the caller must root before it allocates anything, and returns
+ * how many there were, or -1 if the image is damaged.
+*/
+int readHeapImage(Reader* reader, Value* values, int valueCapacity, bool inProcess) {
+    initValueArray(&restoring);
+
+    // A channel address only means something in the process that wrote it.
+    channelCount = readCount(reader, 2);
+    channelsAdopted = 0;
+    channelAddresses = reader->current;
+    if (channelCount > 0 && !inProcess) reader->failed = true;
+    if (!reader->failed) reader->current += sizeof(uint64_t) * channelCount;
+
+    readGlobalNames(reader);
+
+    int count = readCount(reader, 1);
+    for (int i = 0; i < count && !reader->failed; i++) {
+        Obj* object = allocateRestored(reader);
+        if (object == NULL) {
+            reader->failed = true;
+            break;
+        }
+        push(OBJ_VAL(object));
+        writeValueArray(&restoring, OBJ_VAL(object));
+        pop();
+    }
+
+    for (int i = 0; i < restoring.count && !reader->failed; i++) {
+        linkObject(reader, AS_OBJ(restoring.values[i]));
+    }
+
+    int bindingCount = readCount(reader, 2);
+    int* slots = bindingCount > 0 ? ALLOCATE(int, bindingCount) : NULL;
+    Value* bindings = bindingCount > 0 ? ALLOCATE(Value, bindingCount) : NULL;
+    for (int i = 0; i < bindingCount && !reader->failed; i++) {
+        ObjString* name = (ObjString*)readObject(reader, OBJ_STRING);
+        bindings[i] = readValue(reader);
+        if (name != NULL) slots[i] = globalSlot(name);
+    }
+
+    int valueCount = readCount(reader, 1);
+    if (valueCount > valueCapacity) reader->failed = true;
+    for (int i = 0; i < valueCount && !reader->failed; i++) {
+        values[i] = readValue(reader);
+    }
+
+    bool valid = !reader->failed && reader->current == reader->end;
+    if (valid) {
+        for (int i = 0; i < bindingCount; i++) {
+            vm.globalValues.values[slots[i]] = bindings[i];
+        }
+    }
+    // The channels that never got a handle would otherwise keep their references.
+    for (int i = channelsAdopted; i < channelCount && inProcess; i++) {
+        uint64_t address;
+        memcpy(&address, channelAddresses + sizeof(uint64_t) * i, sizeof(uint64_t));
+        releaseChannel((Channel*)(uintptr_t)address);
+    }
+
+    FREE_ARRAY(int, slots, bindingCount);
+    FREE_ARRAY(Value, bindings, bindingCount);
+    freeValueArray(&restoring);
+    return valid ? valueCount : -1;
+}
+
+/**
+ * Defines the globals saved in the snapshot file at path, with every object they reach.
+ * Returns false, leaving the globals as they were, if the file cannot be read, was
+ * written by another version of the interpreter or is damaged.
+*/
+bool restoreSnapshot(const char* path) {
+    size_t size;
+    const uint8_t* data = mapFile(path, &size);
+    if (data == NULL) return false;
+
+    Reader reader;
+    initReader(&reader, data, size);
+    bool valid = readWord(&reader) == SNAPSHOT_MAGIC &&
+        readWord(&reader) == SNAPSHOT_VERSION &&
+        readWord(&reader) == BYTECODE_VERSION &&
+        readHeapImage(&reader, NULL, 0, false) == 0;
+
+    freeReader(&reader);
+    unmapFile(data, size);
+    return valid;
+}
@@ -0,0 +1,47 @@
+#ifndef kc_snapshot_h
+#define kc_snapshot_h
+
+#include "bytecode.h"
+
+/**
+ * Heap snapshots (.kcs). After an initialization script has run, writeSnapshot() saves
+ * every object that the globals can reach, together with the globals themselves.
+ * restoreSnapshot() rebuilds that heap in a fresh VM without compiling or running
+ * anything, so a script can start out with a large prelude already defined.
+ * Bump SNAPSHOT_VERSION whenever the layout of a snapshot file changes.
+*/
+#define SNAPSHOT_VERSION 2
+
+/**
+ * Saves the globals of the VM and everything they reach to path. Returns false if the
+ * file could not be written or the heap holds something that snapshots cannot keep.
+*/
+bool writeSnapshot(const char* path);
+
+/**
+ * Defines the globals saved in the snapshot file at path, with every object they reach.
+ * Returns false, leaving the globals as they were, if the file cannot be read, was
+ * written by another version of the interpreter or is damaged.
+*/
+bool restoreSnapshot(const char* path);
+
+/**
+ * Heap images, which snapshots and the messages between isolates (isolate.c) are made of.
+ * An image is a copy of some values and of every object they reach, which another VM
+ * can read back into its own heap. Which globals it also keeps is up to the writer:
+ * none, the ones that the code in the image uses, or all of them.
+*/
+typedef enum {
+    IMAGE_VALUES_ONLY,
+    IMAGE_USED_GLOBALS,
+    IMAGE_ALL_GLOBALS
+} ImageGlobals;
+
+bool writeHeapImage(ByteBuffer* buffer, Value* values, int valueCount, ImageGlobals globals, bool inProcess);
+int readHeapImage(Reader* reader, Value* values, int valueCapacity, bool inProcess);
+void retainHeapImage(ByteBuffer* buffer);
+void discardHeapImage(ByteBuffer* buffer);
+
+void markSnapshotRoots();
+
+#endif
@@ -64,6 +64,7 @@ void printValue(Value value) {
         case VAL_NULL: printf("null"); break;
         case VAL_NUMBER: printf("%g", AS_NUMBER(value)); break;
         case VAL_OBJ: printObject(value); break;
+        case VAL_UNDEFINED: break;
     }
     #endif
     //printf("%g ", AS_NUMBER(value)); // This was the original line that caused duplicate prints
@@ -19,6 +19,7 @@ typedef struct ObjList ObjList;
 #define TAG_NULL    1
 #define TAG_FALSE   2
 #define TAG_TRUE    3
+#define TAG_UNDEFINED 4
 
 typedef uint64_t Value;
 
@@ -26,6 +27,7 @@ typedef uint64_t Value;
 #define IS_NULL(value)      ((value) == NULL_VAL)
 #define IS_NUMBER(value)    (((value) & QNAN) != QNAN)
 #define IS_OBJ(value)       (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
 
 #define AS_BOOL(value)      ((value) == TRUE_VAL)
 #define AS_NUMBER(value)    valueToNum(value)
@@ -35,6 +37,7 @@ typedef uint64_t Value;
 #define FALSE_VAL           ((Value)(uint64_t)(QNAN | TAG_FALSE))
 #define TRUE_VAL            ((Value)(uint64_t)(QNAN | TAG_TRUE))
 #define NULL_VAL            ((Value)(uint64_t)(QNAN | TAG_NULL))
+#define UNDEFINED_VAL       ((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
 #define NUMBER_VAL(num)     numToValue(num)
 #define OBJ_VAL(obj)        (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj))
 
@@ -59,7 +62,8 @@ typedef enum {
     VAL_BOOL,
     VAL_NULL,
     VAL_NUMBER,
-    VAL_OBJ
+    VAL_OBJ,
+    VAL_UNDEFINED   // Only marks global slots that are not defined yet, never a language value
 }   ValueType;
 
 /**
@@ -82,6 +86,7 @@ typedef struct {
 #define IS_NULL(value)      ((value).type == VAL_NULL)
 #define IS_NUMBER(value)    ((value).type == VAL_NUMBER)
 #define IS_OBJ(value)       ((value).type == VAL_OBJ)
+#define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
 
 /**
  * AS_ macros extract the value from the value field of the instruction based upon the value's
@@ -109,6 +114,7 @@ typedef struct {
 #define NULL_VAL            ((Value){VAL_NULL, {.number = 0}})
 #define NUMBER_VAL(value)   ((Value){VAL_NUMBER, {.number = value}})
 #define OBJ_VAL(object)     ((Value){VAL_OBJ, {.obj = (Obj*)object}})
+#define UNDEFINED_VAL       ((Value){VAL_UNDEFINED, {.number = 0}})
 
 #endif
 
@@ -3,9 +3,12 @@
 #include <string.h>
 #include <time.h>
 
+#include "array.h"
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
+#include "isolate.h"
+#include "scheduler.h"
 #include "object.h"
 #include "memory.h"
 #include "vm.h"
@@ -15,30 +18,39 @@
 */
 
 static void resetStack();
-static void runtimeError(const char* format, ...);
 static void concatenate();
 static bool isFalsey(Value value);
-static InterpretResult run();
+static InterpretResult run(int baseFrame);
+static InterpretResult runRegisters(int baseFrame);
+static InterpretResult runFrom(int baseFrame);
 static Value peek(int distance);
 
 void initVM();
 void freeVM();
 void push(Value value);
 static bool callValue(Value callee, int argCount);
+static bool tailCall(Value* callee, int argCount);
+static bool tailCallClosure(ObjClosure* closure, Value* callee, int argCount);
 static ObjUpvalue* captureUpvalue(Value* local);
 static void closeUpvalues(Value* last);
 
 Value pop();
 InterpretResult interpret(const char* source);
 static bool bindMethod(ObjClass* Class, ObjString* name);
-static bool invoke(ObjString* name, int argCount);
+static bool invoke(ObjString* name, int argCount, InlineCache* cache, bool tail);
+static bool getProperty(ObjInstance* instance, ObjString* name, InlineCache* cache, CacheEntry* entry);
+static void setProperty(ObjInstance* instance, ObjString* name, Value value, InlineCache* cache);
+static void invalidateInlineCaches(ObjClass* Class);
 static void defineMethod(ObjString* name);
-static bool invokeFromClass(ObjClass* Class, ObjString* name, int argCount);
+static bool invokeFromClass(ObjClass* Class, ObjString* name, int argCount, bool tail);
+#ifdef DEBUG_PROFILE_OPCODES
+static void printOpcodeProfile();
+#endif
 
 /**
- * Virtual Machine reference:
+ * The virtual machine of the calling thread. Every thread that calls initVM() gets its own.
 */
-VM vm;
+THREAD_LOCAL VM vm;
 
 static Value clockNative(int argCount, Value* args) {
     return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
@@ -58,7 +70,7 @@ static void resetStack() {
  * Printing out runtime errors with corresponding line
  * and any other useful information.
 */
-static void runtimeError(const char* format, ...) {
+void runtimeError(const char* format, ...) {
     va_list args;
     va_start(args, format);
     vfprintf(stderr, format, args);
@@ -69,8 +81,15 @@ static void runtimeError(const char* format, ...) {
     for (int i = vm.frameCount - 1; i >= 0; i--) {
         CallFrame* frame = &vm.frames[i];
         ObjFunction* function = frame->closure->function;
-        size_t instruction = frame->ip - function->chunk.code -1;
-        fprintf(stderr, "[line %d] in ", function->chunk.lines[instruction]);
+        int line;
+        if (onRegisterEngine(function)) {
+            line = getLine(&function->chunk.registers.lines, (int)(frame->pc - function->chunk.registers.code - 1));
+        }
+        else {
+            size_t instruction = frame->ip - function->chunk.code -1;
+            line = getLine(&function->chunk.lines, (int)instruction);
+        }
+        fprintf(stderr, "[line %d] in ", line);
         if (function->name == NULL) {
             fprintf(stderr, "script\n");
         }
@@ -85,12 +104,17 @@ static void runtimeError(const char* format, ...) {
 static void defineNative(const char* name, NativeFn function) {
     push(OBJ_VAL(copyString(name, (int)strlen(name))));
     push(OBJ_VAL(newNative(function)));
-    tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+    int slot = globalSlot(AS_STRING(vm.stack[0]));
+    vm.globalValues.values[slot] = vm.stack[1];
     pop();
     pop();
 }
 
 void initVM() {
+    vm.frames = NULL;
+    vm.frameCapacity = 0;
+    vm.stack = NULL;
+    vm.stackCapacity = 0;
     resetStack();
     vm.objects = NULL;
     vm.bytesAllocated = 0;
@@ -99,335 +123,1303 @@ void initVM() {
     vm.grayCount = 0;
     vm.grayCapacity = 0;
     vm.grayStack = NULL;
+    vm.registerEngine = false;
 
-    initTable(&vm.globals);
+    initTable(&vm.globalSlots);
+    initValueArray(&vm.globalNames);
+    initValueArray(&vm.globalValues);
     initTable(&vm.strings);
 
+    vm.frames = ALLOCATE(CallFrame, FRAMES_INITIAL);
+    vm.frameCapacity = FRAMES_INITIAL;
+    vm.stack = ALLOCATE(Value, STACK_INITIAL);
+    vm.stackCapacity = STACK_INITIAL;
+    resetStack();
+
+    initValueArray(&vm.selectorNames);
+    initValueArray(&vm.hostRoots);
     vm.initString = NULL;
     vm.initString = copyString("init", 4);
+    methodSelector(vm.initString);
+    vm.emptyShape = NULL;
+    vm.emptyShape = newShape(NULL, NULL);
     defineNative("clock", clockNative); // Add more native functions for file i/o
+    defineNative("channel", channelNative);
+    defineNative("send", sendNative);
+    defineNative("recv", recvNative);
+    defineNative("spawn", spawnNative);
+    defineNative("async", asyncNative);
+    defineNative("await", awaitNative);
+    defineNative("array", arrayNative);
+    defineNative("get", getNative);
+    defineNative("set", setNative);
+    defineNative("length", lengthNative);
+    defineNative("parallelMap", parallelMapNative);
+    defineNative("parallelReduce", parallelReduceNative);
     //defineNative("writeFile", writeFileNative);
     //defineNative("readFile", readFileNative);
     //defineNative("");
 }
 
+/**
+ * Returns the slot of the global with the given name, adding an undefined slot
+ * for it if the name hasn't been seen before.
+*/
+int globalSlot(ObjString* name) {
+    Value slot;
+    if (tableGet(&vm.globalSlots, name, &slot)) return (int)AS_NUMBER(slot);
+
+    push(OBJ_VAL(name));
+    int index = vm.globalValues.count;
+    writeValueArray(&vm.globalNames, OBJ_VAL(name));
+    writeValueArray(&vm.globalValues, UNDEFINED_VAL);
+    tableSet(&vm.globalSlots, name, NUMBER_VAL(index));
+    pop();
+    return index;
+}
+
+/**
+ * Returns the selector id of a method name, giving the name the next free id
+ * the first time a method with that name is compiled.
+*/
+int methodSelector(ObjString* name) {
+    if (name->selector == -1) {
+        push(OBJ_VAL(name));
+        writeValueArray(&vm.selectorNames, OBJ_VAL(name));
+        pop();
+        name->selector = vm.selectorNames.count - 1;
+    }
+    return name->selector;
+}
+
 void freeVM() {
-    freeTable(&vm.globals);
+    #ifdef DEBUG_PROFILE_OPCODES
+        printOpcodeProfile();
+    #endif
+    freeTable(&vm.globalSlots);
+    freeValueArray(&vm.globalNames);
+    freeValueArray(&vm.globalValues);
+    freeValueArray(&vm.selectorNames);
+    freeValueArray(&vm.hostRoots);
     freeTable(&vm.strings);
     vm.initString = NULL;
+    vm.emptyShape = NULL;
     freeObjects();
+    FREE_ARRAY(CallFrame, vm.frames, vm.frameCapacity);
+    FREE_ARRAY(Value, vm.stack, vm.stackCapacity);
+}
+
+#ifdef DEBUG_TRACE_EXECUTION
+/**
+ * Prints the stack contents and the instruction about to be executed.
+*/
+static void traceExecution(CallFrame* frame) {
+    printf("    ");
+    for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
+        printf("[ ");
+        printValue(*slot);
+        printf(" ]");
+    }
+    printf("\n");
+
+    disassembleInstruction(&frame->closure->function->chunk,
+        (int)(frame->ip - frame->closure->function->chunk.code));
+}
+
+/**
+ * Prints the current frame's registers and the register instruction about to be executed.
+*/
+static void traceRegisterExecution(CallFrame* frame) {
+    printf("    ");
+    for (Value* slot = frame->slots; slot < vm.stackTop; slot++) {
+        printf("[ ");
+        printValue(*slot);
+        printf(" ]");
+    }
+    printf("\n");
+
+    Chunk* chunk = &frame->closure->function->chunk;
+    disassembleRegisterInstruction(chunk, (int)(frame->pc - chunk->registers.code));
 }
+#endif
 
-// The "heart" of the VM
-static InterpretResult run() {
-    CallFrame* frame = &vm.frames[vm.frameCount - 1];
+#ifdef DEBUG_PROFILE_OPCODES
+// How often each opcode was executed directly after another one.
+// This is what the superinstruction set in chunk.h was picked from.
+static unsigned long opcodePairs[UINT8_COUNT][UINT8_COUNT];
+static int previousOpcode = -1;
 
+static void profileOpcode(uint8_t instruction) {
+    if (previousOpcode != -1) opcodePairs[previousOpcode][instruction]++;
+    previousOpcode = instruction;
+}
 
-    #define READ_BYTE() (*frame->ip++)
+/**
+ * Prints the most frequently executed opcode pairs to stderr.
+*/
+static void printOpcodeProfile() {
+    unsigned long total = 0;
+    for (int a = 0; a < UINT8_COUNT; a++) {
+        for (int b = 0; b < UINT8_COUNT; b++) total += opcodePairs[a][b];
+    }
 
-    #define READ_SHORT() \
-        (frame->ip += 2, \
-        (uint16_t) ((frame->ip[-2] << 8) | frame->ip[-1]))
+    fprintf(stderr, "== opcode pairs (%lu total) ==\n", total);
+    for (int rank = 0; rank < 30; rank++) {
+        int bestA = 0, bestB = 0;
+        for (int a = 0; a < UINT8_COUNT; a++) {
+            for (int b = 0; b < UINT8_COUNT; b++) {
+                if (opcodePairs[a][b] > opcodePairs[bestA][bestB]) {
+                    bestA = a;
+                    bestB = b;
+                }
+            }
+        }
+        if (opcodePairs[bestA][bestB] == 0) break;
 
-    #define READ_CONSTANT() \
-        (frame->closure->function->chunk.constants.values[READ_BYTE()])
+        fprintf(stderr, "%10lu %5.1f%%  %s, %s\n", opcodePairs[bestA][bestB],
+            100.0 * opcodePairs[bestA][bestB] / total, opcodeName(bestA), opcodeName(bestB));
+        opcodePairs[bestA][bestB] = 0;
+    }
+}
+#endif
+
+// The "heart" of the VM. Runs until the frame at baseFrame returns.
+static InterpretResult run(int baseFrame) {
+    // The hot interpreter state is kept in locals so the C compiler can hold it in
+    // registers: the instruction pointer, the stack pointer, the frame's slot base
+    // and constant pool, and the value on top of the stack.
+    // The stack is written through, so stack memory is always current; it is vm.stackTop
+    // and frame->ip that are only written back (STORE_STATE) before calls, returns,
+    // anything that can allocate (and so run the GC) and runtime errors.
+    CallFrame* frame;
+    uint32_t* ip;
+    Value* slots;
+    Value* constants;
+    Value* sp = vm.stackTop;
+    Value top = sp[-1];
+
+    #define LOAD_FRAME() \
+        do { \
+            frame = &vm.frames[vm.frameCount - 1]; \
+            ip = frame->ip; \
+            slots = frame->slots; \
+            constants = frame->closure->function->chunk.constants.values; \
+        } while (false)
 
+    #define STORE_STATE() \
+        do { \
+            frame->ip = ip; \
+            vm.stackTop = sp; \
+        } while (false)
+
+    #define LOAD_STACK() \
+        do { \
+            sp = vm.stackTop; \
+            top = sp[-1]; \
+        } while (false)
+
+    #define PUSH(value) (top = *sp++ = (value))
+    #define DROP()      (sp--, top = sp[-1])
+    #define PEEK(distance) ((distance) == 0 ? top : sp[-1 - (distance)])
+
+    #define RUNTIME_ERROR(...) \
+        do { \
+            STORE_STATE(); \
+            runtimeError(__VA_ARGS__); \
+            return INTERPRET_RUNTIME_ERROR; \
+        } while (false)
+
+    // Every instruction is one aligned word: the handler gets it in instruction and
+    // decodes its operand with a shift. Only extension words are read separately.
+    #define READ_WORD() (*ip++)
+    #define ARG() INSTR_ARG(instruction)
+
+    #define READ_CONSTANT() \
+        (constants[ARG()])
 
     #define READ_STRING() AS_STRING(READ_CONSTANT())
 
+    #define CACHE(index) \
+        (&frame->closure->function->chunk.caches[(index)])
+
     // This checks that both operands are numbers, otherwise, we throw a runtime error
     #define BINARY_OP(valueType, op) \
         do { \
-            if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
-                runtimeError("Operands must be numbers."); \
-                return INTERPRET_RUNTIME_ERROR; \
+            Value bValue = top; \
+            Value aValue = sp[-2]; \
+            if (!IS_NUMBER(bValue) || !IS_NUMBER(aValue)) { \
+                RUNTIME_ERROR("Operands must be numbers."); \
             } \
-            double b = AS_NUMBER(pop()); \
-            double a = AS_NUMBER(pop()); \
-            push(valueType(a op b)); \
+            sp--; \
+            top = sp[-1] = valueType(AS_NUMBER(aValue) op AS_NUMBER(bValue)); \
         } while (false)
 
     #define POST_BINARY_OP(valueType, op) \
         do { \
-            if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
-                runtimeError("Operands must be numbers."); \
-                return INTERPRET_RUNTIME_ERROR; \
+            Value bValue = top; \
+            Value aValue = sp[-2]; \
+            if (!IS_NUMBER(bValue) || !IS_NUMBER(aValue)) { \
+                RUNTIME_ERROR("Operands must be numbers."); \
             } \
-            double b = AS_NUMBER(pop()); \
-            double a = AS_NUMBER(pop()); \
-            push(valueType(b op a)); \
+            sp--; \
+            top = sp[-1] = valueType(AS_NUMBER(bValue) op AS_NUMBER(aValue)); \
         } while (false)
 
+    // Quickening: overwrites the opcode of the instruction being executed, which is
+    // the word before ip, and rewinds ip so that the next dispatch runs it again in the
+    // new form. The specialized forms only guard their operand types and rewrite
+    // themselves into the form that stays generic when the guard fails, so a site that
+    // sees several kinds of operands is only rewritten twice.
+    #define QUICKEN(opcode) (ip--, *ip = INSTR_ENCODE((opcode), ARG()))
+
+    #ifdef DEBUG_PROFILE_OPCODES
+        #define PROFILE_OPCODE() profileOpcode(INSTR_OP(*ip))
+    #else
+        #define PROFILE_OPCODE() do { } while (false)
+    #endif
+
+    #ifdef DEBUG_TRACE_EXECUTION
+        #define TRACE_EXECUTION() \
+            do { \
+                STORE_STATE(); \
+                traceExecution(frame); \
+            } while (false)
+    #else
+        #define TRACE_EXECUTION() do { } while (false)
+    #endif
+
+    // Threaded dispatch: every handler jumps straight to the next handler through
+    // this table instead of going back through one shared switch branch.
+    #ifdef COMPUTED_GOTO
+        static void* dispatchTable[] = {
+            [OP_CONSTANT] = &&code_CONSTANT,
+            [OP_NULL] = &&code_NULL,
+            [OP_TRUE] = &&code_TRUE,
+            [OP_FALSE] = &&code_FALSE,
+            [OP_POP] = &&code_POP,
+            [OP_GET_LOCAL] = &&code_GET_LOCAL,
+            [OP_SET_LOCAL] = &&code_SET_LOCAL,
+            [OP_GET_GLOBAL] = &&code_GET_GLOBAL,
+            [OP_DEFINE_GLOBAL] = &&code_DEFINE_GLOBAL,
+            [OP_SET_GLOBAL] = &&code_SET_GLOBAL,
+            [OP_GET_UPVALUE] = &&code_GET_UPVALUE,
+            [OP_SET_UPVALUE] = &&code_SET_UPVALUE,
+            [OP_GET_PROPERTY] = &&code_GET_PROPERTY,
+            [OP_SET_PROPERTY] = &&code_SET_PROPERTY,
+            [OP_GET_SUPER] = &&code_GET_SUPER,
+            [OP_EQUAL] = &&code_EQUAL,
+            [OP_GREATER] = &&code_GREATER,
+            [OP_LESS] = &&code_LESS,
+            [OP_GREATER_EQUAL] = &&code_GREATER_EQUAL,
+            [OP_LESS_EQUAL] = &&code_LESS_EQUAL,
+            [OP_NOT_EQUAL] = &&code_NOT_EQUAL,
+            [OP_ADD] = &&code_ADD,
+            [OP_SUBTRACT] = &&code_SUBTRACT,
+            [OP_MULTIPLY] = &&code_MULTIPLY,
+            [OP_DIVIDE] = &&code_DIVIDE,
+            [OP_NOT] = &&code_NOT,
+            [OP_NEGATE] = &&code_NEGATE,
+            [OP_PRINT] = &&code_PRINT,
+            [OP_JUMP] = &&code_JUMP,
+            [OP_JUMP_IF_FALSE] = &&code_JUMP_IF_FALSE,
+            [OP_LOOP] = &&code_LOOP,
+            [OP_CALL] = &&code_CALL,
+            [OP_TAIL_CALL] = &&code_TAIL_CALL,
+            [OP_INVOKE] = &&code_INVOKE,
+            [OP_SUPER_INVOKE] = &&code_SUPER_INVOKE,
+            [OP_TAIL_INVOKE] = &&code_TAIL_INVOKE,
+            [OP_TAIL_SUPER_INVOKE] = &&code_TAIL_SUPER_INVOKE,
+            [OP_CLOSURE] = &&code_CLOSURE,
+            [OP_CLOSE_UPVALUE] = &&code_CLOSE_UPVALUE,
+            [OP_RETURN] = &&code_RETURN,
+            [OP_CLASS] = &&code_CLASS,
+            [OP_INHERIT] = &&code_INHERIT,
+            [OP_METHOD] = &&code_METHOD,
+            [OP_FOR_RANGE] = &&code_FOR_RANGE,
+            [OP_GET_LOCAL_CONSTANT] = &&code_GET_LOCAL_CONSTANT,
+            [OP_ADD_LOCALS] = &&code_ADD_LOCALS,
+            [OP_INCREMENT_LOCAL] = &&code_INCREMENT_LOCAL,
+            [OP_SET_LOCAL_POP] = &&code_SET_LOCAL_POP,
+            [OP_JUMP_IF_FALSE_POP] = &&code_JUMP_IF_FALSE_POP,
+            [OP_LESS_JUMP_IF_FALSE] = &&code_LESS_JUMP_IF_FALSE,
+            [OP_EQUAL_NUM] = &&code_EQUAL_NUM,
+            [OP_ADD_NUM] = &&code_ADD_NUM,
+            [OP_ADD_STR] = &&code_ADD_STR,
+            [OP_ADD_LOCALS_NUM] = &&code_ADD_LOCALS_NUM,
+            [OP_EQUAL_ANY] = &&code_EQUAL_ANY,
+            [OP_ADD_ANY] = &&code_ADD_ANY,
+            [OP_ADD_LOCALS_ANY] = &&code_ADD_LOCALS_ANY
+        };
+
+        #define INTERPRET_LOOP  goto *dispatchTable[INSTR_OP(instruction = READ_WORD())];
+        #define CASE_CODE(name) code_##name
+        #define DISPATCH() \
+            do { \
+                TRACE_EXECUTION(); \
+                PROFILE_OPCODE(); \
+                goto *dispatchTable[INSTR_OP(instruction = READ_WORD())]; \
+            } while (false)
+    #else
+        #define INTERPRET_LOOP  switch (INSTR_OP(instruction = READ_WORD()))
+        #define CASE_CODE(name) case OP_##name
+        #define DISPATCH() break
+    #endif
+
+    LOAD_FRAME();
+
     for (;;) {
-        /*
-        #ifdef DEBUG_TRACE_EXECUTION
-            printf("    ");
-            for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
-                printf("[ ");
-                printValue(*slot);
-                printf(" ]");
-            }
-            printf("\n");
-
-            disassembleInstruction(&frame->closure->function->chunk,
-                (int)(frame->ip - frame->closure->function->chunk.code));
-        #endif
-        */
-
-        uint8_t instruction;
-        switch(instruction = READ_BYTE()) {
-            case OP_CONSTANT: {
+        TRACE_EXECUTION();
+        PROFILE_OPCODE();
+
+        uint32_t instruction;
+        INTERPRET_LOOP {
+            CASE_CODE(CONSTANT): {
                 Value constant = READ_CONSTANT();
-                push(constant);
-                break;
+                PUSH(constant);
+                DISPATCH();
             }
-            case OP_NULL:       push(NULL_VAL); break;
-            case OP_TRUE:       push(BOOL_VAL(true)); break;
-            case OP_FALSE:      push(BOOL_VAL(false)); break;
-            case OP_POP:        pop(); break;
-            case OP_GET_LOCAL:  {
-                uint8_t slot = READ_BYTE();
-                push(frame->slots[slot]);
-                break;
-            }
-            case OP_SET_LOCAL: {
-                uint8_t slot = READ_BYTE();
-                frame->slots[slot] = peek(0);
-                break;
-            }
-            case OP_GET_GLOBAL: {
-                ObjString* name = READ_STRING();
-                Value value;
-                if (!tableGet(&vm.globals, name, &value)) {
-                    runtimeError("Undefined variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
+            CASE_CODE(NULL):       PUSH(NULL_VAL); DISPATCH();
+            CASE_CODE(TRUE):       PUSH(BOOL_VAL(true)); DISPATCH();
+            CASE_CODE(FALSE):      PUSH(BOOL_VAL(false)); DISPATCH();
+            CASE_CODE(POP):        DROP(); DISPATCH();
+            CASE_CODE(GET_LOCAL):  PUSH(slots[ARG()]); DISPATCH();
+            CASE_CODE(SET_LOCAL):  slots[ARG()] = top; DISPATCH();
+            CASE_CODE(GET_GLOBAL): {
+                uint32_t slot = ARG();
+                Value value = vm.globalValues.values[slot];
+                if (IS_UNDEFINED(value)) {
+                    RUNTIME_ERROR("Undefined variable '%s'.", GLOBAL_NAME(slot)->chars);
                 }
-                push(value);
-                break;
+                PUSH(value);
+                DISPATCH();
             }
-            case OP_DEFINE_GLOBAL: {
-                ObjString* name = READ_STRING();
-                tableSet(&vm.globals, name, peek(0));
-                pop();
-                break;
+            CASE_CODE(DEFINE_GLOBAL): {
+                vm.globalValues.values[ARG()] = top;
+                DROP();
+                DISPATCH();
             }         
-            case OP_SET_GLOBAL: {
-                ObjString* name = READ_STRING();
-                if (tableSet(&vm.globals, name, peek(0))) {
-                    tableDelete(&vm.globals, name);
-                    runtimeError("Undefined variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
+            CASE_CODE(SET_GLOBAL): {
+                uint32_t slot = ARG();
+                if (IS_UNDEFINED(vm.globalValues.values[slot])) {
+                    RUNTIME_ERROR("Undefined variable '%s'.", GLOBAL_NAME(slot)->chars);
                 }
-                break;
+                vm.globalValues.values[slot] = top;
+                DISPATCH();
             }
-            case OP_GET_UPVALUE: {
-                uint8_t slot = READ_BYTE();
-                push(*frame->closure->upvalues[slot]->location);
-                break;
+            CASE_CODE(GET_UPVALUE): {
+                PUSH(*frame->closure->upvalues[ARG()]->location);
+                DISPATCH();
             }
-            case OP_SET_UPVALUE: {
-                uint8_t slot = READ_BYTE();
-                *frame->closure->upvalues[slot]->location = peek(0);
-                break;
+            CASE_CODE(SET_UPVALUE): {
+                *frame->closure->upvalues[ARG()]->location = top;
+                DISPATCH();
             }
-            case OP_GET_PROPERTY: {
-                if (!IS_INSTANCE(peek(0))) {
-                    runtimeError("Only class instances have properties that can be accessed.");
-                    return INTERPRET_RUNTIME_ERROR;
+            CASE_CODE(GET_PROPERTY): {
+                if (!IS_INSTANCE(top)) {
+                    RUNTIME_ERROR("Only class instances have properties that can be accessed.");
                 }
 
-                ObjInstance* instance = AS_INSTANCE(peek(0));
+                ObjInstance* instance = AS_INSTANCE(top);
                 ObjString* name = READ_STRING();
+                InlineCache* cache = CACHE(READ_WORD());
 
-                Value value;
-                if (tableGet(&instance->fields, name, &value)) {
-                    pop();
-                    push(value);
-                    break;
+                CacheEntry* entry = findCacheEntry(cache, instance);
+                if (entry != NULL && entry->method == NULL) {
+                    top = sp[-1] = *instanceField(instance, entry->slot);
+                    DISPATCH();
                 }
 
                 //runtimeError("Undefined property '%s'.", name->chars);
                 //return INTERPRET_RUNTIME_ERROR;
 
-                if (!bindMethod(instance->Class, name)) {
+                STORE_STATE();
+                if (!getProperty(instance, name, cache, entry)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                break;
+                LOAD_STACK();
+                DISPATCH();
             }
-            case OP_SET_PROPERTY: {
-                if (!IS_INSTANCE(peek(1))) {
-                    runtimeError("Only instances have fields.");
-                    return INTERPRET_RUNTIME_ERROR;
+            CASE_CODE(SET_PROPERTY): {
+                if (!IS_INSTANCE(sp[-2])) {
+                    RUNTIME_ERROR("Only instances have fields.");
                 }
 
-                ObjInstance* instance = AS_INSTANCE(peek(1));
-                tableSet(&instance->fields, READ_STRING(), peek(0));
-                Value value = pop();
-                pop();
-                push(value);
-                break;
+                ObjInstance* instance = AS_INSTANCE(sp[-2]);
+                ObjString* name = READ_STRING();
+                InlineCache* cache = CACHE(READ_WORD());
+
+                CacheEntry* entry = findCacheEntry(cache, instance);
+                if (entry != NULL) {
+                    if (!hasFieldStorage(instance, entry->slot)) {
+                        STORE_STATE();
+                        reserveField(instance, entry->slot);
+                    }
+                    *instanceField(instance, entry->slot) = top;
+                    if (entry->transition != NULL) instance->shape = entry->transition;
+                }
+                else {
+                    STORE_STATE();
+                    setProperty(instance, name, top, cache);
+                }
+                Value value = top;
+                sp--;
+                top = sp[-1] = value;
+                DISPATCH();
             }
-            case OP_GET_SUPER: {
+            CASE_CODE(GET_SUPER): {
                 ObjString* name = READ_STRING();
-                ObjClass* superclass = AS_CLASS(pop());
+                ObjClass* superclass = AS_CLASS(top);
+                DROP();
 
+                STORE_STATE();
                 if (!bindMethod(superclass, name)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                break;
+                LOAD_STACK();
+                DISPATCH();
             }
-            case OP_EQUAL: {
-                Value b = pop();
-                Value a = pop();
-                push(BOOL_VAL(valuesEqual(a, b)));
-                break;
+            CASE_CODE(EQUAL): {
+                Value b = top;
+                Value a = sp[-2];
+                if (IS_NUMBER(a) && IS_NUMBER(b)) {
+                    QUICKEN(OP_EQUAL_NUM);
+                    DISPATCH();
+                }
+                sp--;
+                top = sp[-1] = BOOL_VAL(valuesEqual(a, b));
+                DISPATCH();
             }
-            case OP_GREATER:    BINARY_OP(BOOL_VAL, >); break;
-            case OP_LESS:       BINARY_OP(BOOL_VAL, <); break;
-            case OP_GREATER_EQUAL: BINARY_OP(BOOL_VAL, >=); break;
-            case OP_LESS_EQUAL: BINARY_OP(BOOL_VAL, <=); break;
-            case OP_ADD: {
-                if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-                    concatenate();
-                } 
-                else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-                    double b = AS_NUMBER(pop());
-                    double a = AS_NUMBER(pop());
-                    push(NUMBER_VAL(a + b));
-                } 
-                else {
-                    runtimeError("Operands must be two numbers or two strings.");
-                    return INTERPRET_RUNTIME_ERROR;
+            CASE_CODE(NOT_EQUAL): {
+                Value b = top;
+                Value a = sp[-2];
+                sp--;
+                top = sp[-1] = BOOL_VAL(!valuesEqual(a, b));
+                DISPATCH();
+            }
+            CASE_CODE(GREATER):    BINARY_OP(BOOL_VAL, >); DISPATCH();
+            CASE_CODE(LESS):       BINARY_OP(BOOL_VAL, <); DISPATCH();
+            CASE_CODE(GREATER_EQUAL): BINARY_OP(BOOL_VAL, >=); DISPATCH();
+            CASE_CODE(LESS_EQUAL): BINARY_OP(BOOL_VAL, <=); DISPATCH();
+            CASE_CODE(ADD): {
+                // Never adds anything itself, it only picks the form to quicken into.
+                Value b = top;
+                Value a = sp[-2];
+                if (IS_NUMBER(b) && IS_NUMBER(a)) {
+                    QUICKEN(OP_ADD_NUM);
+                    DISPATCH();
                 }
-                break;
+                if (IS_STRING(b) && IS_STRING(a)) {
+                    QUICKEN(OP_ADD_STR);
+                    DISPATCH();
+                }
+                RUNTIME_ERROR("Operands must be two numbers or two strings.");
             }
-            case OP_SUBTRACT:   BINARY_OP(NUMBER_VAL, -); break;
-            case OP_MULTIPLY:   BINARY_OP(NUMBER_VAL, *); break;
-            case OP_DIVIDE:     BINARY_OP(NUMBER_VAL, /); break;
-            case OP_NOT:        push(BOOL_VAL(isFalsey(pop()))); break;
-            case OP_NEGATE: {
+            CASE_CODE(SUBTRACT):   BINARY_OP(NUMBER_VAL, -); DISPATCH();
+            CASE_CODE(MULTIPLY):   BINARY_OP(NUMBER_VAL, *); DISPATCH();
+            CASE_CODE(DIVIDE):     BINARY_OP(NUMBER_VAL, /); DISPATCH();
+            CASE_CODE(NOT):        top = sp[-1] = BOOL_VAL(isFalsey(top)); DISPATCH();
+            CASE_CODE(NEGATE): {
                 // Read the value on top of the stack and check to see if it is a number,
                 // since if it isn't we throw a runtime error
-                if (!IS_NUMBER(peek(0))) {
-                    runtimeError("Operand must be a number.");
-                    return INTERPRET_RUNTIME_ERROR;
+                if (!IS_NUMBER(top)) {
+                    RUNTIME_ERROR("Operand must be a number.");
                 }
 
-                // Will push the numerical value to the top of the vm's stack
-                push(NUMBER_VAL(-AS_NUMBER(pop())));
-                break;
+                // Will replace the value on top of the vm's stack with its negation
+                top = sp[-1] = NUMBER_VAL(-AS_NUMBER(top));
+                DISPATCH();
             }
-            case OP_PRINT: {
-                printValue(pop());
+            CASE_CODE(PRINT): {
+                printValue(top);
                 printf("\n");
-                break;
+                DROP();
+                DISPATCH();
             }
-            case OP_JUMP: {
-                uint16_t offset = READ_SHORT();
-                frame->ip += offset;
-                break;
+            CASE_CODE(JUMP):       ip += ARG(); DISPATCH();
+            CASE_CODE(JUMP_IF_FALSE): {
+                if (isFalsey(top)) ip += ARG();
+                DISPATCH();
             }
-            case OP_JUMP_IF_FALSE: {
-                uint16_t offset = READ_SHORT();
-                if (isFalsey(peek(0))) frame->ip += offset;
-                break;
+            CASE_CODE(LOOP):       ip -= ARG(); DISPATCH();
+            CASE_CODE(CALL): {
+                int argCount = ARG();
+                STORE_STATE();
+                if (!callValue(PEEK(argCount), argCount)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                LOAD_FRAME();
+                LOAD_STACK();
+                DISPATCH();
             }
-            case OP_LOOP: {
-                uint16_t offset  = READ_SHORT();
-                frame->ip -= offset;
-                break;
+            CASE_CODE(TAIL_CALL): {
+                int argCount = ARG();
+                STORE_STATE();
+                if (!tailCall(sp - argCount - 1, argCount)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                LOAD_FRAME();
+                LOAD_STACK();
+                DISPATCH();
             }
-            case OP_CALL: {
-                int argCount = READ_BYTE();
-                if (!callValue(peek(argCount), argCount)) {
+            CASE_CODE(INVOKE): {
+                ObjString* method = READ_STRING();
+                uint32_t operands = READ_WORD();
+                int argCount = INSTR_OP(operands);
+                InlineCache* cache = CACHE(INSTR_ARG(operands));
+                STORE_STATE();
+                if (!invoke(method, argCount, cache, false)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
+                LOAD_FRAME();
+                LOAD_STACK();
+                DISPATCH();
             }
-            case OP_INVOKE: {
+            CASE_CODE(SUPER_INVOKE): {
                 ObjString* method = READ_STRING();
-                int argCount = READ_BYTE();
-                if (!invoke(method, argCount)) {
+                int argCount = INSTR_OP(READ_WORD());
+                ObjClass* superclass = AS_CLASS(top);
+                DROP();
+                STORE_STATE();
+                if (!invokeFromClass(superclass, method, argCount, false)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
+                LOAD_FRAME();
+                LOAD_STACK();
+                DISPATCH();
             }
-            case OP_SUPER_INVOKE: {
+            CASE_CODE(TAIL_INVOKE): {
                 ObjString* method = READ_STRING();
-                int argCount = READ_BYTE();
-                ObjClass* superclass = AS_CLASS(pop());
-                if (!invokeFromClass(superclass, method, argCount)) {
+                uint32_t operands = READ_WORD();
+                int argCount = INSTR_OP(operands);
+                InlineCache* cache = CACHE(INSTR_ARG(operands));
+                STORE_STATE();
+                if (!invoke(method, argCount, cache, true)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
+                LOAD_FRAME();
+                LOAD_STACK();
+                DISPATCH();
             }
-            case OP_CLOSURE: {
+            CASE_CODE(TAIL_SUPER_INVOKE): {
+                ObjString* method = READ_STRING();
+                int argCount = INSTR_OP(READ_WORD());
+                ObjClass* superclass = AS_CLASS(top);
+                DROP();
+                STORE_STATE();
+                if (!invokeFromClass(superclass, method, argCount, true)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                LOAD_FRAME();
+                LOAD_STACK();
+                DISPATCH();
+            }
+            CASE_CODE(CLOSURE): {
                 ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
+                STORE_STATE();
                 ObjClosure* closure = newClosure(function);
-                push(OBJ_VAL(closure));
+                PUSH(OBJ_VAL(closure));
+                // The closure is a GC root while its upvalues are being captured.
+                vm.stackTop = sp;
                 for (int i = 0; i < closure->upvalueCount; i++) {
-                    uint8_t isLocal = READ_BYTE();
-                    uint8_t index = READ_BYTE();
-                    if (isLocal) {
+                    uint32_t upvalue = READ_WORD();
+                    uint32_t index = INSTR_ARG(upvalue);
+                    if (INSTR_OP(upvalue)) {
                         closure->upvalues[i] =
-                            captureUpvalue(frame->slots + index);
+                            captureUpvalue(slots + index);
                     } else {
                         closure->upvalues[i] = frame->closure->upvalues[index];
                     }
                 }
-                break;
+                DISPATCH();
             }
-            case OP_CLOSE_UPVALUE: {
-                closeUpvalues(vm.stackTop - 1);
-                pop();
-                break;
+            CASE_CODE(CLOSE_UPVALUE): {
+                closeUpvalues(sp - 1);
+                DROP();
+                DISPATCH();
             }
-            case OP_RETURN: {
-                Value result = pop();
-                closeUpvalues(frame->slots);
+            CASE_CODE(RETURN): {
+                Value result = top;
+                closeUpvalues(slots);
                 vm.frameCount--;
-                if (vm.frameCount == 0) {
-                    pop();
+                if (vm.frameCount == baseFrame) {
+                    // The result takes the place of the callee, like after any other call.
+                    *slots = result;
+                    vm.stackTop = slots + 1;
                     return INTERPRET_OK;
                 }
 
-                vm.stackTop = frame->slots;
-                push(result);
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
+                sp = slots;
+                PUSH(result);
+                LOAD_FRAME();
+                DISPATCH();
             }
-            case OP_CLASS: {
-                push(OBJ_VAL(newClass(READ_STRING())));
-                break;
+            CASE_CODE(CLASS): {
+                ObjString* name = READ_STRING();
+                STORE_STATE();
+                PUSH(OBJ_VAL(newClass(name)));
+                DISPATCH();
             }
-            case OP_INHERIT: {
-                Value superclass = peek(1);
+            CASE_CODE(INHERIT): {
+                Value superclass = sp[-2];
                 if (!IS_CLASS(superclass)) {
-                    runtimeError("Superclass must be a class. The superclass being used inheriting from isn't actually a class.");
-                    return INTERPRET_RUNTIME_ERROR;
+                    RUNTIME_ERROR("Superclass must be a class. The superclass being used inheriting from isn't actually a class.");
                 }
 
-                ObjClass* subclass = AS_CLASS(peek(0));
-                tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
-                pop(); // Subclass.
-                break;
+                ObjClass* subclass = AS_CLASS(top);
+                STORE_STATE();
+                inheritMethods(subclass, AS_CLASS(superclass));
+                invalidateInlineCaches(subclass);
+                DROP(); // Subclass.
+                DISPATCH();
             }
-            case OP_METHOD: {
-                defineMethod(READ_STRING());
-                break;
+            CASE_CODE(METHOD): {
+                ObjString* name = READ_STRING();
+                STORE_STATE();
+                defineMethod(name);
+                LOAD_STACK();
+                DISPATCH();
+            }
+            CASE_CODE(FOR_RANGE): {
+                uint32_t slot = INSTR_A(instruction);
+                Value step = constants[INSTR_B(instruction)];
+                uint32_t limitWord = READ_WORD();
+                uint32_t distance = INSTR_ARG(READ_WORD());
+                if (!IS_NUMBER(slots[slot])) {
+                    PUSH(slots[slot]);
+                    PUSH(step);
+                    RUNTIME_ERROR("Operands must be two numbers or two strings.");
+                }
+                double counter = AS_NUMBER(slots[slot]) + AS_NUMBER(step);
+                slots[slot] = NUMBER_VAL(counter);
+                // The slot may be the one on top of the stack.
+                top = sp[-1];
+
+                Value limit = INSTR_OP(limitWord) ? constants[INSTR_ARG(limitWord)] : slots[INSTR_ARG(limitWord)];
+                if (!IS_NUMBER(limit)) {
+                    RUNTIME_ERROR("Operands must be numbers.");
+                }
+                if (counter < AS_NUMBER(limit)) ip -= distance;
+                DISPATCH();
+            }
+            CASE_CODE(GET_LOCAL_CONSTANT): {
+                PUSH(slots[INSTR_A(instruction)]);
+                PUSH(constants[INSTR_B(instruction)]);
+                DISPATCH();
+            }
+            CASE_CODE(ADD_LOCALS): {
+                Value a = slots[INSTR_A(instruction)];
+                Value b = slots[INSTR_B(instruction)];
+                if (IS_NUMBER(a) && IS_NUMBER(b)) {
+                    QUICKEN(OP_ADD_LOCALS_NUM);
+                    DISPATCH();
+                }
+                if (IS_STRING(a) && IS_STRING(b)) {
+                    PUSH(a);
+                    PUSH(b);
+                    STORE_STATE();
+                    concatenate();
+                    LOAD_STACK();
+                }
+                else {
+                    PUSH(a);
+                    PUSH(b);
+                    RUNTIME_ERROR("Operands must be two numbers or two strings.");
+                }
+                DISPATCH();
+            }
+            CASE_CODE(INCREMENT_LOCAL): {
+                uint32_t slot = INSTR_A(instruction);
+                Value constant = constants[INSTR_B(instruction)];
+                if (!IS_NUMBER(slots[slot])) {
+                    PUSH(slots[slot]);
+                    PUSH(constant);
+                    RUNTIME_ERROR("Operands must be two numbers or two strings.");
+                }
+                slots[slot] = NUMBER_VAL(AS_NUMBER(slots[slot]) + AS_NUMBER(constant));
+                // The slot may be the one on top of the stack.
+                top = sp[-1];
+                DISPATCH();
+            }
+            CASE_CODE(SET_LOCAL_POP): {
+                slots[ARG()] = top;
+                DROP();
+                DISPATCH();
+            }
+            CASE_CODE(JUMP_IF_FALSE_POP): {
+                bool falsey = isFalsey(top);
+                DROP();
+                if (falsey) ip += ARG();
+                DISPATCH();
+            }
+            CASE_CODE(LESS_JUMP_IF_FALSE): {
+                Value b = top;
+                Value a = sp[-2];
+                if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+                    RUNTIME_ERROR("Operands must be numbers.");
+                }
+                sp -= 2;
+                top = sp[-1];
+                if (!(AS_NUMBER(a) < AS_NUMBER(b))) ip += ARG();
+                DISPATCH();
+            }
+            CASE_CODE(EQUAL_NUM): {
+                Value b = top;
+                Value a = sp[-2];
+                if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+                    QUICKEN(OP_EQUAL_ANY);
+                    DISPATCH();
+                }
+                sp--;
+                top = sp[-1] = BOOL_VAL(AS_NUMBER(a) == AS_NUMBER(b));
+                DISPATCH();
+            }
+            CASE_CODE(ADD_NUM): {
+                Value b = top;
+                Value a = sp[-2];
+                if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+                    QUICKEN(OP_ADD_ANY);
+                    DISPATCH();
+                }
+                sp--;
+                top = sp[-1] = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+                DISPATCH();
+            }
+            CASE_CODE(ADD_STR): {
+                if (!IS_STRING(top) || !IS_STRING(sp[-2])) {
+                    QUICKEN(OP_ADD_ANY);
+                    DISPATCH();
+                }
+                STORE_STATE();
+                concatenate();
+                LOAD_STACK();
+                DISPATCH();
+            }
+            CASE_CODE(ADD_LOCALS_NUM): {
+                Value a = slots[INSTR_A(instruction)];
+                Value b = slots[INSTR_B(instruction)];
+                if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+                    QUICKEN(OP_ADD_LOCALS_ANY);
+                    DISPATCH();
+                }
+                PUSH(NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+                DISPATCH();
+            }
+            CASE_CODE(EQUAL_ANY): {
+                Value b = top;
+                Value a = sp[-2];
+                sp--;
+                top = sp[-1] = BOOL_VAL(valuesEqual(a, b));
+                DISPATCH();
+            }
+            CASE_CODE(ADD_ANY): {
+                Value b = top;
+                Value a = sp[-2];
+                if (IS_NUMBER(b) && IS_NUMBER(a)) {
+                    sp--;
+                    top = sp[-1] = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+                }
+                else if (IS_STRING(b) && IS_STRING(a)) {
+                    STORE_STATE();
+                    concatenate();
+                    LOAD_STACK();
+                }
+                else {
+                    RUNTIME_ERROR("Operands must be two numbers or two strings.");
+                }
+                DISPATCH();
+            }
+            CASE_CODE(ADD_LOCALS_ANY): {
+                Value a = slots[INSTR_A(instruction)];
+                Value b = slots[INSTR_B(instruction)];
+                if (IS_NUMBER(a) && IS_NUMBER(b)) {
+                    PUSH(NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+                    DISPATCH();
+                }
+                PUSH(a);
+                PUSH(b);
+                if (!IS_STRING(a) || !IS_STRING(b)) {
+                    RUNTIME_ERROR("Operands must be two numbers or two strings.");
+                }
+                STORE_STATE();
+                concatenate();
+                LOAD_STACK();
+                DISPATCH();
             }
         }
     }
 
-    #undef READ_BYTE
-    #undef READ_SHORT
+    #undef LOAD_FRAME
+    #undef STORE_STATE
+    #undef LOAD_STACK
+    #undef PUSH
+    #undef DROP
+    #undef PEEK
+    #undef RUNTIME_ERROR
+    #undef READ_WORD
+    #undef ARG
     #undef READ_CONSTANT
     #undef READ_STRING
+    #undef CACHE
     #undef BINARY_OP
     #undef POST_BINARY_OP
+    #undef QUICKEN
+    #undef TRACE_EXECUTION
+    #undef PROFILE_OPCODE
+    #undef INTERPRET_LOOP
+    #undef CASE_CODE
+    #undef DISPATCH
+}
+
+/**
+ * The register machine counterpart of run(), executing the RegisterCode that
+ * compileRegisterCode() produced. Registers are the frame's slots, so values go
+ * straight from one register to another instead of through pushes and pops.
+ * vm.stackTop stays at the top of the current frame's registers, except while a
+ * call or a helper that works on the VM stack is handed the values above a register.
+ * Runs until the frame at baseFrame returns.
+*/
+static InterpretResult runRegisters(int baseFrame) {
+    CallFrame* frame;
+    uint32_t* pc;
+    Value* slots;
+    Value* constants;
+    Value* registersTop;
+
+    #define LOAD_FRAME() \
+        do { \
+            frame = &vm.frames[vm.frameCount - 1]; \
+            pc = frame->pc; \
+            slots = frame->slots; \
+            constants = frame->closure->function->chunk.constants.values; \
+            registersTop = slots + frame->closure->function->chunk.registers.frameSize; \
+            vm.stackTop = registersTop; \
+        } while (false)
+
+    #define STORE_STATE() (frame->pc = pc)
+
+    #define RUNTIME_ERROR(...) \
+        do { \
+            STORE_STATE(); \
+            runtimeError(__VA_ARGS__); \
+            return INTERPRET_RUNTIME_ERROR; \
+        } while (false)
+
+    #define RA  (slots[REG_A(instruction)])
+    #define RB  (slots[REG_B(instruction)])
+    #define RC  (slots[REG_C(instruction)])
+    #define KC  (constants[REG_C(instruction)])
+    #define KBX (constants[REG_BX(instruction)])
+    // The inline cache index of a property instruction is the word after it.
+    #define READ_CACHE() (&frame->closure->function->chunk.caches[*pc++])
+
+    // This checks that both operands are numbers, otherwise, we throw a runtime error
+    #define BINARY_OP(valueType, op, right) \
+        do { \
+            Value bValue = (right); \
+            Value aValue = RB; \
+            if (!IS_NUMBER(bValue) || !IS_NUMBER(aValue)) { \
+                RUNTIME_ERROR("Operands must be numbers."); \
+            } \
+            RA = valueType(AS_NUMBER(aValue) op AS_NUMBER(bValue)); \
+        } while (false)
+
+    #define ADD_OP(right) \
+        do { \
+            Value bValue = (right); \
+            Value aValue = RB; \
+            if (IS_NUMBER(bValue) && IS_NUMBER(aValue)) { \
+                RA = NUMBER_VAL(AS_NUMBER(aValue) + AS_NUMBER(bValue)); \
+            } \
+            else if (IS_STRING(bValue) && IS_STRING(aValue)) { \
+                ObjString* result = concatenateStrings(AS_STRING(aValue), AS_STRING(bValue)); \
+                RA = OBJ_VAL(result); \
+            } \
+            else { \
+                RUNTIME_ERROR("Operands must be two numbers or two strings."); \
+            } \
+        } while (false)
+
+    // Skips the jump word that follows when R[B] < right, otherwise takes it.
+    #define LESS_JUMP(right) \
+        do { \
+            Value bValue = (right); \
+            Value aValue = RB; \
+            if (!IS_NUMBER(bValue) || !IS_NUMBER(aValue)) { \
+                RUNTIME_ERROR("Operands must be numbers."); \
+            } \
+            pc += AS_NUMBER(aValue) < AS_NUMBER(bValue) ? 1 : REG_SBX(*pc) + 1; \
+        } while (false)
+
+    // Steps R[A] by K[B] and takes the jump word that follows while R[A] < right.
+    #define FOR_RANGE(right) \
+        do { \
+            Value step = constants[REG_B(instruction)]; \
+            if (!IS_NUMBER(RA)) { \
+                RUNTIME_ERROR("Operands must be two numbers or two strings."); \
+            } \
+            double counter = AS_NUMBER(RA) + AS_NUMBER(step); \
+            RA = NUMBER_VAL(counter); \
+            Value limit = (right); \
+            if (!IS_NUMBER(limit)) { \
+                RUNTIME_ERROR("Operands must be numbers."); \
+            } \
+            pc += counter < AS_NUMBER(limit) ? REG_SBX(*pc) + 1 : 1; \
+        } while (false)
+
+    #ifdef DEBUG_TRACE_EXECUTION
+        #define TRACE_EXECUTION() \
+            do { \
+                STORE_STATE(); \
+                traceRegisterExecution(frame); \
+            } while (false)
+    #else
+        #define TRACE_EXECUTION() do { } while (false)
+    #endif
+
+    #ifdef COMPUTED_GOTO
+        static void* dispatchTable[] = {
+            [ROP_MOVE] = &&code_MOVE,
+            [ROP_LOAD_CONSTANT] = &&code_LOAD_CONSTANT,
+            [ROP_NULL] = &&code_NULL,
+            [ROP_TRUE] = &&code_TRUE,
+            [ROP_FALSE] = &&code_FALSE,
+            [ROP_GET_GLOBAL] = &&code_GET_GLOBAL,
+            [ROP_DEFINE_GLOBAL] = &&code_DEFINE_GLOBAL,
+            [ROP_SET_GLOBAL] = &&code_SET_GLOBAL,
+            [ROP_GET_UPVALUE] = &&code_GET_UPVALUE,
+            [ROP_SET_UPVALUE] = &&code_SET_UPVALUE,
+            [ROP_GET_PROPERTY] = &&code_GET_PROPERTY,
+            [ROP_SET_PROPERTY] = &&code_SET_PROPERTY,
+            [ROP_GET_SUPER] = &&code_GET_SUPER,
+            [ROP_EQUAL] = &&code_EQUAL,
+            [ROP_NOT_EQUAL] = &&code_NOT_EQUAL,
+            [ROP_GREATER] = &&code_GREATER,
+            [ROP_LESS] = &&code_LESS,
+            [ROP_GREATER_EQUAL] = &&code_GREATER_EQUAL,
+            [ROP_LESS_EQUAL] = &&code_LESS_EQUAL,
+            [ROP_ADD] = &&code_ADD,
+            [ROP_SUBTRACT] = &&code_SUBTRACT,
+            [ROP_MULTIPLY] = &&code_MULTIPLY,
+            [ROP_DIVIDE] = &&code_DIVIDE,
+            [ROP_EQUAL_K] = &&code_EQUAL_K,
+            [ROP_NOT_EQUAL_K] = &&code_NOT_EQUAL_K,
+            [ROP_GREATER_K] = &&code_GREATER_K,
+            [ROP_LESS_K] = &&code_LESS_K,
+            [ROP_GREATER_EQUAL_K] = &&code_GREATER_EQUAL_K,
+            [ROP_LESS_EQUAL_K] = &&code_LESS_EQUAL_K,
+            [ROP_ADD_K] = &&code_ADD_K,
+            [ROP_SUBTRACT_K] = &&code_SUBTRACT_K,
+            [ROP_MULTIPLY_K] = &&code_MULTIPLY_K,
+            [ROP_DIVIDE_K] = &&code_DIVIDE_K,
+            [ROP_NOT] = &&code_NOT,
+            [ROP_NEGATE] = &&code_NEGATE,
+            [ROP_PRINT] = &&code_PRINT,
+            [ROP_JUMP] = &&code_JUMP,
+            [ROP_JUMP_IF_FALSE] = &&code_JUMP_IF_FALSE,
+            [ROP_JUMP_IF_NOT_LESS] = &&code_JUMP_IF_NOT_LESS,
+            [ROP_JUMP_IF_NOT_LESS_K] = &&code_JUMP_IF_NOT_LESS_K,
+            [ROP_FOR_RANGE] = &&code_FOR_RANGE,
+            [ROP_FOR_RANGE_K] = &&code_FOR_RANGE_K,
+            [ROP_CALL] = &&code_CALL,
+            [ROP_TAIL_CALL] = &&code_TAIL_CALL,
+            [ROP_INVOKE] = &&code_INVOKE,
+            [ROP_SUPER_INVOKE] = &&code_SUPER_INVOKE,
+            [ROP_TAIL_INVOKE] = &&code_TAIL_INVOKE,
+            [ROP_TAIL_SUPER_INVOKE] = &&code_TAIL_SUPER_INVOKE,
+            [ROP_CLOSURE] = &&code_CLOSURE,
+            [ROP_CLOSE_UPVALUE] = &&code_CLOSE_UPVALUE,
+            [ROP_RETURN] = &&code_RETURN,
+            [ROP_CLASS] = &&code_CLASS,
+            [ROP_INHERIT] = &&code_INHERIT,
+            [ROP_METHOD] = &&code_METHOD
+        };
+
+        #define INTERPRET_LOOP  goto *dispatchTable[REG_OP(instruction = *pc++)];
+        #define CASE_CODE(name) code_##name
+        #define DISPATCH() \
+            do { \
+                TRACE_EXECUTION(); \
+                goto *dispatchTable[REG_OP(instruction = *pc++)]; \
+            } while (false)
+    #else
+        #define INTERPRET_LOOP  switch (REG_OP(instruction = *pc++))
+        #define CASE_CODE(name) case ROP_##name
+        #define DISPATCH() break
+    #endif
+
+    LOAD_FRAME();
+
+    for (;;) {
+        TRACE_EXECUTION();
+
+        uint32_t instruction;
+        INTERPRET_LOOP {
+            CASE_CODE(MOVE):          RA = RB; DISPATCH();
+            CASE_CODE(LOAD_CONSTANT): RA = KBX; DISPATCH();
+            CASE_CODE(NULL):          RA = NULL_VAL; DISPATCH();
+            CASE_CODE(TRUE):          RA = BOOL_VAL(true); DISPATCH();
+            CASE_CODE(FALSE):         RA = BOOL_VAL(false); DISPATCH();
+            CASE_CODE(GET_GLOBAL): {
+                Value value = vm.globalValues.values[REG_BX(instruction)];
+                if (IS_UNDEFINED(value)) {
+                    RUNTIME_ERROR("Undefined variable '%s'.", GLOBAL_NAME(REG_BX(instruction))->chars);
+                }
+                RA = value;
+                DISPATCH();
+            }
+            CASE_CODE(DEFINE_GLOBAL): {
+                vm.globalValues.values[REG_BX(instruction)] = RA;
+                DISPATCH();
+            }
+            CASE_CODE(SET_GLOBAL): {
+                if (IS_UNDEFINED(vm.globalValues.values[REG_BX(instruction)])) {
+                    RUNTIME_ERROR("Undefined variable '%s'.", GLOBAL_NAME(REG_BX(instruction))->chars);
+                }
+                vm.globalValues.values[REG_BX(instruction)] = RA;
+                DISPATCH();
+            }
+            CASE_CODE(GET_UPVALUE): {
+                RA = *frame->closure->upvalues[REG_B(instruction)]->location;
+                DISPATCH();
+            }
+            CASE_CODE(SET_UPVALUE): {
+                *frame->closure->upvalues[REG_B(instruction)]->location = RA;
+                DISPATCH();
+            }
+            CASE_CODE(GET_PROPERTY): {
+                if (!IS_INSTANCE(RA)) {
+                    RUNTIME_ERROR("Only class instances have properties that can be accessed.");
+                }
+
+                ObjInstance* instance = AS_INSTANCE(RA);
+                InlineCache* cache = READ_CACHE();
+
+                CacheEntry* entry = findCacheEntry(cache, instance);
+                if (entry != NULL && entry->method == NULL) {
+                    RA = *instanceField(instance, entry->slot);
+                    DISPATCH();
+                }
+
+                STORE_STATE();
+                vm.stackTop = &RA + 1;
+                if (!getProperty(instance, AS_STRING(KBX), cache, entry)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                vm.stackTop = registersTop;
+                DISPATCH();
+            }
+            CASE_CODE(SET_PROPERTY): {
+                if (!IS_INSTANCE(RA)) {
+                    RUNTIME_ERROR("Only instances have fields.");
+                }
+
+                ObjInstance* instance = AS_INSTANCE(RA);
+                Value value = slots[REG_A(instruction) + 1];
+                InlineCache* cache = READ_CACHE();
+
+                CacheEntry* entry = findCacheEntry(cache, instance);
+                if (entry != NULL) {
+                    if (!hasFieldStorage(instance, entry->slot)) reserveField(instance, entry->slot);
+                    *instanceField(instance, entry->slot) = value;
+                    if (entry->transition != NULL) instance->shape = entry->transition;
+                }
+                else {
+                    setProperty(instance, AS_STRING(KBX), value, cache);
+                }
+                RA = value;
+                DISPATCH();
+            }
+            CASE_CODE(GET_SUPER): {
+                ObjClass* superclass = AS_CLASS(slots[REG_A(instruction) + 1]);
+                STORE_STATE();
+                vm.stackTop = &RA + 1;
+                if (!bindMethod(superclass, AS_STRING(KBX))) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                vm.stackTop = registersTop;
+                DISPATCH();
+            }
+            CASE_CODE(EQUAL):           RA = BOOL_VAL(valuesEqual(RB, RC)); DISPATCH();
+            CASE_CODE(NOT_EQUAL):       RA = BOOL_VAL(!valuesEqual(RB, RC)); DISPATCH();
+            CASE_CODE(GREATER):         BINARY_OP(BOOL_VAL, >, RC); DISPATCH();
+            CASE_CODE(LESS):            BINARY_OP(BOOL_VAL, <, RC); DISPATCH();
+            CASE_CODE(GREATER_EQUAL):   BINARY_OP(BOOL_VAL, >=, RC); DISPATCH();
+            CASE_CODE(LESS_EQUAL):      BINARY_OP(BOOL_VAL, <=, RC); DISPATCH();
+            CASE_CODE(ADD):             ADD_OP(RC); DISPATCH();
+            CASE_CODE(SUBTRACT):        BINARY_OP(NUMBER_VAL, -, RC); DISPATCH();
+            CASE_CODE(MULTIPLY):        BINARY_OP(NUMBER_VAL, *, RC); DISPATCH();
+            CASE_CODE(DIVIDE):          BINARY_OP(NUMBER_VAL, /, RC); DISPATCH();
+            CASE_CODE(EQUAL_K):         RA = BOOL_VAL(valuesEqual(RB, KC)); DISPATCH();
+            CASE_CODE(NOT_EQUAL_K):     RA = BOOL_VAL(!valuesEqual(RB, KC)); DISPATCH();
+            CASE_CODE(GREATER_K):       BINARY_OP(BOOL_VAL, >, KC); DISPATCH();
+            CASE_CODE(LESS_K):          BINARY_OP(BOOL_VAL, <, KC); DISPATCH();
+            CASE_CODE(GREATER_EQUAL_K): BINARY_OP(BOOL_VAL, >=, KC); DISPATCH();
+            CASE_CODE(LESS_EQUAL_K):    BINARY_OP(BOOL_VAL, <=, KC); DISPATCH();
+            CASE_CODE(ADD_K):           ADD_OP(KC); DISPATCH();
+            CASE_CODE(SUBTRACT_K):      BINARY_OP(NUMBER_VAL, -, KC); DISPATCH();
+            CASE_CODE(MULTIPLY_K):      BINARY_OP(NUMBER_VAL, *, KC); DISPATCH();
+            CASE_CODE(DIVIDE_K):        BINARY_OP(NUMBER_VAL, /, KC); DISPATCH();
+            CASE_CODE(NOT):             RA = BOOL_VAL(isFalsey(RB)); DISPATCH();
+            CASE_CODE(NEGATE): {
+                if (!IS_NUMBER(RB)) {
+                    RUNTIME_ERROR("Operand must be a number.");
+                }
+                RA = NUMBER_VAL(-AS_NUMBER(RB));
+                DISPATCH();
+            }
+            CASE_CODE(PRINT): {
+                printValue(RA);
+                printf("\n");
+                DISPATCH();
+            }
+            CASE_CODE(JUMP): {
+                pc += REG_SBX(instruction);
+                DISPATCH();
+            }
+            CASE_CODE(JUMP_IF_FALSE): {
+                if (isFalsey(RA)) pc += REG_SBX(instruction);
+                DISPATCH();
+            }
+            CASE_CODE(JUMP_IF_NOT_LESS):   LESS_JUMP(RC); DISPATCH();
+            CASE_CODE(JUMP_IF_NOT_LESS_K): LESS_JUMP(KC); DISPATCH();
+            CASE_CODE(FOR_RANGE):          FOR_RANGE(RC); DISPATCH();
+            CASE_CODE(FOR_RANGE_K):        FOR_RANGE(KC); DISPATCH();
+            CASE_CODE(CALL): {
+                int argCount = REG_B(instruction);
+                STORE_STATE();
+                vm.stackTop = &RA + argCount + 1;
+                if (!callValue(RA, argCount)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                LOAD_FRAME();
+                DISPATCH();
+            }
+            CASE_CODE(TAIL_CALL): {
+                int argCount = REG_B(instruction);
+                STORE_STATE();
+                vm.stackTop = &RA + argCount + 1;
+                if (!tailCall(&RA, argCount)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                LOAD_FRAME();
+                DISPATCH();
+            }
+            CASE_CODE(INVOKE): {
+                int argCount = REG_B(instruction);
+                InlineCache* cache = READ_CACHE();
+                STORE_STATE();
+                vm.stackTop = &RA + argCount + 1;
+                if (!invoke(AS_STRING(KC), argCount, cache, false)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                LOAD_FRAME();
+                DISPATCH();
+            }
+            CASE_CODE(SUPER_INVOKE): {
+                int argCount = REG_B(instruction);
+                ObjClass* superclass = AS_CLASS((&RA)[argCount + 1]);
+                STORE_STATE();
+                vm.stackTop = &RA + argCount + 1;
+                if (!invokeFromClass(superclass, AS_STRING(KC), argCount, false)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                LOAD_FRAME();
+                DISPATCH();
+            }
+            CASE_CODE(TAIL_INVOKE): {
+                int argCount = REG_B(instruction);
+                InlineCache* cache = READ_CACHE();
+                STORE_STATE();
+                vm.stackTop = &RA + argCount + 1;
+                if (!invoke(AS_STRING(KC), argCount, cache, true)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                LOAD_FRAME();
+                DISPATCH();
+            }
+            CASE_CODE(TAIL_SUPER_INVOKE): {
+                int argCount = REG_B(instruction);
+                ObjClass* superclass = AS_CLASS((&RA)[argCount + 1]);
+                STORE_STATE();
+                vm.stackTop = &RA + argCount + 1;
+                if (!invokeFromClass(superclass, AS_STRING(KC), argCount, true)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                LOAD_FRAME();
+                DISPATCH();
+            }
+            CASE_CODE(CLOSURE): {
+                ObjFunction* function = AS_FUNCTION(KBX);
+                ObjClosure* closure = newClosure(function);
+                RA = OBJ_VAL(closure);
+                for (int i = 0; i < closure->upvalueCount; i++) {
+                    uint32_t upvalue = *pc++;
+                    if (REG_A(upvalue)) {
+                        closure->upvalues[i] = captureUpvalue(slots + REG_B(upvalue));
+                    } else {
+                        closure->upvalues[i] = frame->closure->upvalues[REG_B(upvalue)];
+                    }
+                }
+                DISPATCH();
+            }
+            CASE_CODE(CLOSE_UPVALUE): {
+                closeUpvalues(&RA);
+                DISPATCH();
+            }
+            CASE_CODE(RETURN): {
+                Value result = RA;
+                closeUpvalues(slots);
+                vm.frameCount--;
+                if (vm.frameCount == baseFrame) {
+                    slots[0] = result;
+                    vm.stackTop = slots + 1;
+                    return INTERPRET_OK;
+                }
+
+                slots[0] = result;
+                LOAD_FRAME();
+                DISPATCH();
+            }
+            CASE_CODE(CLASS): {
+                RA = OBJ_VAL(newClass(AS_STRING(KBX)));
+                DISPATCH();
+            }
+            CASE_CODE(INHERIT): {
+                Value superclass = RA;
+                if (!IS_CLASS(superclass)) {
+                    RUNTIME_ERROR("Superclass must be a class. The superclass being used inheriting from isn't actually a class.");
+                }
+
+                ObjClass* subclass = AS_CLASS(slots[REG_A(instruction) + 1]);
+                inheritMethods(subclass, AS_CLASS(superclass));
+                invalidateInlineCaches(subclass);
+                DISPATCH();
+            }
+            CASE_CODE(METHOD): {
+                setMethod(AS_CLASS(RA), methodSelector(AS_STRING(KBX)), AS_CLOSURE(slots[REG_A(instruction) + 1]));
+                invalidateInlineCaches(AS_CLASS(RA));
+                DISPATCH();
+            }
+        }
+    }
+
+    #undef LOAD_FRAME
+    #undef STORE_STATE
+    #undef RUNTIME_ERROR
+    #undef RA
+    #undef RB
+    #undef RC
+    #undef KC
+    #undef READ_CACHE
+    #undef KBX
+    #undef BINARY_OP
+    #undef ADD_OP
+    #undef LESS_JUMP
+    #undef FOR_RANGE
+    #undef TRACE_EXECUTION
+    #undef INTERPRET_LOOP
+    #undef CASE_CODE
+    #undef DISPATCH
 }
 
 void push(Value value) {
@@ -444,22 +1436,94 @@ static Value peek(int distance) {
     return vm.stackTop[-1 - distance];
 }
 
-static bool call(ObjClosure* closure, int argCount) {
+/**
+ * Grows the call frames and the value stack so that one more frame fits and the stack
+ * holds stackSize values. The stack may move, so the frames' slots, the open upvalues
+ * and vm.stackTop are moved along with it.
+*/
+static bool growStacks(int stackSize) {
+    if (vm.frameCount == FRAMES_MAX || stackSize > STACK_MAX) {
+        runtimeError("Stack overflow.");
+        return false;
+    }
+
+    if (vm.frameCount == vm.frameCapacity) {
+        int oldCapacity = vm.frameCapacity;
+        vm.frameCapacity = GROW_CAPACITY(oldCapacity);
+        vm.frames = GROW_ARRAY(CallFrame, vm.frames, oldCapacity, vm.frameCapacity);
+    }
+
+    if (stackSize > vm.stackCapacity) {
+        int oldCapacity = vm.stackCapacity;
+        int capacity = oldCapacity;
+        while (capacity < stackSize) capacity = GROW_CAPACITY(capacity);
+        if (capacity > STACK_MAX) capacity = STACK_MAX;
+
+        Value* oldStack = vm.stack;
+        vm.stack = GROW_ARRAY(Value, vm.stack, oldCapacity, capacity);
+        vm.stackCapacity = capacity;
+        if (vm.stack != oldStack) {
+            vm.stackTop = vm.stack + (vm.stackTop - oldStack);
+            for (int i = 0; i < vm.frameCount; i++) {
+                vm.frames[i].slots = vm.stack + (vm.frames[i].slots - oldStack);
+            }
+            for (ObjUpvalue* upvalue = vm.openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
+                upvalue->location = vm.stack + (upvalue->location - oldStack);
+            }
+        }
+    }
+    return true;
+}
+
+/**
+ * Sets up the frame of a call of closure, whose arguments are on top of the stack,
+ * without running anything.
+*/
+static bool pushFrame(ObjClosure* closure, int argCount) {
      if (argCount != closure->function->arity) {
         runtimeError("Expected %d arguments but got %d.",
             closure->function->arity, argCount);
         return false;
     }
 
-    if (vm.frameCount == FRAMES_MAX) {
-        runtimeError("Stack overflow.");
-        return false;
+    // The one overflow check of a call: the frame and every value the callee can
+    // push have to fit.
+    RegisterCode* registers = &closure->function->chunk.registers;
+    bool onRegisters = onRegisterEngine(closure->function);
+    int frameSize = onRegisters ? registers->frameSize : closure->function->maxStack;
+    int stackSize = (int)(vm.stackTop - vm.stack) - argCount - 1 + frameSize + STACK_SLACK;
+    if (vm.frameCount == vm.frameCapacity || stackSize > vm.stackCapacity) {
+        if (!growStacks(stackSize)) return false;
     }
 
+    Value* slots = vm.stackTop - argCount - 1;
+
     CallFrame* frame = &vm.frames[vm.frameCount++];
     frame->closure = closure;
     frame->ip = closure->function->chunk.code;
-    frame->slots = vm.stackTop - argCount - 1;
+    frame->pc = registers->code;
+    frame->slots = slots;
+
+    if (onRegisters) {
+        // The registers above the arguments still hold whatever an earlier call left
+        // there, which the GC may already have freed, and they are all roots from now on.
+        for (Value* slot = vm.stackTop; slot < slots + registers->frameSize; slot++) {
+            *slot = NULL_VAL;
+        }
+        vm.stackTop = slots + registers->frameSize;
+    }
+    return true;
+}
+
+static bool call(ObjClosure* closure, int argCount) {
+    if (!pushFrame(closure, argCount)) return false;
+
+    // A callee that runs on the other engine than its caller is run to the end by a
+    // run loop of its own, so to the caller it looks like a native call.
+    if (vm.frameCount > 1 && onRegisterEngine(closure->function) !=
+        onRegisterEngine(vm.frames[vm.frameCount - 2].closure->function)) {
+        return runFrom(vm.frameCount - 1) == INTERPRET_OK;
+    }
     return true;
 }
 
@@ -474,9 +1538,9 @@ static bool callValue(Value callee, int argCount) {
             case OBJ_CLASS: {
                 ObjClass* Class = AS_CLASS(callee);
                 vm.stackTop[-argCount - 1] = OBJ_VAL(newInstance(Class));
-                Value initializer;
-                if (tableGet(&Class->methods, vm.initString, &initializer)) {
-                    return call(AS_CLOSURE(initializer), argCount);
+                ObjClosure* initializer = findMethod(Class, vm.initString);
+                if (initializer != NULL) {
+                    return call(initializer, argCount);
                 }
                 else if (argCount != 0) {
                     runtimeError("Expected 0 arguments but got %d.", argCount);
@@ -489,6 +1553,8 @@ static bool callValue(Value callee, int argCount) {
             case OBJ_NATIVE: {
                 NativeFn native = AS_NATIVE(callee);
                 Value result = native(argCount, vm.stackTop - argCount);
+                // A native that failed has already reported the error.
+                if (IS_UNDEFINED(result)) return false;
                 vm.stackTop -= argCount + 1;
                 push(result);
                 return true;
@@ -501,19 +1567,102 @@ static bool callValue(Value callee, int argCount) {
     return false;
 }
 
+/**
+ * Calls the callee at callee, with the argCount arguments above it, in place of the
+ * current frame. Anything other than a closure or bound method is called normally.
+ * The OP_RETURN that always follows a tail call then returns its result.
+*/
+static bool tailCall(Value* callee, int argCount) {
+    if (IS_BOUND_METHOD(*callee)) {
+        ObjBoundMethod* bound = AS_BOUND_METHOD(*callee);
+        *callee = bound->receiver;
+        return tailCallClosure(bound->method, callee, argCount);
+    }
+    if (IS_CLOSURE(*callee)) return tailCallClosure(AS_CLOSURE(*callee), callee, argCount);
+    return callValue(*callee, argCount);
+}
+
+/**
+ * Calls closure in place of the current frame, with callee holding its function or
+ * receiver and the argCount arguments above it: the frame's upvalues are closed, the
+ * callee and its arguments slide down over the frame's slots and the new call takes
+ * over the frame. A closure that runs on the other engine than the current frame is
+ * called normally.
+*/
+static bool tailCallClosure(ObjClosure* closure, Value* callee, int argCount) {
+    if (onRegisterEngine(closure->function) != onRegisterEngine(vm.frames[vm.frameCount - 1].closure->function)) {
+        return call(closure, argCount);
+    }
+    // Checked while the caller's frame is still there to show up in the stack trace.
+    if (argCount != closure->function->arity) {
+        runtimeError("Expected %d arguments but got %d.",
+            closure->function->arity, argCount);
+        return false;
+    }
+
+    Value* slots = vm.frames[vm.frameCount - 1].slots;
+    closeUpvalues(slots);
+    memmove(slots, callee, sizeof(Value) * (argCount + 1));
+    vm.stackTop = slots + argCount + 1;
+    vm.frameCount--;
+    // The new frame runs in the loop that ran the old one.
+    return pushFrame(closure, argCount);
+}
+
 /**
  * Looks up method name in the class's method table and reports an error if the method cannot be found.
+ * A tail invoke calls the method in place of the current frame.
  */
-static bool invokeFromClass(ObjClass* Class, ObjString* name, int argCount) {
-    Value method;
-    if (!tableGet(&Class->methods, name, &method)) {
+static bool invokeFromClass(ObjClass* Class, ObjString* name, int argCount, bool tail) {
+    ObjClosure* method = findMethod(Class, name);
+    if (method == NULL) {
         runtimeError("Undefined property (Undefined method) '%s' for specified class", name->chars);
         return false;
     }
-    return call(AS_CLOSURE(method), argCount);
+    if (tail) return tailCallClosure(method, vm.stackTop - argCount - 1, argCount);
+    return call(method, argCount);
+}
+
+/**
+ * Records what a lookup on a receiver with the given class and shape found. A site
+ * that sees more receivers than its cache holds goes megamorphic and stops caching.
+*/
+static void addCacheEntry(InlineCache* cache, ObjClass* Class, ObjShape* shape, int slot,
+                          ObjShape* transition, ObjClosure* method) {
+    if (cache->count == INLINE_CACHE_MEGAMORPHIC) return;
+    if (cache->count == INLINE_CACHE_ENTRIES) {
+        cache->count = INLINE_CACHE_MEGAMORPHIC;
+        return;
+    }
+
+    CacheEntry* entry = &cache->entries[cache->count++];
+    entry->Class = Class;
+    entry->shape = shape;
+    entry->transition = transition;
+    entry->method = method;
+    entry->slot = slot;
+    Class->cached = true;
+}
+
+/**
+ * Empties every inline cache once the method table of a class that some cache has
+ * an entry for changes. Method tables only change while a class declaration runs,
+ * so this almost never has anything to do.
+*/
+static void invalidateInlineCaches(ObjClass* Class) {
+    if (!Class->cached) return;
+
+    for (Obj* object = vm.objects; object != NULL; object = object->next) {
+        if (object->type == OBJ_FUNCTION) {
+            resetInlineCaches(&((ObjFunction*)object)->chunk);
+        }
+        else if (object->type == OBJ_CLASS) {
+            ((ObjClass*)object)->cached = false;
+        }
+    }
 }
 
-static bool invoke(ObjString* name, int argCount) {
+static bool invoke(ObjString* name, int argCount, InlineCache* cache, bool tail) {
     Value receiver = peek(argCount);
     if (!IS_INSTANCE(receiver)) {
         runtimeError("Only class instances have methods. Called a method on the wrong object or type.");
@@ -522,23 +1671,88 @@ static bool invoke(ObjString* name, int argCount) {
 
     ObjInstance* instance = AS_INSTANCE(receiver);
 
-    Value value;
-    if (tableGet(&instance->fields, name, &value)) {
-        vm.stackTop[-argCount - 1] = value;
-        return callValue(value, argCount);
+    ObjClosure* method;
+    int slot;
+    CacheEntry* entry = findCacheEntry(cache, instance);
+    if (entry != NULL) {
+        method = entry->method;
+        slot = entry->slot;
+    }
+    else {
+        // A field holding something callable shadows a method of the same name.
+        slot = shapeSlot(instance->shape, name);
+        method = NULL;
+        if (slot == -1) {
+            method = findMethod(instance->Class, name);
+            if (method == NULL) {
+                runtimeError("Undefined property (Undefined method) '%s' for specified class", name->chars);
+                return false;
+            }
+        }
+        addCacheEntry(cache, instance->Class, instance->shape, slot, NULL, method);
+    }
+
+    Value* callee = vm.stackTop - argCount - 1;
+    if (method != NULL) {
+        return tail ? tailCallClosure(method, callee, argCount) : call(method, argCount);
     }
 
-    return invokeFromClass(instance->Class, name, argCount);
+    *callee = *instanceField(instance, slot);
+    return tail ? tailCall(callee, argCount) : callValue(*callee, argCount);
+}
+
+/**
+ * Finishes a property read that the inline cache couldn't answer with a field. It
+ * binds the cached method, or looks the property up and caches what it finds.
+ * The instance is on top of the stack and gets replaced with the result.
+*/
+static bool getProperty(ObjInstance* instance, ObjString* name, InlineCache* cache, CacheEntry* entry) {
+    ObjClosure* method;
+    if (entry != NULL) {
+        method = entry->method;
+    }
+    else {
+        int slot = shapeSlot(instance->shape, name);
+        if (slot != -1) {
+            addCacheEntry(cache, instance->Class, instance->shape, slot, NULL, NULL);
+            vm.stackTop[-1] = *instanceField(instance, slot);
+            return true;
+        }
+
+        method = findMethod(instance->Class, name);
+        if (method == NULL) {
+            runtimeError("Undefined property (The called method does not exist!) '%s'.", name->chars);
+            return false;
+        }
+        addCacheEntry(cache, instance->Class, instance->shape, -1, NULL, method);
+    }
+
+    ObjBoundMethod* bound = newBoundMethod(peek(0), method);
+    pop();
+    push(OBJ_VAL(bound));
+    return true;
+}
+
+/**
+ * Stores a field that the inline cache had no entry for and caches where it went,
+ * along with the shape the instance moved to if the field is new.
+*/
+static void setProperty(ObjInstance* instance, ObjString* name, Value value, InlineCache* cache) {
+    ObjShape* shape = instance->shape;
+    setField(instance, name, value);
+
+    ObjShape* transition = instance->shape != shape ? instance->shape : NULL;
+    addCacheEntry(cache, instance->Class, shape, shapeSlot(instance->shape, name), transition, NULL);
 }
 
 static bool bindMethod(ObjClass* Class, ObjString* name) {
-    Value method;
-    if (!tableGet(&Class->methods, name, &method)) {
+    ObjClosure* method = findMethod(Class, name);
+    if (method == NULL) {
         runtimeError("Undefined property (The called method does not exist!) '%s'.", name->chars);
         return false;
     }
 
-    ObjBoundMethod* bound = newBoundMethod(peek(0), AS_CLOSURE(method));
+    ObjBoundMethod* bound = newBoundMethod(peek(0), method);
     pop();
     push(OBJ_VAL(bound));
     return true;
@@ -578,9 +1792,10 @@ static void closeUpvalues(Value* last) {
 }
 
 static void defineMethod(ObjString* name) {
-    Value method = peek(0);
+    ObjClosure* method = AS_CLOSURE(peek(0));
     ObjClass* Class = AS_CLASS(peek(1));
-    tableSet(&Class->methods, name, method);
+    setMethod(Class, methodSelector(name), method);
+    invalidateInlineCaches(Class);
     pop();
 }
 
@@ -594,19 +1809,23 @@ static bool isFalsey(Value value) {
  * Combines two strings together.
 */
 static void concatenate() {
-    ObjString* b = AS_STRING(peek(0));
-    ObjString* a = AS_STRING(peek(1));
+    ObjString* result = concatenateStrings(AS_STRING(peek(1)), AS_STRING(peek(0)));
+    pop();
+    pop();
+    push(OBJ_VAL(result));
+}
 
+/**
+ * Returns a new string of a followed by b. The caller keeps both reachable.
+*/
+ObjString* concatenateStrings(ObjString* a, ObjString* b) {
     int length = a->length + b->length;
     char* chars = ALLOCATE(char, length + 1);
     memcpy(chars, a->chars, a->length);
     memcpy(chars + a->length, b->chars, b->length);
     chars[length] = '\0';
 
-    ObjString* result = takeString(chars, length);
-    pop();
-    pop();
-    push(OBJ_VAL(result));
+    return takeString(chars, length);
 }
 
 // This took in a Chunk before, now it'll take in a string of source code
@@ -614,11 +1833,52 @@ InterpretResult interpret(const char* source) {
     ObjFunction* function = compile(source);
     if (function == NULL) return INTERPRET_COMPILE_ERROR;
 
+    return interpretFunction(function);
+}
+
+/**
+ * Runs the script function of an already compiled program, such as one that
+ * loadBytecodeFile() rebuilt from a bytecode file.
+*/
+InterpretResult interpretFunction(ObjFunction* function) {
     push(OBJ_VAL(function));
     ObjClosure* closure = newClosure(function);
     pop();
     push(OBJ_VAL(closure));
-    call(closure, 0);
 
-    return run();
+    InterpretResult result = runClosure(closure, 0);
+    if (result == INTERPRET_OK) pop();
+    return result;
+}
+
+/**
+ * Calls closure, which sits on the stack below its argCount arguments, and runs it until
+ * it returns. Its result is left on the stack in its place, like after any other call.
+*/
+InterpretResult runClosure(ObjClosure* closure, int argCount) {
+    int baseFrame = vm.frameCount;
+    if (!call(closure, argCount)) return INTERPRET_RUNTIME_ERROR;
+    // A callee on the other engine than the running frame has already run.
+    if (vm.frameCount == baseFrame) return INTERPRET_OK;
+    return runFrom(baseFrame);
+}
+
+/**
+ * Calls whatever sits on the stack below the argCount arguments on top of it, the way
+ * a call expression would, while no code is running. Its result is left in its place.
+*/
+InterpretResult runCall(int argCount) {
+    int baseFrame = vm.frameCount;
+    if (!callValue(vm.stackTop[-1 - argCount], argCount)) return INTERPRET_RUNTIME_ERROR;
+    // Natives and classes without an initializer are done without pushing a frame.
+    if (vm.frameCount == baseFrame) return INTERPRET_OK;
+    return runFrom(baseFrame);
+}
+
+/**
+ * Runs the frame at baseFrame, and everything it calls, on the engine of its function
+ * until it returns.
+*/
+static InterpretResult runFrom(int baseFrame) {
+    return onRegisterEngine(vm.frames[baseFrame].closure->function) ? runRegisters(baseFrame) : run(baseFrame);
 }
@@ -5,26 +5,48 @@
 #include "table.h"
 #include "value.h"
 
-#define FRAMES_MAX 64
+// The call frames and the value stack start out small and double whenever a call
+// needs more room, up to these limits.
+#define FRAMES_INITIAL 8
+#define FRAMES_MAX (1 << 16)
+#define STACK_INITIAL UINT8_COUNT
 #define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+// Room kept above every frame for the values the VM's helpers push while they allocate.
+#define STACK_SLACK 4
 
 typedef struct {
     ObjClosure* closure;
-    uint8_t* ip;
+    uint32_t* ip;
+    uint32_t* pc;   // Instruction pointer into the register code, used instead of ip by runRegisters()
     Value* slots;
 } CallFrame;
 
 typedef struct {
-    CallFrame frames[FRAMES_MAX];
+    CallFrame* frames;
     int frameCount;
+    int frameCapacity;
 
-    Value stack[STACK_MAX];
+    // call() makes sure the callee's maxStack (frameSize on the register engine) fits,
+    // so pushes never have to check. Growing can move the stack, which is why the
+    // interpreter loops reload their stack pointers after every call.
+    Value* stack;
     Value* stackTop;
-    Table globals;
+    int stackCapacity;
+    // Globals live in a dense array. The compiler resolves every global name to its
+    // index through globalSlots, and a slot holds UNDEFINED_VAL until the global is defined.
+    // globalNames holds the name of each slot for error messages.
+    Table globalSlots;
+    ValueArray globalNames;
+    ValueArray globalValues;
     Table strings;
     Table lists;
+    // Method name of every selector id, which also keeps those strings alive.
+    ValueArray selectorNames;
     ObjString* initString;
+    ObjShape* emptyShape;
     ObjUpvalue* openUpvalues;
+    // Values that the program embedding the VM holds on to (see embed.h).
+    ValueArray hostRoots;
 
     size_t bytesAllocated;
     size_t nextGC;
@@ -32,6 +54,10 @@ typedef struct {
     int grayCount;
     int grayCapacity;
     Obj** grayStack;
+
+    // Set once at startup: functions are also compiled to register code and
+    // interpret() executes that instead of the stack code, where there is any.
+    bool registerEngine;
 } VM;
 
 typedef enum {
@@ -40,11 +66,35 @@ typedef enum {
     INTERPRET_RUNTIME_ERROR
 } InterpretResult;
 
-extern VM vm;
+extern THREAD_LOCAL VM vm;
+
+#define GLOBAL_NAME(slot) AS_STRING(vm.globalNames.values[slot])
+
+/**
+ * Whether calls of function run on runRegisters() rather than run(). A function that
+ * the register translator couldn't handle stays on the stack engine.
+*/
+static inline bool onRegisterEngine(ObjFunction* function) {
+    return vm.registerEngine && !function->stackOnly;
+}
 
 void initVM();
 void freeVM();
 InterpretResult interpret(const char* source);
+InterpretResult interpretFunction(ObjFunction* function);
+InterpretResult runClosure(ObjClosure* closure, int argCount);
+InterpretResult runCall(int argCount);
+/**
+ * Reports a runtime error with a stack trace. A native that calls it must then return
+ * UNDEFINED_VAL, which makes the call fail.
+*/
+void runtimeError(const char* format, ...);
+/**
+ * Returns a new string of a followed by b. The caller keeps both reachable.
+*/
+ObjString* concatenateStrings(ObjString* a, ObjString* b);
+int globalSlot(ObjString* name);
+int methodSelector(ObjString* name);
 void push(Value value);
 Value pop();
 